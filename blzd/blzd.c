@@ -0,0 +1,711 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * blzd - share BLE links between local processes
+ *
+ * The daemon owns all connections and notification subscriptions. Handles
+ * of all clients to the same characteristic share one StartNotify, every
+ * notification is received from the bus once and copied once into the
+ * event ring of each subscribed client. See blzd_proto.h for the protocol.
+ *
+ * Devices are connected asynchronously: an open command waits for the
+ * connection of its device together with all other opens of the same device,
+ * while the commands of all clients are served. Writes and notification
+ * starts and stops are asynchronous too, their results are sent when BlueZ
+ * answered. Only the service and characteristic lookups after connecting are
+ * synchronous, they are local calls to bluetoothd which don't wait for the
+ * device.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "blzd_proto.h"
+#include "blzlib.h"
+#include "blzlib_log.h"
+
+#define MAX_CLIENTS		 64
+#define OPEN_DEADLINE_MS 50000 /* clients wait 60 s for the result */
+
+struct blzd_client;
+
+/* open command waiting for its device to be connected */
+struct blzd_open {
+	struct blzd_open* next;
+	struct blzd_client* cl;
+	uint32_t tag;
+	char serv[BLZD_UUID_LEN];
+	char uuid[BLZD_UUID_LEN];
+};
+
+struct blzd_dev {
+	struct blzd_dev* next;
+	char mac[BLZD_MAC_LEN];
+	blz_dev* dev;
+	blz_conn_req* req; /* while connecting */
+	bool connecting;
+	struct blzd_open* opens; /* waiting for the connection */
+	unsigned int refs;		 /* open characteristics */
+};
+
+struct blzd_char {
+	struct blzd_char* next;
+	struct blzd_client* cl;
+	uint32_t handle;
+	struct blzd_dev* dev;
+	blz_serv* srv;
+	blz_char* ch;
+	bool notifying;
+};
+
+struct blzd_client {
+	struct blzd_client* next;
+	int fd;
+	struct blzd_shm* shm;
+	struct blzd_ring_ref ev;
+	struct blzd_ring_ref cmd;
+	struct blzd_char* chars;
+	uint32_t next_handle;
+	bool closing;
+};
+
+/* command in flight, the client may go away before it completes */
+struct blzd_req {
+	struct blzd_char* c;
+	uint32_t tag;
+};
+
+static blz_ctx* ctx;
+static struct blzd_dev* devs;
+static struct blzd_client* clients;
+static int nclients;
+static volatile sig_atomic_t running = 1;
+
+static void kick(struct blzd_client* cl)
+{
+	char b = 0;
+	/* EAGAIN means a wakeup is pending already */
+	send(cl->fd, &b, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void ev_push(struct blzd_client* cl, uint16_t type, const void* hdr,
+					size_t hlen, const void* data, size_t dlen)
+{
+	bool was_empty;
+
+	if (cl->closing) {
+		return;
+	}
+	if (!blzd_ring_push(&cl->ev, type, hdr, hlen, data, dlen, &was_empty)) {
+		LOG_WARN("blzd: Client %d event ring full", cl->fd);
+		return;
+	}
+	if (was_empty) {
+		kick(cl);
+	}
+}
+
+static void result(struct blzd_client* cl, uint32_t tag, uint32_t handle,
+				   blz_ret ret)
+{
+	struct blzd_ev_result res = {.tag = tag, .handle = handle, .ret = ret};
+	ev_push(cl, BLZD_EV_RESULT, &res, sizeof(res), NULL, 0);
+}
+
+/* free the device when neither characteristics nor opens are left */
+static void dev_check(struct blzd_dev* d)
+{
+	if (d->refs > 0 || d->opens != NULL) {
+		return;
+	}
+
+	for (struct blzd_dev** p = &devs; *p != NULL; p = &(*p)->next) {
+		if (*p == d) {
+			*p = d->next;
+			break;
+		}
+	}
+
+	if (d->req != NULL) {
+		LOG_INF("blzd: Cancelling connect to %s", d->mac);
+		blz_connect_cancel(d->req);
+	} else if (d->dev != NULL) {
+		LOG_INF("blzd: Disconnecting %s", d->mac);
+		blz_disconnect(d->dev);
+	}
+	free(d);
+}
+
+static void dev_put(struct blzd_dev* d)
+{
+	d->refs--;
+	dev_check(d);
+}
+
+/* look up service and characteristic of a connected device */
+static void open_finish(struct blzd_dev* d, struct blzd_client* cl,
+						uint32_t tag, const char* serv, const char* uuid)
+{
+	struct blzd_char* c = calloc(1, sizeof(struct blzd_char));
+	if (c == NULL) {
+		result(cl, tag, 0, BLZ_ERR);
+		return;
+	}
+
+	c->dev = d;
+	d->refs++;
+	c->srv = blz_get_serv_from_uuid(d->dev, serv);
+	c->ch = c->srv != NULL ? blz_get_char_from_uuid(c->srv, uuid) : NULL;
+	if (c->ch == NULL) {
+		blz_serv_free(c->srv);
+		dev_put(d);
+		free(c);
+		result(cl, tag, 0, BLZ_ERR_INVALID_PARAM);
+		return;
+	}
+
+	c->cl = cl;
+	c->handle = ++cl->next_handle;
+	c->next = cl->chars;
+	cl->chars = c;
+	result(cl, tag, c->handle, BLZ_OK);
+}
+
+static void dev_connect_cb(blz_dev* dev, blz_ret ret,
+						   const struct blz_connect_info* info, void* user)
+{
+	struct blzd_dev* d = user;
+	struct blzd_open* o = d->opens;
+
+	d->connecting = false;
+	d->req = NULL;
+	d->dev = dev;
+	d->opens = NULL;
+
+	if (ret != BLZ_OK) {
+		LOG_INF("blzd: Connecting %s failed: %s", d->mac, blz_errstr(ret));
+	}
+
+	/* keep the device while the opens are finished, failed lookups may
+	 * drop their reference */
+	d->refs++;
+	while (o != NULL) {
+		struct blzd_open* next = o->next;
+		if (ret == BLZ_OK) {
+			open_finish(d, o->cl, o->tag, o->serv, o->uuid);
+		} else {
+			result(o->cl, o->tag, 0, ret);
+		}
+		free(o);
+		o = next;
+	}
+	dev_put(d);
+}
+
+/* remove the opens of a client which goes away */
+static void devs_drop_opens(struct blzd_client* cl)
+{
+	struct blzd_dev* d = devs;
+
+	while (d != NULL) {
+		struct blzd_dev* next = d->next;
+		struct blzd_open** p = &d->opens;
+		while (*p != NULL) {
+			struct blzd_open* o = *p;
+			if (o->cl == cl) {
+				*p = o->next;
+				free(o);
+			} else {
+				p = &o->next;
+			}
+		}
+		dev_check(d);
+		d = next;
+	}
+}
+
+static struct blzd_char* char_find(struct blzd_client* cl, uint32_t handle)
+{
+	for (struct blzd_char* c = cl->chars; c != NULL; c = c->next) {
+		if (c->handle == handle) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static void char_close(struct blzd_char* c)
+{
+	struct blzd_client* cl = c->cl;
+
+	for (struct blzd_char** p = &cl->chars; *p != NULL; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+
+	/* stops notifications if no other client uses them and fails writes
+	 * in flight, which is why the char is unlinked before */
+	blz_char_free(c->ch);
+	blz_serv_free(c->srv);
+	dev_put(c->dev);
+	free(c);
+}
+
+static void notify_cb(const uint8_t* data, size_t len,
+					  const struct blz_notify_info* info, blz_char* ch,
+					  void* user)
+{
+	struct blzd_char* c = user;
+	struct blzd_ev_notify ev = {
+		.ts = info->ts,
+		.handle = c->handle,
+		.seq = info->seq,
+		.lost = info->lost,
+		.dropped = atomic_load_explicit(&c->cl->shm->ev.dropped,
+										memory_order_relaxed),
+	};
+
+	ev_push(c->cl, BLZD_EV_NOTIFY, &ev, sizeof(ev), data,
+			len > BLZD_MAX_DATA ? BLZD_MAX_DATA : len);
+}
+
+static void req_cb(blz_ret ret, const uint8_t* data, size_t len,
+				   blz_char* ch, void* user)
+{
+	struct blzd_req* r = user;
+	result(r->c->cl, r->tag, r->c->handle, ret);
+	free(r);
+}
+
+static void notify_start_cb(blz_ret ret, const uint8_t* data, size_t len,
+							blz_char* ch, void* user)
+{
+	struct blzd_req* r = user;
+	if (ret != BLZ_OK) {
+		r->c->notifying = false;
+	}
+	result(r->c->cl, r->tag, r->c->handle, ret);
+	free(r);
+}
+
+static void cmd_open(struct blzd_client* cl, const struct blzd_cmd_open* cmd)
+{
+	struct blzd_open* o = calloc(1, sizeof(struct blzd_open));
+	struct blzd_dev* d;
+	char mac[BLZD_MAC_LEN];
+
+	if (o == NULL) {
+		result(cl, cmd->tag, 0, BLZ_ERR);
+		return;
+	}
+
+	/* strings in shared memory may be changed by the client any time */
+	memcpy(mac, cmd->mac, sizeof(mac));
+	memcpy(o->serv, cmd->serv, sizeof(o->serv));
+	memcpy(o->uuid, cmd->uuid, sizeof(o->uuid));
+	mac[sizeof(mac) - 1] = '\0';
+	o->serv[sizeof(o->serv) - 1] = '\0';
+	o->uuid[sizeof(o->uuid) - 1] = '\0';
+	o->cl = cl;
+	o->tag = cmd->tag;
+
+	for (d = devs; d != NULL; d = d->next) {
+		if (strcasecmp(d->mac, mac) == 0) {
+			break;
+		}
+	}
+
+	if (d != NULL && !d->connecting) {
+		open_finish(d, cl, o->tag, o->serv, o->uuid);
+		free(o);
+		return;
+	}
+
+	/* join the connection in progress */
+	if (d != NULL) {
+		o->next = d->opens;
+		d->opens = o;
+		return;
+	}
+
+	d = calloc(1, sizeof(struct blzd_dev));
+	if (d == NULL) {
+		free(o);
+		result(cl, cmd->tag, 0, BLZ_ERR);
+		return;
+	}
+
+	strncpy(d->mac, mac, BLZD_MAC_LEN - 1);
+	d->opens = o;
+	d->next = devs;
+	devs = d;
+
+	/* the handler may be called right away when the request fails, the
+	 * reference keeps the device until we are done here */
+	LOG_INF("blzd: Connecting %s", mac);
+	d->connecting = true;
+	d->refs++;
+	blz_conn_req* req
+		= blz_connect_async(ctx, mac, cmd->atype, BLZ_PRIO_CONTROL,
+							OPEN_DEADLINE_MS, dev_connect_cb, d);
+	if (req == NULL && d->connecting) {
+		dev_connect_cb(NULL, BLZ_ERR_INVALID_PARAM, NULL, d);
+	} else if (d->connecting) {
+		d->req = req;
+	}
+	dev_put(d);
+}
+
+static void cmd_handle(struct blzd_client* cl, uint16_t type,
+					   const uint8_t* p, uint32_t len)
+{
+	struct blzd_cmd cmd;
+	struct blzd_char* c;
+	blz_ret ret;
+
+	if (type == BLZD_CMD_OPEN) {
+		if (len >= sizeof(struct blzd_cmd_open)) {
+			struct blzd_cmd_open open;
+			memcpy(&open, p, sizeof(open));
+			cmd_open(cl, &open);
+		}
+		return;
+	}
+
+	if (len < sizeof(cmd)) {
+		return;
+	}
+	memcpy(&cmd, p, sizeof(cmd));
+
+	c = char_find(cl, cmd.handle);
+	if (c == NULL) {
+		result(cl, cmd.tag, cmd.handle, BLZ_ERR_INVALID_PARAM);
+		return;
+	}
+
+	switch (type) {
+	case BLZD_CMD_CLOSE:
+		char_close(c);
+		result(cl, cmd.tag, cmd.handle, BLZ_OK);
+		break;
+	case BLZD_CMD_NOTIFY_START:
+	case BLZD_CMD_NOTIFY_STOP: {
+		/* the result is sent when BlueZ answered. Starting again while a
+		 * start is in flight gets the same result */
+		struct blzd_req* r = malloc(sizeof(struct blzd_req));
+		if (r == NULL) {
+			result(cl, cmd.tag, cmd.handle, BLZ_ERR);
+			break;
+		}
+		r->c = c;
+		r->tag = cmd.tag;
+		if (type == BLZD_CMD_NOTIFY_START) {
+			c->notifying = true;
+			ret = blz_char_notify_start_async(c->ch, notify_cb, c,
+											  notify_start_cb, r);
+		} else if (c->notifying) {
+			c->notifying = false;
+			ret = blz_char_notify_stop_async(c->ch, req_cb, r);
+		} else {
+			req_cb(BLZ_OK, NULL, 0, c->ch, r);
+			break;
+		}
+		if (ret != BLZ_OK) {
+			c->notifying = false;
+			free(r);
+			result(cl, cmd.tag, cmd.handle, ret);
+		}
+		break;
+	}
+	case BLZD_CMD_WRITE: {
+		struct blzd_req* w = malloc(sizeof(struct blzd_req));
+		if (w == NULL || len - sizeof(cmd) > BLZD_MAX_DATA) {
+			free(w);
+			result(cl, cmd.tag, cmd.handle, BLZ_ERR_INVALID_PARAM);
+			break;
+		}
+		w->c = c;
+		w->tag = cmd.tag;
+		/* the data is copied into the operation */
+		ret = blz_char_write_async(c->ch, p + sizeof(cmd), len - sizeof(cmd),
+								   BLZ_PRIO_NORMAL, req_cb, w);
+		if (ret != BLZ_OK) {
+			free(w);
+			result(cl, cmd.tag, cmd.handle, ret);
+		}
+		break;
+	}
+	default:
+		LOG_WARN("blzd: Unknown command %d", type);
+		break;
+	}
+}
+
+static void client_free(struct blzd_client* cl)
+{
+	for (struct blzd_client** p = &clients; *p != NULL; p = &(*p)->next) {
+		if (*p == cl) {
+			*p = cl->next;
+			break;
+		}
+	}
+
+	LOG_INF("blzd: Client %d closed", cl->fd);
+	cl->closing = true;
+	devs_drop_opens(cl);
+	while (cl->chars != NULL) {
+		char_close(cl->chars);
+	}
+	munmap(cl->shm, BLZD_SHM_SIZE);
+	close(cl->fd);
+	free(cl);
+	nclients--;
+}
+
+/* returns false when the client is gone */
+static bool client_read(struct blzd_client* cl)
+{
+	char buf[16];
+	ssize_t r;
+	uint16_t type;
+	uint32_t len;
+	const uint8_t* p;
+
+	/* drain wakeups */
+	while ((r = recv(cl->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+	}
+	if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+		return false;
+	}
+
+	/* commands may close the client on errors, but never free it */
+	while ((p = blzd_ring_peek(&cl->cmd, &type, &len)) != NULL) {
+		cmd_handle(cl, type, p, len);
+		blzd_ring_consume(&cl->cmd, len);
+	}
+	return true;
+}
+
+static void client_accept(int lfd)
+{
+	struct blzd_client* cl;
+	int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	if (nclients >= MAX_CLIENTS) {
+		LOG_WARN("blzd: Too many clients");
+		close(fd);
+		return;
+	}
+
+	int mfd = memfd_create("blzd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mfd < 0 || ftruncate(mfd, BLZD_SHM_SIZE) < 0
+		/* the client must not be able to make our mapping fault */
+		|| fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+			   < 0) {
+		LOG_ERR("blzd: Failed to create shared memory: %s", strerror(errno));
+		goto err;
+	}
+
+	cl = calloc(1, sizeof(struct blzd_client));
+	if (cl == NULL) {
+		goto err;
+	}
+
+	cl->shm = mmap(NULL, BLZD_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+				   mfd, 0);
+	if (cl->shm == MAP_FAILED) {
+		free(cl);
+		goto err;
+	}
+
+	cl->fd = fd;
+	cl->shm->magic = BLZD_MAGIC;
+	cl->shm->version = BLZD_VERSION;
+	cl->shm->ev.size = BLZD_EV_RING_SIZE;
+	cl->shm->ev.offset = BLZD_SHM_DATA_OFF;
+	cl->shm->cmd.size = BLZD_CMD_RING_SIZE;
+	cl->shm->cmd.offset = BLZD_SHM_DATA_OFF + BLZD_EV_RING_SIZE;
+	blzd_ring_ref_init(&cl->ev, cl->shm, &cl->shm->ev, BLZD_SHM_DATA_OFF,
+					   BLZD_EV_RING_SIZE);
+	blzd_ring_ref_init(&cl->cmd, cl->shm, &cl->shm->cmd,
+					   BLZD_SHM_DATA_OFF + BLZD_EV_RING_SIZE,
+					   BLZD_CMD_RING_SIZE);
+
+	/* pass the memfd */
+	char b = 0;
+	struct iovec iov = {.iov_base = &b, .iov_len = 1};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &mfd, sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		LOG_ERR("blzd: Failed to send shared memory: %s", strerror(errno));
+		munmap(cl->shm, BLZD_SHM_SIZE);
+		free(cl);
+		goto err;
+	}
+
+	close(mfd);
+	cl->next = clients;
+	clients = cl;
+	nclients++;
+	LOG_INF("blzd: Client %d connected", fd);
+	return;
+
+err:
+	if (mfd >= 0) {
+		close(mfd);
+	}
+	close(fd);
+}
+
+static int listen_socket(const char* path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOG_ERR("blzd: Socket path too long");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		LOG_ERR("blzd: socket failed: %s", strerror(errno));
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+		|| listen(fd, 8) < 0) {
+		LOG_ERR("blzd: Failed to listen on %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void signal_handler(int sig)
+{
+	running = 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = BLZD_SOCKET_PATH;
+	const char* hci = "hci0";
+	struct pollfd pfds[MAX_CLIENTS + 2];
+	struct blzd_client* polled[MAX_CLIENTS];
+	int lfd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:i:")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'i':
+			hci = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s socket] [-i hci]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	struct sigaction sa = {.sa_handler = signal_handler};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	ctx = blz_init(hci);
+	if (ctx == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	lfd = listen_socket(path);
+	if (lfd < 0) {
+		blz_fini(ctx);
+		return EXIT_FAILURE;
+	}
+
+	LOG_INF("blzd: Listening on %s", path);
+
+	while (running) {
+		int n = 0;
+
+		pfds[n].fd = blz_get_fd(ctx);
+		pfds[n++].events = POLLIN;
+		pfds[n].fd = lfd;
+		pfds[n++].events = POLLIN;
+		for (struct blzd_client* cl = clients; cl != NULL; cl = cl->next) {
+			polled[n - 2] = cl;
+			pfds[n].fd = cl->fd;
+			pfds[n++].events = POLLIN;
+		}
+
+		int r = poll(pfds, n, blz_get_timeout(ctx));
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_ERR("blzd: poll failed: %s", strerror(errno));
+			break;
+		}
+
+		/* also runs expired timers when nothing was received */
+		blz_handle_read(ctx);
+
+		for (int i = 2; i < n; i++) {
+			if (pfds[i].revents != 0 && !client_read(polled[i - 2])) {
+				client_free(polled[i - 2]);
+			}
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			client_accept(lfd);
+		}
+	}
+
+	LOG_INF("blzd: Shutting down");
+	while (clients != NULL) {
+		client_free(clients);
+	}
+	close(lfd);
+	unlink(path);
+	blz_fini(ctx);
+	return EXIT_SUCCESS;
+}
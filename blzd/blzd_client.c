@@ -0,0 +1,410 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blzd_client.h"
+#include "blzd_proto.h"
+#include "blzlib_log.h"
+
+/* the daemon may have to connect the device first */
+#define OPEN_TIMEOUT_MS 60000
+#define CMD_TIMEOUT_MS	30000
+
+struct blzc_char {
+	struct blzc_char* next;
+	blzc* c;
+	uint32_t handle;
+	blzc_notify_handler_t cb;
+	void* user;
+};
+
+/* command waiting for its result, nested when handlers send commands */
+struct blzc_wait {
+	struct blzc_wait* next;
+	uint32_t tag;
+	bool done;
+	uint32_t handle;
+	blz_ret ret;
+};
+
+struct blzc {
+	int fd;
+	struct blzd_shm* shm;
+	struct blzd_ring_ref ev;
+	struct blzd_ring_ref cmd;
+	struct blzc_char* chars;
+	uint32_t tag;
+	struct blzc_wait* waits;
+};
+
+static int recv_fd(int sock)
+{
+	char b;
+	struct iovec iov = {.iov_base = &b, .iov_len = 1};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	int fd = -1;
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+		return -1;
+	}
+
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	if (cm != NULL && cm->cmsg_level == SOL_SOCKET
+		&& cm->cmsg_type == SCM_RIGHTS
+		&& cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+		memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	}
+	return fd;
+}
+
+blzc* blzc_init(const char* path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	blzc* c;
+	int mfd;
+
+	if (path == NULL) {
+		path = BLZD_SOCKET_PATH;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOG_ERR("BLZC: Socket path too long");
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	c = calloc(1, sizeof(struct blzc));
+	if (c == NULL) {
+		LOG_ERR("BLZC: blzc alloc failed");
+		return NULL;
+	}
+
+	c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (c->fd < 0
+		|| connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		LOG_ERR("BLZC: Failed to connect to %s: %s", path, strerror(errno));
+		goto err;
+	}
+
+	mfd = recv_fd(c->fd);
+	if (mfd < 0) {
+		LOG_ERR("BLZC: No shared memory received");
+		goto err;
+	}
+
+	c->shm = mmap(NULL, BLZD_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+				  mfd, 0);
+	close(mfd);
+	if (c->shm == MAP_FAILED) {
+		LOG_ERR("BLZC: Failed to map shared memory: %s", strerror(errno));
+		c->shm = NULL;
+		goto err;
+	}
+
+	if (c->shm->magic != BLZD_MAGIC || c->shm->version != BLZD_VERSION) {
+		LOG_ERR("BLZC: Protocol version mismatch");
+		goto err;
+	}
+
+	blzd_ring_ref_init(&c->ev, c->shm, &c->shm->ev, c->shm->ev.offset,
+					   c->shm->ev.size);
+	blzd_ring_ref_init(&c->cmd, c->shm, &c->shm->cmd, c->shm->cmd.offset,
+					   c->shm->cmd.size);
+	return c;
+
+err:
+	blzc_fini(c);
+	return NULL;
+}
+
+void blzc_fini(blzc* c)
+{
+	if (c == NULL) {
+		return;
+	}
+
+	/* the daemon releases all handles when the socket is closed */
+	while (c->chars != NULL) {
+		struct blzc_char* ch = c->chars;
+		c->chars = ch->next;
+		free(ch);
+	}
+
+	if (c->shm != NULL) {
+		munmap(c->shm, BLZD_SHM_SIZE);
+	}
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+	free(c);
+}
+
+int blzc_get_fd(blzc* c)
+{
+	return c->fd;
+}
+
+static struct blzc_char* char_find(blzc* c, uint32_t handle)
+{
+	for (struct blzc_char* ch = c->chars; ch != NULL; ch = ch->next) {
+		if (ch->handle == handle) {
+			return ch;
+		}
+	}
+	return NULL;
+}
+
+static void ev_handle(blzc* c, uint16_t type, const uint8_t* p, uint32_t len)
+{
+	if (type == BLZD_EV_RESULT && len >= sizeof(struct blzd_ev_result)) {
+		struct blzd_ev_result res;
+		memcpy(&res, p, sizeof(res));
+		for (struct blzc_wait* w = c->waits; w != NULL; w = w->next) {
+			if (w->tag == res.tag) {
+				w->done = true;
+				w->handle = res.handle;
+				w->ret = res.ret;
+				break;
+			}
+		}
+	} else if (type == BLZD_EV_NOTIFY && len >= sizeof(struct blzd_ev_notify)) {
+		struct blzd_ev_notify ev;
+		memcpy(&ev, p, sizeof(ev));
+		struct blzc_char* ch = char_find(c, ev.handle);
+		if (ch != NULL && ch->cb != NULL) {
+			struct blz_notify_info info = {
+				.ts = ev.ts,
+				.seq = ev.seq,
+				.lost = ev.lost,
+				.dropped = ev.dropped,
+			};
+			ch->cb(p + sizeof(ev), len - sizeof(ev), &info, ch, ch->user);
+		}
+	}
+}
+
+void blzc_handle_read(blzc* c)
+{
+	char buf[16];
+	uint16_t type;
+	uint32_t len;
+	const uint8_t* p;
+
+	/* drain wakeups */
+	while (recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+	}
+
+	/* handlers may send commands and wait, which dispatches further events
+	 * recursively, so the record is released before the call */
+	while ((p = blzd_ring_peek(&c->ev, &type, &len)) != NULL) {
+		uint8_t rec[sizeof(struct blzd_ev_notify) + BLZD_MAX_DATA];
+		if (len > sizeof(rec)) {
+			len = sizeof(rec);
+		}
+		memcpy(rec, p, len);
+		blzd_ring_consume(&c->ev, len);
+		ev_handle(c, type, rec, len);
+	}
+}
+
+blz_ret blzc_loop_one(blzc* c, uint32_t timeout_ms)
+{
+	struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+
+	/* events may be waiting without a wakeup when we were busy */
+	blzc_handle_read(c);
+
+	int r = poll(&pfd, 1, timeout_ms);
+	if (r < 0 && errno != EINTR) {
+		LOG_ERR("BLZC: poll failed: %s", strerror(errno));
+		return BLZ_ERR;
+	}
+	if (pfd.revents & (POLLHUP | POLLERR)) {
+		LOG_ERR("BLZC: Daemon closed connection");
+		return BLZ_ERR_BUS;
+	}
+	if (r > 0) {
+		blzc_handle_read(c);
+	}
+	return BLZ_OK;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* send command and wait for its result */
+static blz_ret cmd_call(blzc* c, uint16_t type, void* hdr, size_t hlen,
+						const void* data, size_t dlen, uint32_t timeout_ms,
+						uint32_t* handle)
+{
+	bool was_empty;
+	struct blzc_wait w = {.tag = ++c->tag};
+	uint64_t end = now_ms() + timeout_ms;
+
+	/* every command starts with the tag */
+	memcpy(hdr, &w.tag, sizeof(w.tag));
+
+	if (!blzd_ring_push(&c->cmd, type, hdr, hlen, data, dlen, &was_empty)) {
+		LOG_ERR("BLZC: Command ring full");
+		return BLZ_ERR;
+	}
+	if (was_empty) {
+		char b = 0;
+		send(c->fd, &b, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+
+	w.next = c->waits;
+	c->waits = &w;
+
+	blz_ret ret = BLZ_OK;
+	while (!w.done && ret == BLZ_OK) {
+		uint64_t now = now_ms();
+		if (now >= end) {
+			ret = BLZ_ERR_TIMEOUT;
+			break;
+		}
+		ret = blzc_loop_one(c, end - now);
+	}
+
+	if (w.done) {
+		ret = w.ret;
+		if (handle != NULL) {
+			*handle = w.handle;
+		}
+	}
+
+	/* nested waits always finish first */
+	c->waits = w.next;
+	return ret;
+}
+
+blzc_char* blzc_char_open(blzc* c, const char* macstr,
+						  enum blz_addr_type atype, const char* uuid_srv,
+						  const char* uuid_char)
+{
+	struct blzd_cmd_open cmd = {.atype = atype};
+	uint32_t handle;
+
+	if (c == NULL || macstr == NULL || uuid_srv == NULL || uuid_char == NULL
+		|| strlen(macstr) >= BLZD_MAC_LEN || strlen(uuid_srv) >= BLZD_UUID_LEN
+		|| strlen(uuid_char) >= BLZD_UUID_LEN) {
+		return NULL;
+	}
+
+	strcpy(cmd.mac, macstr);
+	strcpy(cmd.serv, uuid_srv);
+	strcpy(cmd.uuid, uuid_char);
+
+	struct blzc_char* ch = calloc(1, sizeof(struct blzc_char));
+	if (ch == NULL) {
+		LOG_ERR("BLZC: blzc_char alloc failed");
+		return NULL;
+	}
+
+	blz_ret ret = cmd_call(c, BLZD_CMD_OPEN, &cmd, sizeof(cmd), NULL, 0,
+						   OPEN_TIMEOUT_MS, &handle);
+	if (ret != BLZ_OK) {
+		LOG_ERR("BLZC: Failed to open %s %s: %s", macstr, uuid_char,
+				blz_errstr(ret));
+		free(ch);
+		return NULL;
+	}
+
+	ch->c = c;
+	ch->handle = handle;
+	ch->next = c->chars;
+	c->chars = ch;
+	return ch;
+}
+
+void blzc_char_close(blzc_char* ch)
+{
+	if (ch == NULL) {
+		return;
+	}
+
+	blzc* c = ch->c;
+	struct blzd_cmd cmd = {.handle = ch->handle};
+	cmd_call(c, BLZD_CMD_CLOSE, &cmd, sizeof(cmd), NULL, 0, CMD_TIMEOUT_MS,
+			 NULL);
+
+	for (struct blzc_char** p = &c->chars; *p != NULL; p = &(*p)->next) {
+		if (*p == ch) {
+			*p = ch->next;
+			break;
+		}
+	}
+	free(ch);
+}
+
+blz_ret blzc_char_write(blzc_char* ch, const uint8_t* data, size_t len)
+{
+	struct blzd_cmd cmd;
+
+	if (ch == NULL || len > BLZD_MAX_DATA) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	cmd.handle = ch->handle;
+	return cmd_call(ch->c, BLZD_CMD_WRITE, &cmd, sizeof(cmd), data, len,
+					CMD_TIMEOUT_MS, NULL);
+}
+
+blz_ret blzc_char_notify_start(blzc_char* ch, blzc_notify_handler_t cb,
+							   void* user)
+{
+	struct blzd_cmd cmd;
+
+	if (ch == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	ch->cb = cb;
+	ch->user = user;
+	cmd.handle = ch->handle;
+	blz_ret ret = cmd_call(ch->c, BLZD_CMD_NOTIFY_START, &cmd, sizeof(cmd),
+						   NULL, 0, CMD_TIMEOUT_MS, NULL);
+	if (ret != BLZ_OK) {
+		ch->cb = NULL;
+	}
+	return ret;
+}
+
+blz_ret blzc_char_notify_stop(blzc_char* ch)
+{
+	struct blzd_cmd cmd;
+
+	if (ch == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	ch->cb = NULL;
+	cmd.handle = ch->handle;
+	return cmd_call(ch->c, BLZD_CMD_NOTIFY_STOP, &cmd, sizeof(cmd), NULL, 0,
+					CMD_TIMEOUT_MS, NULL);
+}
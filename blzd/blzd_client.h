@@ -0,0 +1,55 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#ifndef BLZD_CLIENT_H
+#define BLZD_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blzlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Client of blzd, mirroring the blzlib API. Handlers are called from
+ * blzc_loop_one() and blzc_handle_read() and while waiting for results */
+
+typedef struct blzc blzc;
+typedef struct blzc_char blzc_char;
+
+typedef void (*blzc_notify_handler_t)(const uint8_t* data, size_t len,
+									  const struct blz_notify_info* info,
+									  blzc_char* ch, void* user);
+
+/** path NULL for the default socket */
+blzc* blzc_init(const char* path);
+void blzc_fini(blzc* c);
+
+/** connects the device in the daemon if no other client did */
+blzc_char* blzc_char_open(blzc* c, const char* macstr,
+						  enum blz_addr_type atype, const char* uuid_srv,
+						  const char* uuid_char);
+void blzc_char_close(blzc_char* ch);
+
+blz_ret blzc_char_write(blzc_char* ch, const uint8_t* data, size_t len);
+blz_ret blzc_char_notify_start(blzc_char* ch, blzc_notify_handler_t cb,
+							   void* user);
+blz_ret blzc_char_notify_stop(blzc_char* ch);
+
+blz_ret blzc_loop_one(blzc* c, uint32_t timeout_ms);
+int blzc_get_fd(blzc* c);
+/** call when fd is readable */
+void blzc_handle_read(blzc* c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * blzd protocol
+ *
+ * A client connects to the SOCK_SEQPACKET Unix socket and receives a memfd
+ * with SCM_RIGHTS in the first message. The shared memory holds two single
+ * producer single consumer rings of variable length records: events from
+ * the daemon to the client (results and notifications) and commands from
+ * the client to the daemon. Positions are free running byte counters.
+ *
+ * After pushing a record into a ring which was empty, the producer sends a
+ * one byte message on the socket to wake up the consumer. A consumer always
+ * empties the ring before it sleeps again. Closing the socket ends the
+ * session and releases all handles of the client.
+ */
+
+#ifndef BLZD_PROTO_H
+#define BLZD_PROTO_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BLZD_SOCKET_PATH "/run/blzd.sock"
+#define BLZD_MAGIC		 0x647a6c62 /* "blzd" */
+#define BLZD_VERSION	 1
+
+#define BLZD_EV_RING_SIZE  (256 * 1024)
+#define BLZD_CMD_RING_SIZE (64 * 1024)
+#define BLZD_MAX_DATA	   512 /* max attribute value length */
+#define BLZD_UUID_LEN	   37
+#define BLZD_MAC_LEN	   18
+
+enum blzd_msg_type {
+	BLZD_PAD, /* filler up to the end of the ring */
+	/* commands */
+	BLZD_CMD_OPEN,
+	BLZD_CMD_CLOSE,
+	BLZD_CMD_NOTIFY_START,
+	BLZD_CMD_NOTIFY_STOP,
+	BLZD_CMD_WRITE,
+	/* events */
+	BLZD_EV_RESULT,
+	BLZD_EV_NOTIFY,
+};
+
+/* connect device if necessary and open characteristic, result has handle.
+ * Results of later commands may arrive first while the device connects */
+struct blzd_cmd_open {
+	uint32_t tag;
+	uint8_t atype; /* enum blz_addr_type */
+	char mac[BLZD_MAC_LEN];
+	char serv[BLZD_UUID_LEN];
+	char uuid[BLZD_UUID_LEN];
+};
+
+/* close, notify start/stop and write, which is followed by the data */
+struct blzd_cmd {
+	uint32_t tag;
+	uint32_t handle;
+};
+
+struct blzd_ev_result {
+	uint32_t tag;
+	uint32_t handle;
+	int32_t ret; /* blz_ret */
+};
+
+/* followed by the data */
+struct blzd_ev_notify {
+	uint64_t ts; /* CLOCK_MONOTONIC ns of dispatch in the daemon */
+	uint32_t handle;
+	uint32_t seq;
+	uint32_t lost;
+	uint32_t dropped; /* by the daemon because the ring was full */
+};
+
+struct blzd_rec {
+	uint32_t len; /* payload bytes, padded to 8 in the ring */
+	uint16_t type;
+	uint16_t reserved;
+};
+
+/* clang-format off */
+struct blzd_ring {
+	_Atomic uint64_t	head; /* written by the producer only */
+	uint8_t				pad1[56];
+	_Atomic uint64_t	tail; /* written by the consumer only */
+	uint8_t				pad2[56];
+	_Atomic uint64_t	dropped; /* records not pushed as ring was full */
+	uint32_t			size;	 /* bytes, power of two */
+	uint32_t			offset;	 /* of data from start of shared memory */
+};
+
+struct blzd_shm {
+	uint32_t			magic;
+	uint32_t			version;
+	struct blzd_ring	ev;	 /* daemon to client */
+	struct blzd_ring	cmd; /* client to daemon */
+};
+
+/* local view of a ring. size and data are never taken from the shared
+ * memory by the daemon, so a client can only break its own rings */
+struct blzd_ring_ref {
+	struct blzd_ring*	r;
+	uint8_t*			data;
+	uint32_t			size;
+};
+/* clang-format on */
+
+#define BLZD_ALIGN(x)	  (((x) + 7) & ~(size_t)7)
+#define BLZD_SHM_DATA_OFF BLZD_ALIGN(sizeof(struct blzd_shm))
+#define BLZD_SHM_SIZE                                                          \
+	(BLZD_SHM_DATA_OFF + BLZD_EV_RING_SIZE + BLZD_CMD_RING_SIZE)
+
+static inline void blzd_ring_ref_init(struct blzd_ring_ref* rr,
+									  struct blzd_shm* shm,
+									  struct blzd_ring* r, uint32_t offset,
+									  uint32_t size)
+{
+	rr->r = r;
+	rr->data = (uint8_t*)shm + offset;
+	rr->size = size;
+}
+
+/** push a record of hdr and data. returns false and counts a drop if the
+ * ring is full. was_empty tells if the consumer has to be woken up */
+static inline bool blzd_ring_push(struct blzd_ring_ref* rr, uint16_t type,
+								  const void* hdr, size_t hlen,
+								  const void* data, size_t dlen,
+								  bool* was_empty)
+{
+	uint64_t start = atomic_load_explicit(&rr->r->head, memory_order_relaxed);
+	uint64_t head = start;
+	uint64_t tail = atomic_load(&rr->r->tail);
+	size_t need = sizeof(struct blzd_rec) + BLZD_ALIGN(hlen + dlen);
+	size_t pos = head & (rr->size - 1);
+	size_t pad = rr->size - pos < need ? rr->size - pos : 0;
+	struct blzd_rec rec = {.len = hlen + dlen, .type = type};
+
+	if (need > rr->size || head - tail + pad + need > rr->size) {
+		atomic_fetch_add_explicit(&rr->r->dropped, 1, memory_order_relaxed);
+		return false;
+	}
+
+	if (pad > 0) {
+		struct blzd_rec prec = {.len = pad - sizeof(rec), .type = BLZD_PAD};
+		memcpy(rr->data + pos, &prec, sizeof(prec));
+		head += pad;
+		pos = 0;
+	}
+
+	memcpy(rr->data + pos, &rec, sizeof(rec));
+	memcpy(rr->data + pos + sizeof(rec), hdr, hlen);
+	if (dlen > 0) {
+		memcpy(rr->data + pos + sizeof(rec) + hlen, data, dlen);
+	}
+
+	/* sequentially consistent and tail is checked again after publishing,
+	 * while the consumer checks head after storing tail: a consumer going
+	 * to sleep on an empty ring is always seen here */
+	atomic_store(&rr->r->head, head + need);
+	*was_empty = atomic_load(&rr->r->tail) == start;
+	return true;
+}
+
+/** returns the payload of the next record or NULL if the ring is empty or
+ * corrupted. Records are validated, the producer is not trusted */
+static inline const uint8_t* blzd_ring_peek(struct blzd_ring_ref* rr,
+											uint16_t* type, uint32_t* len)
+{
+	for (;;) {
+		uint64_t tail
+			= atomic_load_explicit(&rr->r->tail, memory_order_relaxed);
+		uint64_t head = atomic_load(&rr->r->head);
+		size_t pos = tail & (rr->size - 1);
+		struct blzd_rec rec;
+
+		if (head == tail || head - tail > rr->size || (tail & 7) != 0) {
+			return NULL;
+		}
+
+		memcpy(&rec, rr->data + pos, sizeof(rec));
+		if (rec.len > rr->size - pos - sizeof(rec)
+			|| sizeof(rec) + BLZD_ALIGN(rec.len) > head - tail) {
+			return NULL;
+		}
+
+		if (rec.type == BLZD_PAD) {
+			atomic_store(&rr->r->tail, tail + sizeof(rec) + rec.len);
+			continue;
+		}
+
+		*type = rec.type;
+		*len = rec.len;
+		return rr->data + pos + sizeof(rec);
+	}
+}
+
+/** release the record returned by blzd_ring_peek() with its len */
+static inline void blzd_ring_consume(struct blzd_ring_ref* rr, uint32_t len)
+{
+	uint64_t tail = atomic_load_explicit(&rr->r->tail, memory_order_relaxed);
+	atomic_store(&rr->r->tail,
+				 tail + sizeof(struct blzd_rec) + BLZD_ALIGN(len));
+}
+
+#endif
@@ -6,6 +6,8 @@
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <systemd/sd-bus.h>
@@ -17,11 +19,18 @@
 #include "blzlib_log.h"
 #include "blzlib_util.h"
 
+static int blz_dev_props_cb(sd_bus_message* m, void* user, sd_bus_error* err);
+static blz_ret loop_one(blz_ctx* ctx, uint64_t timeout_us);
+
 blz_ctx* blz_init(const char* dev)
+{
+	return blz_init_multi(&dev, 1);
+}
+
+static blz_ctx* ctx_new(const char* const* devs, unsigned int n)
 {
 	int r;
 	struct blz_context* ctx;
-	sd_bus_error error = SD_BUS_ERROR_NULL;
 
 	ctx = calloc(1, sizeof(struct blz_context));
 	if (ctx == NULL) {
@@ -29,38 +38,98 @@ blz_ctx* blz_init(const char* dev)
 		return NULL;
 	}
 
-	r = snprintf(ctx->path, DBUS_PATH_MAX_LEN, "/org/bluez/%s", dev);
-	if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
-		LOG_ERR("BLZ: Failed to construct path");
+	if (adapters_init(ctx, devs, n) != BLZ_OK) {
+		adapters_fini(ctx);
 		free(ctx);
 		return NULL;
 	}
 
+	timer_wheel_init(&ctx->timers, timer_now());
+	ctx->op_timeout_ms = OP_TIMEOUT * 1000;
+	list_init(&ctx->sched_ready);
+	list_init(&ctx->polls);
+	list_init(&ctx->notify_chans);
+	for (int i = 0; i < DEV_HASH_SIZE; i++) {
+		list_init(&ctx->dev_hash[i]);
+	}
+	connect_init(ctx);
+	ctx->max_inflight = MAX_INFLIGHT;
+	ctx->max_inflight_dev = MAX_INFLIGHT_DEV;
+
 	/* Connect to the system bus */
 	r = sd_bus_default_system(&ctx->bus);
 	if (r < 0) {
 		LOG_ERR("BLZ: Failed to connect to system bus: %s", strerror(-r));
+		adapters_fini(ctx);
 		free(ctx);
 		return NULL;
 	}
 
-	/* power on if necessary */
-	r = sd_bus_set_property(ctx->bus, "org.bluez", ctx->path,
-							"org.bluez.Adapter1", "Powered", &error, "b", 1);
-
+	/* property changes of all devices, routed by object path */
+	r = sd_bus_add_match(ctx->bus, &ctx->dev_slot,
+						 "type='signal',sender='org.bluez',"
+						 "interface='org.freedesktop.DBus.Properties',"
+						 "member='PropertiesChanged',arg0='org.bluez.Device1'",
+						 blz_dev_props_cb, ctx);
 	if (r < 0) {
-		if (sd_bus_error_has_name(&error, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
-			LOG_ERR("BLZ: Adapter %s not known", dev);
-		} else {
-			LOG_ERR("BLZ: Failed to power on: %s", error.message);
-		}
-		sd_bus_error_free(&error);
+		LOG_ERR("BLZ: Failed to add device signal");
 		sd_bus_unref(ctx->bus);
+		adapters_fini(ctx);
 		free(ctx);
 		return NULL;
 	}
 
-	sd_bus_error_free(&error);
+	return ctx;
+}
+
+blz_ctx* blz_init_async(const char* const* devs, unsigned int n,
+						uint32_t timeout_ms, blz_ready_handler_t cb,
+						void* user)
+{
+	blz_ctx* ctx = ctx_new(devs, n);
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	/* power on if necessary */
+	if (adapters_power_on(ctx,
+						  timeout_ms > 0 ? timeout_ms : POWER_TIMEOUT * 1000,
+						  cb, user)
+		!= BLZ_OK) {
+		blz_fini(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+struct init_wait {
+	bool done;
+	blz_ret ret;
+};
+
+static void init_wait_done(blz_ctx* ctx, blz_ret ret, void* user)
+{
+	struct init_wait* w = user;
+	w->ret = ret;
+	w->done = true;
+}
+
+blz_ctx* blz_init_multi(const char* const* devs, unsigned int n)
+{
+	struct init_wait w = {0};
+	blz_ctx* ctx;
+
+	ctx = blz_init_async(devs, n, 0, init_wait_done, &w);
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	/* the power on times out by itself, this is only a safety net */
+	blz_loop_wait(ctx, &w.done, (POWER_TIMEOUT + 1) * 1000);
+	if (!w.done || w.ret != BLZ_OK) {
+		blz_fini(ctx);
+		return NULL;
+	}
 	return ctx;
 }
 
@@ -69,6 +138,25 @@ void blz_fini(blz_ctx* ctx)
 	if (ctx == NULL) {
 		return;
 	}
+	ctx->scan_wanted = false;
+	connect_fini(ctx);
+	polls_remove(ctx, NULL);
+	blz_devdb_close(ctx);
+	prune_fini(ctx);
+	/* only left when characteristics were not freed */
+	while (!list_empty(&ctx->notify_chans)) {
+		struct blz_notify_chan* chan = list_entry(
+			ctx->notify_chans.next, struct blz_notify_chan, node);
+		sd_bus_slot_unref(chan->slot);
+		list_del(&chan->node);
+		free(chan);
+	}
+	ctx->batch_cb = NULL;
+	notify_batch_flush(ctx);
+	free(ctx->batch);
+	free(ctx->batch_msgs);
+	adapters_fini(ctx);
+	ctx->dev_slot = sd_bus_slot_unref(ctx->dev_slot);
 	sd_bus_unref(ctx->bus);
 	ctx->bus = NULL;
 	free(ctx);
@@ -92,7 +180,8 @@ blz_ret blz_known_devices(blz_ctx* ctx, blz_scan_handler_t cb, void* user)
 		goto exit;
 	}
 
-	r = msg_parse_objects(reply, ctx->path, MSG_DEVICE_SCAN, ctx);
+	/* devices of all adapters, filtered when parsing */
+	r = msg_parse_objects(reply, "/org/bluez/", MSG_DEVICE_SCAN, ctx);
 	/* error logging done in function */
 
 exit:
@@ -111,12 +200,11 @@ static int blz_intf_cb(sd_bus_message* m, void* user, sd_bus_error* err)
 	}
 
 	/* error logging done in function */
-	return msg_parse_object(m, ctx->path, MSG_DEVICE_SCAN, ctx);
+	return msg_parse_object(m, "/org/bluez/", MSG_DEVICE_SCAN, ctx);
 }
 
 blz_ret blz_scan_start(blz_ctx* ctx, blz_scan_handler_t cb, void* user)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
 	int r;
 
 	ctx->scan_cb = cb;
@@ -128,241 +216,165 @@ blz_ret blz_scan_start(blz_ctx* ctx, blz_scan_handler_t cb, void* user)
 
 	if (r < 0) {
 		LOG_ERR("BLZ: Failed to notify");
-		goto exit;
-	}
-
-	r = sd_bus_call_method(ctx->bus, "org.bluez", ctx->path,
-						   "org.bluez.Adapter1", "StartDiscovery", &error, NULL,
-						   "");
-
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to scan: %s", error.message);
+		return BLZ_ERR;
 	}
 
-exit:
-	sd_bus_error_free(&error);
-	return r >= 0 ? BLZ_OK : BLZ_ERR;
+	/* discovery is started by the adapters when they are not connecting */
+	ctx->scan_wanted = true;
+	adapters_update(ctx);
+	return BLZ_OK;
 }
 
 blz_ret blz_scan_stop(blz_ctx* ctx)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	int r;
-
-	r = sd_bus_call_method(ctx->bus, "org.bluez", ctx->path,
-						   "org.bluez.Adapter1", "StopDiscovery", &error, NULL,
-						   "");
-
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to stop scan: %s", error.message);
-	}
+	ctx->scan_wanted = false;
+	adapters_update(ctx);
 
 	ctx->scan_slot = sd_bus_slot_unref(ctx->scan_slot);
 	ctx->scan_cb = NULL;
 	ctx->scan_user = NULL;
-
-	sd_bus_error_free(&error);
-	return r >= 0 ? BLZ_OK : BLZ_ERR;
+	return BLZ_OK;
 }
 
-static int blz_connect_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+static unsigned int dev_hash(const uint8_t* mac)
 {
-	struct blz_dev* dev = user;
-
-	if (dev == NULL) {
-		LOG_ERR("BLZ: Connect cb no dev");
-		return -1;
-	}
-
-	/* error logging done in function */
-	msg_parse_interface(m, MSG_DEVICE, NULL, dev);
-	return 0;
+	return (mac[0] ^ (mac[1] << 3) ^ (mac[2] << 5)) % DEV_HASH_SIZE;
 }
 
-static int connect_known_cb(sd_bus_message* reply, void* userdata,
-							sd_bus_error* error)
+static bool dev_path_mac(const char* path, uint8_t* mac)
 {
-	int r = 0;
-	blz_dev* dev = (blz_dev*)userdata;
-
-	if (dev == NULL) {
-		LOG_ERR("BLZ: Connect cb no dev");
-		return -1;
-	}
-
-	const sd_bus_error* err = sd_bus_message_get_error(reply);
-	if (err != NULL) {
-		r = -sd_bus_message_get_errno(reply);
-		LOG_INF("BLZ: Connect error: %s '%s' (%d)", err->name, err->message, r);
-	}
+	const char* p = strrchr(path, '/');
 
-	dev->connect_async_result = r;
-	dev->connect_async_done = true;
-	return r;
+	return p != NULL
+		   && sscanf(p, "/dev_%2hhx_%2hhx_%2hhx_%2hhx_%2hhx_%2hhx", &mac[5],
+					 &mac[4], &mac[3], &mac[2], &mac[1], &mac[0])
+				  == 6;
 }
 
-static int blz_connect_known(blz_dev* dev, const char* macstr)
+/** connected device handle of mac, to be shared */
+blz_dev* dev_find(blz_ctx* ctx, const uint8_t* mac)
 {
-	int r;
-	sd_bus_message* call = NULL;
-
-	r = sd_bus_message_new_method_call(dev->ctx->bus, &call, "org.bluez",
-									   dev->path, "org.bluez.Device1",
-									   "Connect");
-
-	if (r < 0) {
-		LOG_ERR("BLZ: Connect failed to create message: %d", r);
-		goto exit;
-	}
+	struct blz_list* head = &ctx->dev_hash[dev_hash(mac)];
 
-	dev->connect_async_done = false;
-
-	/* call it async because it can take longer than the normal sd_bus
-	 * timeout and we want to wait until it is finished or failed */
-	r = sd_bus_call_async(dev->ctx->bus, NULL, call, connect_known_cb, dev,
-						  CONNECT_TIMEOUT * 1000000);
-
-	if (r < 0) {
-		LOG_ERR("BLZ: Connect failed (%d)", r);
-		goto exit;
-	}
-
-	/* wait for callback */
-	r = blz_loop_wait(dev->ctx, &dev->connect_async_done,
-					  CONNECT_TIMEOUT * 1000);
-	if (r != BLZ_OK) {
-		LOG_ERR("BLZ: Connect timeout");
-	} else {
-		r = dev->connect_async_result;
+	for (struct blz_list* n = head->next; n != head; n = n->next) {
+		blz_dev* dev = list_entry(n, struct blz_dev, hash_node);
+		if (memcmp(dev->mac, mac, 6) == 0 && dev->connected
+			&& dev->services_resolved && dev->creq == NULL) {
+			return dev;
+		}
 	}
-
-exit:
-	sd_bus_message_unref(call);
-	return r;
+	return NULL;
 }
 
-static int connect_new_cb(sd_bus_message* reply, void* userdata,
-						  sd_bus_error* error)
+/** any handle of mac, also while it is being connected or reconnected */
+bool dev_in_use(blz_ctx* ctx, const uint8_t* mac)
 {
-	int r;
-	char* opath;
-	blz_dev* dev = (blz_dev*)userdata;
-
-	if (dev == NULL) {
-		LOG_ERR("BLZ: Connect new cb no dev");
-		return -1;
-	}
+	struct blz_list* head = &ctx->dev_hash[dev_hash(mac)];
 
-	const sd_bus_error* err = sd_bus_message_get_error(reply);
-	if (err != NULL) {
-		if (sd_bus_error_has_name(err, SD_BUS_ERROR_UNKNOWN_METHOD)) {
-			LOG_NOTI("BLZ: Connect new failed: Bluez < 5.49 (with -E"
-					 " flag) doesn't support ConnectDevice");
-			r = -2;
-		} else {
-			r = -sd_bus_message_get_errno(reply);
-			LOG_INF("BLZ: Connect new error: %s '%s' (%d)", err->name,
-					err->message, r);
+	for (struct blz_list* n = head->next; n != head; n = n->next) {
+		blz_dev* dev = list_entry(n, struct blz_dev, hash_node);
+		if (memcmp(dev->mac, mac, 6) == 0) {
+			return true;
 		}
-		goto exit;
-	}
-
-	r = sd_bus_message_read_basic(reply, 'o', &opath);
-	if (r < 0) {
-		LOG_ERR("BLZ: Connect new invalid reply");
-		goto exit;
 	}
+	return false;
+}
 
-	if (strcmp(opath, dev->path) != 0) {
-		LOG_ERR("BLZ: Connect new device paths don't match (%s %s)", opath,
-				dev->path);
-		r = -1;
-		goto exit;
+/** drop a reference without disconnecting, the last one frees the device */
+void dev_unref(blz_dev* dev)
+{
+	if (--dev->refcnt == 0) {
+		dev_free(dev);
 	}
-
-exit:
-	dev->connect_async_result = r;
-	dev->connect_async_done = true;
-	return r;
 }
 
-static int blz_connect_new(blz_dev* dev, const char* macstr, bool addr_public)
+/* drop a reference taken around handler calls. When a handler called
+ * blz_disconnect() meanwhile, finish it without blocking in the dispatch */
+static void dev_release(blz_dev* dev)
 {
-	int r;
-	sd_bus_message* call = NULL;
-
-	LOG_INF("BLZ: Connect new to %s (%s)", macstr,
-			addr_public ? "public" : "random");
-
-	r = sd_bus_message_new_method_call(dev->ctx->bus, &call, "org.bluez",
-									   dev->ctx->path, "org.bluez.Adapter1",
-									   "ConnectDevice");
-
-	if (r < 0) {
-		LOG_ERR("BLZ: Connect new failed to create message");
-		goto exit;
+	if (dev->refcnt > 1) {
+		dev->refcnt--;
+		return;
 	}
 
-	/* open array */
-	r = sd_bus_message_open_container(call, 'a', "{sv}");
-	if (r < 0) {
-		LOG_ERR("BLZ: Connect new failed to create message");
-		goto exit;
+	if (dev->connected) {
+		sd_bus_call_method_async(dev->ctx->bus, NULL, "org.bluez", dev->path,
+								 "org.bluez.Device1", "Disconnect", NULL, NULL,
+								 "");
 	}
+	dev_unref(dev);
+}
 
-	r = msg_append_property(call, "Address", 's', macstr);
-	if (r < 0) {
-		goto exit;
-	}
+/* the caller holds a reference: the connect, reconnect, op and property
+ * handlers called from here may all drop the device */
+static void blz_dev_changed(blz_dev* dev, sd_bus_message* m)
+{
+	uint32_t changed;
 
-	/* AddressType must either be public or random for BLE, otherwise a
-	 * Bluetooth classic connection (BR/EDR) is attempted */
-	r = msg_append_property(call, "AddressType", 's',
-							addr_public ? "public" : "random");
-	if (r < 0) {
-		goto exit;
+	/* error logging done in function */
+	msg_parse_interface(m, MSG_DEVICE, NULL, dev);
+	adapter_link(dev, dev->connected);
+
+	/* don't let queued operations wait for their timeout, and don't serve
+	 * cached values from before the link was lost */
+	if (!dev->connected) {
+		for (struct blz_list* n = dev->chars.next; n != &dev->chars;
+			 n = n->next) {
+			list_entry(n, struct blz_char, dev_node)->cache_ts = 0;
+		}
+		ops_fail_dev(dev, BLZ_ERR_NOT_CONNECTED);
+		reconnect_lost(dev);
+	} else if (dev->services_resolved && dev->creq != NULL) {
+		connect_resolved(dev);
+	} else if (dev->services_resolved && dev->rc.state != RC_IDLE) {
+		reconnect_resolved(dev);
 	}
 
-	/* close array */
-	r = sd_bus_message_close_container(call);
-	if (r < 0) {
-		LOG_ERR("BLZ: Connect new failed to create message");
-		goto exit;
+	changed = dev->changed & dev->prop_mask;
+	dev->changed = 0;
+	if (dev->prop_cb != NULL && changed != 0) {
+		dev->prop_cb(dev, changed, dev->prop_user);
 	}
+}
 
-	dev->connect_async_done = false;
+static int blz_dev_props_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	blz_ctx* ctx = user;
+	const char* path = sd_bus_message_get_path(m);
+	struct blz_list* head;
+	struct blz_list* next;
+	uint8_t mac[6];
 
-	/* call ConnectDevice, it is only supported from Bluez 5.49 on.
-	 * call it async because it can take longer than the normal sd_bus
-	 * timeout and we want to wait until it is finished or failed */
-	r = sd_bus_call_async(dev->ctx->bus, NULL, call, connect_new_cb, dev,
-						  CONNECT_TIMEOUT * 1000000);
-	if (r < 0) {
-		LOG_ERR("BLZ: Connect new failed: %d", r);
-		goto exit;
+	if (path == NULL || !dev_path_mac(path, mac)) {
+		return 0;
 	}
 
-	/* wait for callback */
-	r = blz_loop_wait(dev->ctx, &dev->connect_async_done,
-					  CONNECT_TIMEOUT * 1000);
-	if (r != BLZ_OK) {
-		LOG_ERR("BLZ: Connect new timeout");
-	} else {
-		r = dev->connect_async_result;
-	}
+	/* RSSI and advertising data changes of devices seen in a scan */
+	prune_seen(ctx, adapter_of(ctx, path), mac);
 
-exit:
-	sd_bus_message_unref(call);
-	return r;
+	/* usually one handle, more while the device is connected again by a
+	 * second request. Handlers may free any device of the bucket, the one
+	 * being handled is kept by a reference until its successor is known */
+	head = &ctx->dev_hash[dev_hash(mac)];
+	for (struct blz_list* n = head->next; n != head; n = next) {
+		blz_dev* dev = list_entry(n, struct blz_dev, hash_node);
+		if (strcmp(dev->path, path) != 0) {
+			next = n->next;
+			continue;
+		}
+		dev->refcnt++;
+		sd_bus_message_rewind(m, true);
+		blz_dev_changed(dev, m);
+		next = n->next;
+		dev_release(dev);
+	}
+	return 0;
 }
 
-blz_dev* blz_connect(blz_ctx* ctx, const char* macstr, enum blz_addr_type atype)
+blz_dev* dev_new(blz_ctx* ctx, struct blz_adapter* adapter,
+				 const char* macstr, enum blz_addr_type atype)
 {
 	int r;
-	uint8_t mac[6];
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	int conn_status = -2; // invalid
-	bool need_disconnect = false;
 
 	struct blz_dev* dev = calloc(1, sizeof(struct blz_dev));
 	if (dev == NULL) {
@@ -371,14 +383,22 @@ blz_dev* blz_connect(blz_ctx* ctx, const char* macstr, enum blz_addr_type atype)
 	}
 
 	dev->ctx = ctx;
+	dev->adapter = adapter;
 	dev->connected = false;
 	dev->services_resolved = false;
+	dev->atype = atype;
+	dev->tx_power = BLZ_TX_POWER_UNKNOWN;
+	list_init(&dev->servs);
+	list_init(&dev->chars);
+	sched_dev_init(dev);
+	reconnect_init(dev);
 
 	/* create device path based on MAC address */
-	blz_string_to_mac(macstr, mac);
+	blz_string_to_mac(macstr, dev->mac);
 	r = snprintf(dev->path, DBUS_PATH_MAX_LEN,
-				 "%s/dev_%02X_%02X_%02X_%02X_%02X_%02X", ctx->path, mac[5],
-				 mac[4], mac[3], mac[2], mac[1], mac[0]);
+				 "%s/dev_%02X_%02X_%02X_%02X_%02X_%02X", adapter->path,
+				 dev->mac[5], dev->mac[4], dev->mac[3], dev->mac[2],
+				 dev->mac[1], dev->mac[0]);
 
 	if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
 		LOG_ERR("BLZ: Connect failed to construct device path");
@@ -386,101 +406,54 @@ blz_dev* blz_connect(blz_ctx* ctx, const char* macstr, enum blz_addr_type atype)
 		return NULL;
 	}
 
-	/* check if it already is connected. this also serves as a mean to check
-	 * wether the object path is known in DBus */
-	r = sd_bus_get_property_trivial(dev->ctx->bus, "org.bluez", dev->path,
-									"org.bluez.Device1", "Connected", &error,
-									'b', &conn_status);
-
-	if (r < 0) {
-		if (sd_bus_error_has_name(&error, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
-			/* device is unknown, mark for ConnectDevice API below */
-			conn_status = -1;
-		} else {
-			LOG_ERR("BLZ: Failed to get connected: %s", error.message);
-			goto exit;
-		}
-	}
+	/* property changes are routed from the registry */
+	dev->refcnt = 1;
+	list_add_tail(&ctx->dev_hash[dev_hash(dev->mac)], &dev->hash_node);
+	return dev;
+}
 
-	if (conn_status == 1) {
-		LOG_NOTI("BLZ: Device %s already was connected", macstr);
-		/* get ServicesResolved status */
-		int sr;
-		r = sd_bus_get_property_trivial(dev->ctx->bus, "org.bluez", dev->path,
-										"org.bluez.Device1", "ServicesResolved",
-										&error, 'b', &sr);
-		if (r < 0) {
-			LOG_ERR("BLZ: Failed to get ServicesResolved: %s", error.message);
-			need_disconnect = true;
-			goto exit;
-		}
-		dev->services_resolved = sr;
-	} else if (conn_status != 0 && conn_status != -1) {
-		/* invalid status */
-		goto exit;
-	}
+void blz_set_connect_handler(blz_ctx* ctx, blz_conn_handler_t cb, void* user)
+{
+	ctx->connect_cb = cb;
+	ctx->connect_user = user;
+}
 
-	/* connect signal for device properties changed */
-	r = sd_bus_match_signal(ctx->bus, &dev->connect_slot, "org.bluez",
-							dev->path, "org.freedesktop.DBus.Properties",
-							"PropertiesChanged", blz_connect_cb, dev);
+void blz_set_op_timeout(blz_ctx* ctx, uint32_t timeout_ms)
+{
+	ctx->op_timeout_ms = timeout_ms > 0 ? timeout_ms : OP_TIMEOUT * 1000;
+}
 
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to add connect signal");
-		goto exit;
-	}
+int16_t blz_dev_rssi(blz_dev* dev)
+{
+	return dev->rssi;
+}
 
-	/* if the device is already known in the DBus object hierarchy, connect
-	 * by the normal Connect API, if not try using the new (Bluez 5.49)
-	 * ConnectDevice API for unknown (not yet discovered) devices */
-	if (conn_status == 0) {
-		r = blz_connect_known(dev, macstr);
-	} else if (conn_status == -1) {
-		r = blz_connect_new(dev, macstr,
-							atype == BLZ_ADDR_PUBLIC ? true : false);
-		/* when addr type is unknown and connect failed, try the other type */
-		if (r < 0 && atype == BLZ_ADDR_UNKNOWN) {
-			r = blz_connect_new(dev, macstr,
-								atype == BLZ_ADDR_PUBLIC ? false : true);
-		}
-	}
+const char* blz_dev_name(blz_dev* dev)
+{
+	return dev->name;
+}
 
-	/* connect calls may have failed with timeout, in this situation bluez
-	 * is still trying to open the connection. Calling Disconnect cancels
-	 * the connection attempt */
-	if (r < 0) {
-		need_disconnect = true;
-		goto exit;
-	}
+int16_t blz_dev_tx_power(blz_dev* dev)
+{
+	return dev->tx_power;
+}
 
-	/* wait until ServicesResolved property changed to true for this device.
-	 * we usually receive connected = true before that, but at that time we
-	 * are not ready yet to look up service and characteristic UUIDs */
-	r = blz_loop_wait(ctx, &dev->services_resolved, SERV_RESOLV_TIMEOUT * 1000);
-	if (r != BLZ_OK) {
-		LOG_ERR("BLZ: Timeout waiting for ServicesResolved");
-		need_disconnect = true;
-	} else {
-		dev->connected = true;
-	}
+bool blz_dev_connected(blz_dev* dev)
+{
+	return dev->connected;
+}
 
-exit:
-	sd_bus_error_free(&error);
-	if (r < 0) {
-		if (need_disconnect) {
-			blz_disconnect(dev); // frees
-		} else {
-			free(dev);
-		}
-		return NULL;
-	}
-	return dev;
+bool blz_dev_services_resolved(blz_dev* dev)
+{
+	return dev->services_resolved;
 }
 
-void blz_set_connect_handler(blz_ctx* ctx, blz_conn_handler_t cb, void* user)
+void blz_dev_set_prop_handler(blz_dev* dev, uint32_t mask,
+							  blz_dev_prop_handler_t cb, void* user)
 {
-	ctx->connect_cb = cb;
-	ctx->connect_user = user;
+	dev->prop_mask = mask;
+	dev->prop_cb = cb;
+	dev->prop_user = user;
 }
 
 static bool find_serv_by_uuid(blz_serv* srv)
@@ -521,13 +494,15 @@ blz_serv* blz_get_serv_from_uuid(blz_dev* dev, const char* uuid)
 	strncpy(srv->uuid, uuid, UUID_STR_LEN);
 
 	/* this will try to find the uuid in char, fill required info */
-	bool b = find_serv_by_uuid(srv);
+	bool b = profile_find_serv(srv) || find_serv_by_uuid(srv);
 	if (!b) {
 		LOG_ERR("BLZ: Couldn't find service with UUID %s", uuid);
 		free(srv);
 		return NULL;
 	}
 
+	list_add_tail(&dev->servs, &srv->dev_node);
+
 	// LOG_INF("Found service with UUID %s", uuid);
 	return srv;
 }
@@ -548,10 +523,11 @@ char** blz_list_service_uuids(blz_dev* dev)
 	return dev->service_uuids;
 }
 
-static bool find_char_by_uuid(blz_char* ch)
+static bool find_char_by_uuid(blz_char* ch, const char* serv_path)
 {
 	sd_bus_error error = SD_BUS_ERROR_NULL;
 	sd_bus_message* reply = NULL;
+	char match[DBUS_PATH_MAX_LEN];
 	int r;
 
 	r = sd_bus_call_method(ch->ctx->bus, "org.bluez", "/",
@@ -563,7 +539,9 @@ static bool find_char_by_uuid(blz_char* ch)
 		goto exit;
 	}
 
-	r = msg_parse_objects(reply, ch->dev->path, MSG_CHAR_FIND, ch);
+	/* below the service, UUIDs may be used in several services */
+	snprintf(match, sizeof(match), "%s/", serv_path);
+	r = msg_parse_objects(reply, match, MSG_CHAR_FIND, ch);
 	/* error logging done in function */
 
 exit:
@@ -618,6 +596,11 @@ exit:
 
 blz_char* blz_get_char_from_uuid(blz_serv* srv, const char* uuid)
 {
+	if (srv->dev == NULL) {
+		LOG_ERR("BLZ: Device of service was disconnected");
+		return NULL;
+	}
+
 	/* alloc char structure for use later */
 	struct blz_char* ch = calloc(1, sizeof(struct blz_char));
 	if (ch == NULL) {
@@ -627,10 +610,14 @@ blz_char* blz_get_char_from_uuid(blz_serv* srv, const char* uuid)
 
 	ch->ctx = srv->dev->ctx;
 	ch->dev = srv->dev;
+	list_init(&ch->chan_node);
+	list_init(&ch->subs);
 	strncpy(ch->uuid, uuid, UUID_STR_LEN);
+	strcpy(ch->serv_uuid, srv->uuid);
 
 	/* this will try to find the uuid in char, fill required info */
-	bool b = find_char_by_uuid(ch);
+	bool b = profile_find_char(ch, srv->path)
+			 || find_char_by_uuid(ch, srv->path);
 	if (!b) {
 		LOG_ERR("BLZ: Couldn't find characteristic with UUID %s", uuid);
 		free(ch);
@@ -638,59 +625,105 @@ blz_char* blz_get_char_from_uuid(blz_serv* srv, const char* uuid)
 	}
 
 	LOG_INF("BLZ: Found characteristic with UUID %s", uuid);
+	list_add_tail(&ch->dev->chars, &ch->dev_node);
 	return ch;
 }
 
-blz_ret blz_char_write(blz_char* ch, const uint8_t* data, size_t len)
+struct op_wait {
+	struct blz_op* op;
+	bool done;
+	blz_ret ret;
+	uint8_t* data;
+	size_t* len;
+	blz_view* view; /* instead of data and len */
+};
+
+static void op_wait_done(struct blz_op* op, blz_ret ret, sd_bus_message* reply)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* call = NULL;
-	sd_bus_message* reply = NULL;
-	int r;
+	struct op_wait* w = op->user;
+	const void* ptr;
+	size_t rlen;
 
-	if (!(ch->flags & (BLZ_CHAR_WRITE | BLZ_CHAR_WRITE_WITHOUT_RESPONSE))) {
-		LOG_ERR("BLZ: Characteristic does not support write");
-		return false;
+	if (ret == BLZ_OK && op->type == OP_READ) {
+		int r = sd_bus_message_read_array(reply, 'y', &ptr, &rlen);
+		if (r < 0) {
+			LOG_ERR("BLZ: Failed to read result");
+			ret = BLZ_ERR;
+		} else if (w->view != NULL) {
+			/* lend the data, it lives as long as the reply message */
+			w->view->data = ptr;
+			w->view->len = rlen;
+			w->view->priv = sd_bus_message_ref(reply);
+		} else {
+			if (rlen > 0) {
+				memcpy(w->data, ptr, rlen < *w->len ? rlen : *w->len);
+			}
+			*w->len = rlen;
+		}
 	}
 
-	r = sd_bus_message_new_method_call(
-		ch->ctx->bus, &call, "org.bluez", ch->path,
-		"org.bluez.GattCharacteristic1", "WriteValue");
+	w->op = NULL;
+	w->ret = ret;
+	w->done = true;
+}
 
-	if (r < 0) {
-		LOG_ERR("BLZ: Frite failed to create message");
-		goto exit;
+/* the loop can not run inside handlers: sd_bus_process() fails with -EBUSY
+ * while a message is dispatched, and handlers called from the loop must not
+ * be re-entered. The current message covers buses dispatched by sd-event */
+static bool in_dispatch(blz_ctx* ctx)
+{
+	return ctx->dispatching > 0 || sd_bus_get_current_message(ctx->bus) != NULL;
+}
+
+/* submit op to the scheduler and run the loop until it is completed. Inside
+ * handlers op is sent directly and the reply awaited until its deadline */
+static blz_ret op_wait(struct blz_op* op, struct op_wait* w)
+{
+	blz_ctx* ctx = op->ch->ctx;
+	blz_ret r;
+
+	w->op = op;
+	w->done = false;
+	if (in_dispatch(ctx)) {
+		r = op_call(op);
+		return r != BLZ_OK ? r : w->ret;
 	}
 
-	r = sd_bus_message_append_array(call, 'y', data, len);
-	if (r < 0) {
-		LOG_ERR("BLZ: Write failed to create message");
-		goto exit;
+	r = op_submit(op);
+	if (r != BLZ_OK) {
+		return r;
 	}
 
-	r = sd_bus_message_open_container(call, 'a', "{sv}");
-	if (r < 0) {
-		LOG_ERR("BLZ: Write failed to create message");
-		goto exit;
+	/* the op deadline guarantees completion, no need for another timeout */
+	r = blz_loop_wait(ctx, &w->done, UINT32_MAX);
+	if (!w->done) {
+		op_cancel(w->op, r != BLZ_OK ? r : BLZ_ERR);
 	}
+	return w->ret;
+}
 
-	r = sd_bus_message_close_container(call);
-	if (r < 0) {
-		LOG_ERR("BLZ: Write failed to create message");
-		goto exit;
+blz_ret blz_char_write_timeout(blz_char* ch, const uint8_t* data, size_t len,
+							   uint32_t timeout_ms)
+{
+	struct op_wait w = {0};
+	struct blz_op* op;
+
+	if (!(ch->flags & (BLZ_CHAR_WRITE | BLZ_CHAR_WRITE_WITHOUT_RESPONSE))) {
+		LOG_ERR("BLZ: Characteristic does not support write");
+		return BLZ_ERR_INVALID_PARAM;
 	}
 
-	r = sd_bus_call(ch->ctx->bus, call, 0, &error, &reply);
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to write: %s", error.message);
-		goto exit;
+	op = op_new(ch, OP_WRITE, BLZ_PRIO_CONTROL, timeout_ms, op_wait_done, &w);
+	if (op == NULL || op_set_data(op, data, len) != BLZ_OK) {
+		return BLZ_ERR;
 	}
 
-exit:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(call);
-	sd_bus_message_unref(reply);
-	return r >= 0 ? BLZ_OK : BLZ_ERR;
+	return op_wait(op, &w);
+}
+
+blz_ret blz_char_write(blz_char* ch, const uint8_t* data, size_t len)
+{
+	return blz_char_write_timeout(ch, data, len, ch->ctx->op_timeout_ms);
 }
 
 blz_ret blz_char_write_cmd(blz_char* ch, const uint8_t* data, size_t len)
@@ -698,108 +731,1040 @@ blz_ret blz_char_write_cmd(blz_char* ch, const uint8_t* data, size_t len)
 	return blz_char_write(ch, data, len);
 }
 
-blz_ret blz_char_read(blz_char* ch, uint8_t* data, size_t* len)
+blz_ret blz_char_read_timeout(blz_char* ch, uint8_t* data, size_t* len,
+							  uint32_t timeout_ms)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* reply = NULL;
-	const void* ptr;
-	size_t rlen = -1;
-	int r;
+	struct op_wait w = {.data = data, .len = len};
+	struct blz_op* op;
 
 	if (!(ch->flags & BLZ_CHAR_READ)) {
 		LOG_ERR("BLZ: Characteristic does not support read");
-		return false;
+		return BLZ_ERR_INVALID_PARAM;
 	}
 
-	r = sd_bus_call_method(ch->ctx->bus, "org.bluez", ch->path,
-						   "org.bluez.GattCharacteristic1", "ReadValue", &error,
-						   &reply, "a{sv}", 0);
-
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to read: %s", error.message);
-		goto exit;
+	/* serve from the last value seen, if it is fresh enough */
+	if (ch->cache_ttl_ms > 0 && ch->cache_ts > 0 && ch->dev != NULL
+		&& ch->dev->connected
+		&& timer_now() - ch->cache_ts < (uint64_t)ch->cache_ttl_ms * 1000000) {
+		if (ch->cache_len > 0) {
+			memcpy(data, ch->cache, MIN(ch->cache_len, *len));
+		}
+		*len = ch->cache_len;
+		return BLZ_OK;
 	}
 
-	r = sd_bus_message_read_array(reply, 'y', &ptr, &rlen);
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to read result: %s", error.message);
-		goto exit;
+	op = op_new(ch, OP_READ, BLZ_PRIO_NORMAL, timeout_ms, op_wait_done, &w);
+	if (op == NULL) {
+		return BLZ_ERR;
 	}
 
-	if (rlen > 0) {
-		memcpy(data, ptr, rlen < *len ? rlen : *len);
+	return op_wait(op, &w);
+}
+
+blz_ret blz_char_read(blz_char* ch, uint8_t* data, size_t* len)
+{
+	return blz_char_read_timeout(ch, data, len, ch->ctx->op_timeout_ms);
+}
+
+static blz_ret read_view(blz_char* ch, uint16_t offset, blz_view* view)
+{
+	struct op_wait w = {.view = view};
+	struct blz_op* op;
+
+	if (view == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	view->data = NULL;
+	view->len = 0;
+	view->priv = NULL;
+
+	if (!(ch->flags & BLZ_CHAR_READ)) {
+		LOG_ERR("BLZ: Characteristic does not support read");
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	op = op_new(ch, OP_READ, BLZ_PRIO_NORMAL, ch->ctx->op_timeout_ms,
+				op_wait_done, &w);
+	if (op == NULL) {
+		return BLZ_ERR;
+	}
+	op->offset = offset;
+
+	return op_wait(op, &w);
+}
+
+blz_ret blz_char_read_view(blz_char* ch, blz_view* view)
+{
+	return read_view(ch, 0, view);
+}
+
+void blz_view_release(blz_view* view)
+{
+	if (view == NULL) {
+		return;
+	}
+	sd_bus_message_unref(view->priv);
+	view->data = NULL;
+	view->len = 0;
+	view->priv = NULL;
+}
+
+blz_ret blz_char_read_range(blz_char* ch, uint16_t offset, uint8_t* data,
+							size_t* len)
+{
+	struct op_wait w = {.data = data, .len = len};
+	struct blz_op* op;
+
+	if (!(ch->flags & BLZ_CHAR_READ)) {
+		LOG_ERR("BLZ: Characteristic does not support read");
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	op = op_new(ch, OP_READ, BLZ_PRIO_BULK, ch->ctx->op_timeout_ms,
+				op_wait_done, &w);
+	if (op == NULL) {
+		return BLZ_ERR;
+	}
+	op->offset = offset;
+
+	return op_wait(op, &w);
+}
+
+blz_ret blz_char_write_range(blz_char* ch, uint16_t offset,
+							 const uint8_t* data, size_t len)
+{
+	struct op_wait w = {0};
+	struct blz_op* op;
+
+	if (!(ch->flags & BLZ_CHAR_WRITE)) {
+		LOG_ERR("BLZ: Characteristic does not support write");
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	op = op_new(ch, OP_WRITE, BLZ_PRIO_BULK, ch->ctx->op_timeout_ms,
+				op_wait_done, &w);
+	if (op == NULL || op_set_data(op, data, len) != BLZ_OK) {
+		return BLZ_ERR;
+	}
+	op->offset = offset;
+
+	return op_wait(op, &w);
+}
+
+void blz_read_iter_init(blz_read_iter* it, blz_char* ch, uint8_t* ring,
+						size_t size)
+{
+	memset(it, 0, sizeof(*it));
+	it->ch = ch;
+	it->ring = ring;
+	it->size = size;
+}
+
+/* MTU of the connection. Handles from a profile don't know it until it is
+ * needed the first time */
+static uint16_t char_mtu(blz_char* ch)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	uint16_t mtu = 0;
+	int r;
+
+	if (ch->mtu > 0) {
+		return ch->mtu;
+	}
+
+	r = sd_bus_get_property_trivial(ch->ctx->bus, "org.bluez", ch->path,
+									"org.bluez.GattCharacteristic1", "MTU",
+									&error, 'q', &mtu);
+	if (r < 0) {
+		LOG_INF("BLZ: Couldn't get MTU: %s", error.message);
+	}
+	sd_bus_error_free(&error);
+
+	/* not asked again, older BlueZ versions don't have the property */
+	ch->mtu = mtu > 0 ? mtu : ATT_DEFAULT_MTU;
+	return ch->mtu;
+}
+
+/* copy from the pending reply into the ring, MTU sized chunks at a time */
+static void read_iter_feed(blz_read_iter* it)
+{
+	uint16_t mtu = char_mtu(it->ch);
+	size_t chunk = mtu > 1 ? mtu - 1 : ATT_DEFAULT_MTU - 1;
+
+	while (it->view_pos < it->view.len) {
+		size_t space = it->size - (it->head - it->tail);
+		size_t n = MIN(MIN(chunk, space), it->view.len - it->view_pos);
+		if (n == 0) {
+			break;
+		}
+
+		size_t pos = it->head % it->size;
+		size_t first = MIN(n, it->size - pos);
+		memcpy(it->ring + pos, it->view.data + it->view_pos, first);
+		memcpy(it->ring, it->view.data + it->view_pos + first, n - first);
+
+		it->head += n;
+		it->view_pos += n;
+		it->offset += n;
+	}
+
+	if (it->view.priv != NULL && it->view_pos >= it->view.len) {
+		blz_view_release(&it->view);
+		it->view_pos = 0;
+	}
+}
+
+blz_ret blz_read_iter_fill(blz_read_iter* it)
+{
+	blz_ret r;
+
+	if (it->view.priv == NULL && !it->eof) {
+		if (it->offset > UINT16_MAX) {
+			it->eof = true;
+			return BLZ_ERR_SIZE;
+		}
+
+		/* BlueZ reads from offset up to the end of the value in one
+		 * ReadValue. On failure we resume from the same offset next time */
+		r = read_view(it->ch, it->offset, &it->view);
+		if (r != BLZ_OK) {
+			return r;
+		}
+		it->view_pos = 0;
+		it->eof = true;
+	}
+
+	read_iter_feed(it);
+	return BLZ_OK;
+}
+
+size_t blz_read_iter_get(blz_read_iter* it, uint8_t* dst, size_t len)
+{
+	size_t n = MIN(len, it->head - it->tail);
+	if (n == 0) {
+		return 0;
+	}
+
+	size_t pos = it->tail % it->size;
+	size_t first = MIN(n, it->size - pos);
+
+	memcpy(dst, it->ring + pos, first);
+	memcpy(dst + first, it->ring, n - first);
+	it->tail += n;
+
+	/* make room for more of the pending reply */
+	read_iter_feed(it);
+	return n;
+}
+
+bool blz_read_iter_done(const blz_read_iter* it)
+{
+	return it->eof && it->view.priv == NULL && it->head == it->tail;
+}
+
+void blz_read_iter_release(blz_read_iter* it)
+{
+	blz_view_release(&it->view);
+}
+
+void char_cache_update(blz_char* ch, const void* data, size_t len)
+{
+	if (len > ch->cache_size) {
+		uint8_t* buf = realloc(ch->cache, len);
+		if (buf == NULL) {
+			LOG_ERR("BLZ: Cache alloc failed");
+			ch->cache_ts = 0;
+			return;
+		}
+		ch->cache = buf;
+		ch->cache_size = len;
+	}
+
+	if (len > 0) {
+		memcpy(ch->cache, data, len);
+	}
+	ch->cache_len = len;
+	ch->cache_ts = timer_now();
+}
+
+blz_ret blz_char_set_cache_ttl(blz_char* ch, uint32_t ttl_ms)
+{
+	if (ch == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	/* filled from read replies and the notification dispatch, there is no
+	 * match of its own */
+	ch->cache_ttl_ms = ttl_ms;
+	if (ttl_ms == 0) {
+		ch->cache_ts = 0;
+	}
+	return BLZ_OK;
+}
+
+struct multi_entry {
+	struct blz_op* op;
+	uint8_t* buf;
+	size_t* len;
+	blz_ret* status;
+	size_t* pending;
+};
+
+static void multi_done(struct blz_op* op, blz_ret ret, sd_bus_message* reply)
+{
+	struct multi_entry* e = op->user;
+	const void* ptr;
+	size_t rlen;
+
+	if (ret == BLZ_OK) {
+		int r = sd_bus_message_read_array(reply, 'y', &ptr, &rlen);
+		if (r < 0) {
+			LOG_ERR("BLZ: Failed to read result");
+			ret = BLZ_ERR;
+		} else {
+			if (rlen > 0) {
+				memcpy(e->buf, ptr, rlen < *e->len ? rlen : *e->len);
+			}
+			if (rlen > *e->len) {
+				ret = BLZ_ERR_SIZE;
+			}
+			*e->len = rlen;
+		}
+	}
+
+	e->op = NULL;
+	*e->status = ret;
+	(*e->pending)--;
+}
+
+/* BlueZ does not offer ATT Read Multiple on D-Bus, so all reads are queued at
+ * once and BlueZ pipelines them on the link */
+blz_ret blz_char_read_multi(blz_char** chars, uint8_t** bufs, size_t* lens,
+							blz_ret* status, size_t n)
+{
+	struct multi_entry* e;
+	size_t pending = 0;
+	blz_ctx* ctx;
+	blz_ret ret = BLZ_OK;
+
+	if (n == 0) {
+		return BLZ_OK;
+	}
+	if (chars == NULL || bufs == NULL || lens == NULL || status == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (chars[i] == NULL) {
+			return BLZ_ERR_INVALID_PARAM;
+		}
+	}
+
+	e = calloc(n, sizeof(struct multi_entry));
+	if (e == NULL) {
+		LOG_ERR("BLZ: Read multi alloc failed");
+		return BLZ_ERR;
+	}
+
+	ctx = chars[0]->ctx;
+	for (size_t i = 0; i < n; i++) {
+		e[i].buf = bufs[i];
+		e[i].len = &lens[i];
+		e[i].status = &status[i];
+		e[i].pending = &pending;
+
+		if (!(chars[i]->flags & BLZ_CHAR_READ)) {
+			status[i] = BLZ_ERR_INVALID_PARAM;
+			continue;
+		}
+
+		struct blz_op* op = op_new(chars[i], OP_READ, BLZ_PRIO_NORMAL,
+								   ctx->op_timeout_ms, multi_done, &e[i]);
+		if (op == NULL) {
+			status[i] = BLZ_ERR;
+			continue;
+		}
+
+		/* counted before submit, it can complete right away. Inside
+		 * handlers the reads are done one after the other */
+		pending++;
+		e[i].op = op;
+		status[i] = in_dispatch(ctx) ? op_call(op) : op_submit(op);
+		if (status[i] != BLZ_OK) {
+			e[i].op = NULL;
+			pending--;
+		}
+	}
+
+	/* op deadlines guarantee that all complete */
+	while (pending > 0) {
+		if (blz_loop_one(ctx, ctx->op_timeout_ms) != BLZ_OK) {
+			break;
+		}
+	}
+
+	/* only on loop errors */
+	for (size_t i = 0; i < n; i++) {
+		if (e[i].op != NULL) {
+			op_cancel(e[i].op, BLZ_ERR);
+		}
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (status[i] != BLZ_OK) {
+			ret = status[i];
+			break;
+		}
+	}
+
+	free(e);
+	return ret;
+}
+
+static void notify_batch_add(blz_ctx* ctx, sd_bus_message* m, blz_char* ch,
+							 const void* ptr, size_t len, uint64_t ts)
+{
+	if (ctx->batch_len == ctx->batch_size) {
+		size_t size = ctx->batch_size > 0 ? ctx->batch_size * 2 : 32;
+		struct blz_notify_batch* b
+			= realloc(ctx->batch, size * sizeof(struct blz_notify_batch));
+		if (b == NULL) {
+			LOG_ERR("BLZ: Notify batch alloc failed");
+			ch->notify_dropped++;
+			return;
+		}
+		ctx->batch = b;
+		sd_bus_message** msgs
+			= realloc(ctx->batch_msgs, size * sizeof(sd_bus_message*));
+		if (msgs == NULL) {
+			LOG_ERR("BLZ: Notify batch alloc failed");
+			ch->notify_dropped++;
+			return;
+		}
+		ctx->batch_msgs = msgs;
+		ctx->batch_size = size;
+	}
+
+	/* keep the message, data points into it */
+	struct blz_notify_batch* b = &ctx->batch[ctx->batch_len];
+	b->ch = ch;
+	b->data = ptr;
+	b->len = len;
+	b->ts = ts;
+	b->seq = ch->notify_seq;
+	b->lost = ch->notify_lost;
+	ctx->batch_msgs[ctx->batch_len] = sd_bus_message_ref(m);
+	ctx->batch_len++;
+}
+
+void notify_batch_flush(blz_ctx* ctx)
+{
+	struct blz_notify_batch* batch = ctx->batch;
+	sd_bus_message** msgs = ctx->batch_msgs;
+	size_t len = ctx->batch_len;
+	size_t size = ctx->batch_size;
+
+	if (len == 0) {
+		return;
+	}
+
+	/* the handler may run the loop again and start a new batch */
+	ctx->batch = NULL;
+	ctx->batch_msgs = NULL;
+	ctx->batch_len = 0;
+	ctx->batch_size = 0;
+
+	if (ctx->batch_cb) {
+		ctx->batch_cb(batch, len, ctx->batch_user);
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		sd_bus_message_unref(msgs[i]);
+	}
+
+	/* keep the arrays for the next batch if no new one was started */
+	if (ctx->batch == NULL) {
+		ctx->batch = batch;
+		ctx->batch_msgs = msgs;
+		ctx->batch_size = size;
+	} else {
+		free(batch);
+		free(msgs);
+	}
+}
+
+/* drop pending entries of a characteristic which is freed before its batch
+ * is delivered */
+static void notify_batch_purge(blz_ctx* ctx, blz_char* ch)
+{
+	size_t j = 0;
+
+	for (size_t i = 0; i < ctx->batch_len; i++) {
+		if (ctx->batch[i].ch == ch) {
+			sd_bus_message_unref(ctx->batch_msgs[i]);
+			continue;
+		}
+		ctx->batch[j] = ctx->batch[i];
+		ctx->batch_msgs[j++] = ctx->batch_msgs[i];
+	}
+	ctx->batch_len = j;
+}
+
+void blz_set_notify_batch_handler(blz_ctx* ctx, blz_notify_batch_handler_t cb,
+								  void* user)
+{
+	notify_batch_flush(ctx);
+	ctx->batch_cb = cb;
+	ctx->batch_user = user;
+}
+
+/* conflation slot for the newest notification, protected by a seqlock */
+struct blz_latest {
+	atomic_uint seq;
+	atomic_size_t len;
+	size_t size;
+	uint8_t data[];
+};
+
+/* seqlock writer, only ever called from the bus dispatch thread. the
+ * sequence is odd while the slot is written */
+static void latest_store(struct blz_latest* l, const void* data, size_t len)
+{
+	unsigned int seq = atomic_load_explicit(&l->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&l->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(l->data, data, MIN(len, l->size));
+	atomic_store_explicit(&l->len, len, memory_order_relaxed);
+
+	atomic_store_explicit(&l->seq, seq + 2, memory_order_release);
+}
+
+blz_ret blz_char_latest(blz_char* ch, uint8_t* buf, size_t* len, uint32_t* seq)
+{
+	struct blz_latest* l;
+	unsigned int s1, s2;
+	size_t n;
+
+	if (ch == NULL || ch->latest == NULL || buf == NULL || len == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	l = ch->latest;
+	do {
+		s1 = atomic_load_explicit(&l->seq, memory_order_acquire);
+		if (s1 & 1) {
+			continue; // writer active
+		}
+		n = atomic_load_explicit(&l->len, memory_order_relaxed);
+		memcpy(buf, l->data, MIN(MIN(n, l->size), *len));
+		atomic_thread_fence(memory_order_acquire);
+		s2 = atomic_load_explicit(&l->seq, memory_order_relaxed);
+	} while ((s1 & 1) || s1 != s2);
+
+	if (seq != NULL) {
+		*seq = s1 / 2;
+	}
+
+	blz_ret ret = n > *len || n > l->size ? BLZ_ERR_SIZE : BLZ_OK;
+	*len = MIN(n, l->size);
+	return ret;
+}
+
+blz_ret blz_char_notify_start_latest(blz_char* ch, size_t max_len)
+{
+	if (ch == NULL || max_len == 0) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	if (ch->latest == NULL) {
+		ch->latest = calloc(1, sizeof(struct blz_latest) + max_len);
+		if (ch->latest == NULL) {
+			LOG_ERR("BLZ: Latest slot alloc failed");
+			return BLZ_ERR;
+		}
+		ch->latest->size = max_len;
+	} else if (ch->latest->size < max_len) {
+		LOG_ERR("BLZ: Latest slot already exists with smaller size");
+		return BLZ_ERR_SIZE;
+	}
+
+	/* already notifying with a handler: the slot is filled in addition */
+	if (ch->notify_started) {
+		return BLZ_OK;
+	}
+
+	return blz_char_notify_start(ch, NULL, NULL);
+}
+
+/* number of intervals needed before the mean is trusted for gap detection */
+#define NOTIFY_GAP_WARMUP 8
+
+/* update sequence number and the gap detector with a new arrival. an interval
+ * of more than 1.5 mean intervals counts as a gap, the number of notifications
+ * lost in it is the interval rounded to whole mean intervals */
+static void notify_track(blz_char* ch, uint64_t ts)
+{
+	ch->notify_seq++;
+
+	if (ch->notify_seq > 1 && ts > ch->notify_ts) {
+		uint64_t dt = ts - ch->notify_ts;
+		uint64_t n = 1;
+
+		if (ch->notify_seq > NOTIFY_GAP_WARMUP + 1 && ch->notify_ewma > 0
+			&& dt * 2 > ch->notify_ewma * 3) {
+			n = (dt + ch->notify_ewma / 2) / ch->notify_ewma;
+			ch->notify_gaps++;
+			ch->notify_lost += n - 1;
+		}
+
+		/* exponential average with alpha 1/8, a gap contributes its
+		 * interval per notification so it does not inflate the mean */
+		int64_t d = (int64_t)(dt / n) - (int64_t)ch->notify_ewma;
+		ch->notify_ewma = ch->notify_seq == 2 ? dt : ch->notify_ewma + d / 8;
+	}
+
+	ch->notify_ts = ts;
+}
+
+/* notification of one attached characteristic handle. returns false when the
+ * handle was detached or freed by one of its handlers */
+static bool char_notify(struct blz_notify_chan* chan, blz_char* ch,
+						sd_bus_message* m, uint64_t ts, const void* ptr,
+						size_t len)
+{
+	notify_track(ch, ts);
+
+	if (ch->latest != NULL) {
+		latest_store(ch->latest, ptr, len);
+	}
+
+	if (ch->cache_ttl_ms > 0) {
+		char_cache_update(ch, ptr, len);
+	}
+
+	if (ch->hist != NULL) {
+		hist_add(ch->hist, ts, ptr, len);
+	}
+
+	struct blz_notify_info info = {
+		.ts = ts,
+		.seq = ch->notify_seq,
+		.gaps = ch->notify_gaps,
+		.lost = ch->notify_lost,
+		.dropped = ch->notify_dropped,
+	};
+
+	if (ch->ctx->batch_cb != NULL) {
+		notify_batch_add(ch->ctx, m, ch, ptr, len, ts);
+	} else if (ch->notify_ext_cb != NULL) {
+		ch->notify_ext_cb(ptr, len, &info, ch, ch->notify_user);
+	} else if (ch->notify_cb != NULL) {
+		ch->notify_cb(ptr, len, ch, ch->notify_user);
+	}
+
+	/* subscribers are called in any mode, they may unsubscribe themselves
+	 * or others while we walk the list */
+	for (struct blz_list* n = ch->subs.next;
+		 chan->cur == ch && n != &ch->subs; n = ch->sub_cursor) {
+		struct blz_sub* sub = list_entry(n, struct blz_sub, node);
+		ch->sub_cursor = n->next;
+		sub->cb(ptr, len, &info, ch, sub->user);
+	}
+
+	return chan->cur == ch;
+}
+
+static void chan_put(struct blz_notify_chan* chan)
+{
+	if (--chan->refs > 0) {
+		return;
+	}
+	sd_bus_slot_unref(chan->slot);
+	list_del(&chan->node);
+	free(chan);
+}
+
+static int blz_notify_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct blz_notify_chan* chan = user;
+	const void* ptr = NULL;
+	size_t len;
+	uint64_t ts;
+	int r;
+
+	/* before parsing, so it is as close to dispatch as possible */
+	ts = msg_timestamp(m);
+
+	r = msg_parse_notify(m, &chan->notifying, &ptr, &len);
+	if (r <= 0 || ptr == NULL) {
+		return 0;
+	}
+
+	/* the message is parsed once and delivered to all handles of the
+	 * characteristic. handlers may detach or free any of them */
+	chan->refs++;
+	for (struct blz_list* n = chan->chars.next; n != &chan->chars;
+		 n = chan->cursor) {
+		blz_char* ch = list_entry(n, struct blz_char, chan_node);
+		chan->cursor = n->next;
+		chan->cur = ch;
+		char_notify(chan, ch, m, ts, ptr, len);
+	}
+	chan->cur = NULL;
+	chan_put(chan);
+
+	return 0;
+}
+
+/* a start of notifications waiting for the StartNotify of its channel */
+struct chan_waiter {
+	struct blz_list node; /* in chan->waiters */
+	blz_char* ch;
+	blz_op_handler_t cb; /* NULL when blocking */
+	void* user;
+	bool done;
+	blz_ret ret;
+};
+
+static void waiter_done(struct chan_waiter* w, blz_ret ret)
+{
+	list_del(&w->node);
+	w->ret = ret;
+	w->done = true;
+	if (w->cb != NULL) {
+		w->cb(ret, NULL, 0, w->ch, w->user);
+		free(w);
+	}
+}
+
+/* remove handle from its channel, failing its starts which are still in
+ * flight. Returns true when it was the last one and notifications have to
+ * be stopped */
+static bool chan_unlink(blz_char* ch)
+{
+	struct blz_notify_chan* chan = ch->chan;
+	bool last;
+
+	if (chan->cursor == &ch->chan_node) {
+		chan->cursor = ch->chan_node.next;
+	}
+	if (chan->cur == ch) {
+		chan->cur = NULL;
+	}
+	list_del(&ch->chan_node);
+	ch->chan = NULL;
+
+	/* a start in flight is abandoned, its reply is ignored */
+	last = list_empty(&chan->chars);
+	if (last) {
+		chan->notifying = false;
+		chan->start_op = NULL;
+		chan->slot = sd_bus_slot_unref(chan->slot);
+	}
+
+	/* handlers may change the list */
+	for (struct blz_list* n = chan->waiters.next; n != &chan->waiters;) {
+		struct chan_waiter* w = list_entry(n, struct chan_waiter, node);
+		n = n->next;
+		if (w->ch == ch) {
+			waiter_done(w, BLZ_ERR);
+			n = chan->waiters.next;
+		}
+	}
+
+	chan_put(chan);
+	return last;
+}
+
+/* remove handle from its channel. the last one stops notifications, waiting
+ * for the reply only if wait is set */
+static blz_ret chan_detach(blz_char* ch, bool wait, uint32_t timeout_ms)
+{
+	struct op_wait w = {0};
+	blz_ret ret = BLZ_OK;
+
+	if (ch->chan == NULL || !chan_unlink(ch)) {
+		return BLZ_OK;
 	}
 
-	*len = rlen;
+	/* when the device is gone, notifications are already stopped and
+	 * op_wait() fails without bus traffic. A freed device has no ops */
+	if (wait && ch->dev != NULL) {
+		struct blz_op* op = op_new(ch, OP_NOTIFY_STOP, BLZ_PRIO_CONTROL,
+								   timeout_ms, op_wait_done, &w);
+		ret = op != NULL ? op_wait(op, &w) : BLZ_ERR;
+	} else if (ch->dev != NULL && ch->dev->connected) {
+		sd_bus_call_method_async(ch->ctx->bus, NULL, "org.bluez", ch->path,
+								 "org.bluez.GattCharacteristic1",
+								 "StopNotify", NULL, NULL, "");
+	}
+	return ret;
+}
 
-exit:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(reply);
-	return r >= 0 ? BLZ_OK : BLZ_ERR;
+/* starting notifications failed: detach all handles, including those
+ * which joined from handlers and were told it succeeded */
+static void chan_fail(struct blz_notify_chan* chan)
+{
+	while (!list_empty(&chan->chars)) {
+		blz_char* c = list_entry(chan->chars.next, struct blz_char, chan_node);
+		c->notify_cb = NULL;
+		c->notify_ext_cb = NULL;
+		c->notify_user = NULL;
+		c->notify_started = false;
+		chan_detach(c, false, 0);
+	}
 }
 
-static int blz_notify_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+/* StartNotify completed: fail the channel if it did not succeed, then pass
+ * the result to everyone waiting for it */
+static void chan_started(struct blz_notify_chan* chan, blz_ret ret)
 {
-	int r;
-	const void* ptr = NULL;
-	size_t len;
-	struct blz_char* ch = user;
+	struct blz_list waiters;
 
-	if (ch == NULL || ch->notify_cb == NULL) {
-		LOG_ERR("BLZ: Signal no callback");
-		return -1;
+	chan->start_op = NULL;
+	list_init(&waiters);
+	list_splice_tail(&waiters, &chan->waiters);
+	if (ret != BLZ_OK) {
+		chan_fail(chan);
+	}
+	while (!list_empty(&waiters)) {
+		waiter_done(list_entry(waiters.next, struct chan_waiter, node), ret);
 	}
+	chan_put(chan);
+}
 
-	r = msg_parse_notify(m, ch, &ptr, &len);
+static void chan_start_done(struct blz_op* op, blz_ret ret,
+							sd_bus_message* reply)
+{
+	struct blz_notify_chan* chan = op->user;
 
-	if (r > 0 && ptr != NULL) {
-		ch->notify_cb(ptr, len, ch, ch->notify_user);
+	if (chan->start_op == op) {
+		chan_started(chan, ret);
+	} else {
+		chan_put(chan);
 	}
+}
 
-	return 0;
+/* send StartNotify for chan. The result is only passed to its waiters */
+static void chan_start(blz_char* ch, struct blz_notify_chan* chan)
+{
+	struct blz_op* op;
+	blz_ret ret;
+
+	chan->refs++;
+	op = op_new(ch, OP_NOTIFY_START, BLZ_PRIO_CONTROL, ch->ctx->op_timeout_ms,
+				chan_start_done, chan);
+	if (op == NULL) {
+		chan_started(chan, BLZ_ERR);
+		return;
+	}
+	chan->start_op = op;
+
+	/* both free op without calling the handler on errors */
+	ret = in_dispatch(ch->ctx) ? op_call(op) : op_submit(op);
+	if (ret != BLZ_OK) {
+		chan_started(chan, ret);
+	}
 }
 
-blz_ret blz_char_notify_start(blz_char* ch, blz_notify_handler_t cb, void* user)
+/* run the loop until the Notifying property changed to true. Handlers
+ * called meanwhile may stop notifications again, that ends the wait */
+static blz_ret chan_wait_notifying(blz_char* ch, struct blz_notify_chan* chan)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* reply = NULL;
+	uint64_t end = timer_now() + 5000 * 1000000ULL;
+	blz_ret ret = BLZ_OK;
+	uint64_t now;
+
+	while (!chan->notifying && ch->chan == chan) {
+		now = timer_now();
+		if (now >= end) {
+			LOG_ERR("BLZ: Timeout waiting for Notifying");
+			ret = BLZ_ERR_TIMEOUT;
+			break;
+		}
+		if (loop_one(ch->ctx, (end - now + 999) / 1000) != BLZ_OK) {
+			ret = BLZ_ERR;
+			break;
+		}
+	}
+	return ret;
+}
+
+/* attach handle to the channel of its characteristic, creating it and
+ * starting notifications only for the first one. w gets the result when
+ * the start completed, which may be right away. Returns errors without
+ * attaching */
+static blz_ret chan_attach(blz_char* ch, struct chan_waiter* w)
+{
+	struct blz_notify_chan* chan = NULL;
+	bool start;
 	int r;
 
 	if (!(ch->flags & (BLZ_CHAR_NOTIFY | BLZ_CHAR_INDICATE))) {
 		LOG_ERR("BLZ: Characteristic does not support notify");
-		return false;
+		return BLZ_ERR_INVALID_PARAM;
 	}
 
-	ch->notify_cb = cb;
-	ch->notify_user = user;
+	if (ch->dev == NULL || !ch->dev->connected) {
+		return BLZ_ERR_NOT_CONNECTED;
+	}
 
-	r = sd_bus_match_signal(ch->ctx->bus, &ch->notify_slot, "org.bluez",
-							ch->path, "org.freedesktop.DBus.Properties",
-							"PropertiesChanged", blz_notify_cb, ch);
+	w->ch = ch;
+	list_init(&w->node);
 
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to notify");
-		goto exit;
+	/* already attached, maybe still starting */
+	if (ch->chan != NULL) {
+		if (ch->chan->start_op != NULL) {
+			list_add_tail(&ch->chan->waiters, &w->node);
+		} else {
+			waiter_done(w, BLZ_OK);
+		}
+		return BLZ_OK;
 	}
 
-	r = sd_bus_call_method(ch->ctx->bus, "org.bluez", ch->path,
-						   "org.bluez.GattCharacteristic1", "StartNotify",
-						   &error, &reply, "");
+	ch->notify_seq = 0;
+	ch->notify_gaps = 0;
+	ch->notify_lost = 0;
+	ch->notify_dropped = 0;
+	ch->notify_ewma = 0;
 
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to start notify: %s", error.message);
+	for (struct blz_list* n = ch->ctx->notify_chans.next;
+		 n != &ch->ctx->notify_chans; n = n->next) {
+		struct blz_notify_chan* c
+			= list_entry(n, struct blz_notify_chan, node);
+		if (strcmp(c->path, ch->path) == 0) {
+			chan = c;
+			break;
+		}
 	}
 
-	/* wait until Notifying property changed to true */
-	r = blz_loop_wait(ch->ctx, &ch->notifying, 5000);
-	if (r != BLZ_OK) {
-		LOG_ERR("BLZ: Timeout waiting for Notifying");
+	if (chan == NULL) {
+		chan = calloc(1, sizeof(struct blz_notify_chan));
+		if (chan == NULL) {
+			LOG_ERR("BLZ: Notify alloc failed");
+			return BLZ_ERR;
+		}
+		strncpy(chan->path, ch->path, DBUS_PATH_MAX_LEN - 1);
+		list_init(&chan->chars);
+		list_init(&chan->waiters);
+		list_add_tail(&ch->ctx->notify_chans, &chan->node);
+	}
+
+	/* the match is there as long as any handle is attached */
+	start = chan->slot == NULL;
+	if (start) {
+		r = sd_bus_match_signal(ch->ctx->bus, &chan->slot, "org.bluez",
+								ch->path, "org.freedesktop.DBus.Properties",
+								"PropertiesChanged", blz_notify_cb, chan);
+		if (r < 0) {
+			LOG_ERR("BLZ: Failed to notify");
+			if (list_empty(&chan->chars) && chan->refs == 0) {
+				list_del(&chan->node);
+				free(chan);
+			}
+			return BLZ_ERR_BUS;
+		}
 	}
 
-exit:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(reply);
-	return r >= 0 ? BLZ_OK : BLZ_ERR;
+	/* attach before starting, so Notifying is seen and a concurrent start
+	 * joins instead of starting again */
+	list_add_tail(&chan->chars, &ch->chan_node);
+	ch->chan = chan;
+	chan->refs++;
+
+	if (start) {
+		list_add_tail(&chan->waiters, &w->node);
+		chan_start(ch, chan);
+	} else if (chan->start_op != NULL) {
+		list_add_tail(&chan->waiters, &w->node);
+	} else {
+		waiter_done(w, BLZ_OK);
+	}
+	return BLZ_OK;
+}
+
+/* chan_attach() and wait for the start. Handlers run meanwhile and may
+ * detach. Inside handlers, where the loop can not run, a start in flight
+ * can not be awaited: if it fails, the handle is detached again */
+static blz_ret chan_attach_wait(blz_char* ch)
+{
+	struct chan_waiter w = {0};
+	struct blz_notify_chan* chan;
+	blz_ret ret;
+
+	ret = chan_attach(ch, &w);
+	if (ret != BLZ_OK || (w.done && w.ret != BLZ_OK)) {
+		return ret != BLZ_OK ? ret : w.ret;
+	}
+	if (!w.done && in_dispatch(ch->ctx)) {
+		list_del(&w.node);
+		return BLZ_OK;
+	}
+
+	/* the op deadline guarantees completion, no need for another timeout.
+	 * The reference keeps chan while handlers run in the loop */
+	chan = ch->chan;
+	chan->refs++;
+	if (!w.done) {
+		ret = blz_loop_wait(ch->ctx, &w.done, UINT32_MAX);
+		if (!w.done) {
+			list_del(&w.node);
+			chan_detach(ch, false, 0);
+		} else {
+			ret = w.ret;
+		}
+	}
+
+	/* wait until Notifying property changed to true. Inside handlers it is
+	 * seen after they return */
+	if (ret == BLZ_OK && !in_dispatch(ch->ctx)) {
+		ret = chan_wait_notifying(ch, chan);
+		if (ret != BLZ_OK) {
+			chan_fail(chan);
+		}
+	}
+	chan_put(chan);
+
+	return ret;
+}
+
+static blz_ret notify_start(blz_char* ch, blz_notify_handler_t cb,
+							blz_notify_ext_handler_t ext_cb, void* user)
+{
+	blz_ret ret;
+
+	if (ch == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	/* starting again only replaces the handler */
+	ch->notify_cb = cb;
+	ch->notify_ext_cb = ext_cb;
+	ch->notify_user = user;
+
+	/* before attaching: handlers run while it waits, and may stop */
+	ch->notify_started = true;
+	ret = chan_attach_wait(ch);
+	if (ret != BLZ_OK) {
+		ch->notify_started = false;
+		ch->notify_cb = NULL;
+		ch->notify_ext_cb = NULL;
+		ch->notify_user = NULL;
+	}
+	return ret;
+}
+
+blz_ret blz_char_notify_start(blz_char* ch, blz_notify_handler_t cb, void* user)
+{
+	return notify_start(ch, cb, NULL, user);
+}
+
+blz_ret blz_char_notify_start_ext(blz_char* ch, blz_notify_ext_handler_t cb,
+								  void* user)
+{
+	return notify_start(ch, NULL, cb, user);
 }
 
 blz_ret blz_char_indicate_start(blz_char* ch, blz_notify_handler_t cb,
@@ -808,31 +1773,202 @@ blz_ret blz_char_indicate_start(blz_char* ch, blz_notify_handler_t cb,
 	return blz_char_notify_start(ch, cb, user);
 }
 
-blz_ret blz_char_notify_stop(blz_char* ch)
+blz_ret blz_char_notify_start_async(blz_char* ch, blz_notify_ext_handler_t cb,
+									void* user, blz_op_handler_t done,
+									void* done_user)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* reply = NULL;
-	int r;
+	struct chan_waiter* w;
+	blz_ret ret;
 
-	if (ch == NULL || ch->notify_slot == NULL) {
+	if (ch == NULL || done == NULL) {
 		return BLZ_ERR_INVALID_PARAM;
 	}
 
-	r = sd_bus_call_method(ch->ctx->bus, "org.bluez", ch->path,
-						   "org.bluez.GattCharacteristic1", "StopNotify",
-						   &error, &reply, "");
+	w = calloc(1, sizeof(struct chan_waiter));
+	if (w == NULL) {
+		LOG_ERR("BLZ: Notify alloc failed");
+		return BLZ_ERR;
+	}
+	w->cb = done;
+	w->user = done_user;
 
-	if (r < 0) {
-		LOG_ERR("BLZ: Failed to stop notify: %s", error.message);
+	ch->notify_cb = NULL;
+	ch->notify_ext_cb = cb;
+	ch->notify_user = user;
+	ch->notify_started = true;
+
+	ret = chan_attach(ch, w);
+	if (ret != BLZ_OK) {
+		free(w);
+		ch->notify_started = false;
+		ch->notify_ext_cb = NULL;
+		ch->notify_user = NULL;
+	}
+	return ret;
+}
+
+blz_ret blz_char_notify_stop_timeout(blz_char* ch, uint32_t timeout_ms)
+{
+	if (ch == NULL || !ch->notify_started) {
+		return BLZ_ERR_INVALID_PARAM;
 	}
 
-	ch->notify_slot = sd_bus_slot_unref(ch->notify_slot);
 	ch->notify_cb = NULL;
+	ch->notify_ext_cb = NULL;
 	ch->notify_user = NULL;
+	ch->notify_started = false;
 
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(reply);
-	return r >= 0 ? BLZ_OK : BLZ_ERR;
+	if (!list_empty(&ch->subs)) {
+		return BLZ_OK;
+	}
+	return chan_detach(ch, true, timeout_ms);
+}
+
+blz_ret blz_char_notify_stop(blz_char* ch)
+{
+	if (ch == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+	return blz_char_notify_stop_timeout(ch, ch->ctx->op_timeout_ms);
+}
+
+static void notify_stop_done(struct blz_op* op, blz_ret ret,
+							 sd_bus_message* reply)
+{
+	op->cb(ret, NULL, 0, op->ch, op->user);
+}
+
+blz_ret blz_char_notify_stop_async(blz_char* ch, blz_op_handler_t done,
+								   void* user)
+{
+	struct blz_op* op;
+
+	if (ch == NULL || done == NULL || !ch->notify_started) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	ch->notify_cb = NULL;
+	ch->notify_ext_cb = NULL;
+	ch->notify_user = NULL;
+	ch->notify_started = false;
+
+	/* nothing to wait for unless it was the last handle */
+	if (!list_empty(&ch->subs) || ch->chan == NULL || !chan_unlink(ch)
+		|| ch->dev == NULL) {
+		done(BLZ_OK, NULL, 0, ch, user);
+		return BLZ_OK;
+	}
+
+	op = op_new(ch, OP_NOTIFY_STOP, BLZ_PRIO_CONTROL, ch->ctx->op_timeout_ms,
+				notify_stop_done, user);
+	if (op == NULL) {
+		return BLZ_ERR;
+	}
+	op->cb = done;
+	return op_submit(op);
+}
+
+blz_sub* blz_char_subscribe(blz_char* ch, blz_notify_ext_handler_t cb,
+							void* user)
+{
+	if (ch == NULL || cb == NULL) {
+		return NULL;
+	}
+
+	struct blz_sub* sub = calloc(1, sizeof(struct blz_sub));
+	if (sub == NULL) {
+		LOG_ERR("BLZ: Subscription alloc failed");
+		return NULL;
+	}
+
+	if (chan_attach_wait(ch) != BLZ_OK) {
+		free(sub);
+		return NULL;
+	}
+
+	sub->ch = ch;
+	sub->cb = cb;
+	sub->user = user;
+	list_add_tail(&ch->subs, &sub->node);
+	return sub;
+}
+
+static void sub_free(struct blz_sub* sub)
+{
+	blz_char* ch = sub->ch;
+
+	if (ch->sub_cursor == &sub->node) {
+		ch->sub_cursor = sub->node.next;
+	}
+	list_del(&sub->node);
+	free(sub);
+}
+
+blz_ret blz_char_unsubscribe(blz_sub* sub)
+{
+	if (sub == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	blz_char* ch = sub->ch;
+	sub_free(sub);
+
+	if (ch->notify_started || !list_empty(&ch->subs)) {
+		return BLZ_OK;
+	}
+	return chan_detach(ch, true, ch->ctx->op_timeout_ms);
+}
+
+static void chan_restart_done(struct blz_op* op, blz_ret ret,
+							  sd_bus_message* reply)
+{
+	if (ret != BLZ_OK) {
+		LOG_ERR("BLZ: Failed to restart notifications of %s: %s",
+				op->ch->path, blz_errstr(ret));
+	}
+}
+
+/** start notifications of dev again after a reconnect, following moved
+ * characteristic paths */
+void notify_chans_restart(blz_dev* dev)
+{
+	blz_ctx* ctx = dev->ctx;
+
+	for (struct blz_list* n = ctx->notify_chans.next; n != &ctx->notify_chans;
+		 n = n->next) {
+		struct blz_notify_chan* chan
+			= list_entry(n, struct blz_notify_chan, node);
+
+		if (list_empty(&chan->chars)) {
+			continue;
+		}
+
+		blz_char* ch = list_entry(chan->chars.next, struct blz_char, chan_node);
+		if (ch->dev != dev) {
+			continue;
+		}
+
+		if (chan->slot == NULL || strcmp(chan->path, ch->path) != 0) {
+			strcpy(chan->path, ch->path);
+			chan->slot = sd_bus_slot_unref(chan->slot);
+			int r = sd_bus_match_signal(ctx->bus, &chan->slot, "org.bluez",
+										ch->path,
+										"org.freedesktop.DBus.Properties",
+										"PropertiesChanged", blz_notify_cb,
+										chan);
+			if (r < 0) {
+				LOG_ERR("BLZ: Failed to notify");
+				continue;
+			}
+		}
+
+		chan->notifying = false;
+		struct blz_op* op = op_new(ch, OP_NOTIFY_START, BLZ_PRIO_CONTROL,
+								   ctx->op_timeout_ms, chan_restart_done, NULL);
+		if (op != NULL) {
+			op_submit(op);
+		}
+	}
 }
 
 int blz_char_write_fd_acquire(blz_char* ch)
@@ -869,15 +2005,46 @@ exit:
 	return r;
 }
 
-/** frees dev */
+/** free dev without disconnecting it */
+void dev_free(blz_dev* dev)
+{
+	adapter_link(dev, false);
+	list_del(&dev->hash_node);
+
+	reconnect_stop(dev);
+	ops_fail_dev(dev, BLZ_ERR_NOT_CONNECTED);
+
+	/* handles may still be freed later, they must not touch the device */
+	while (!list_empty(&dev->servs)) {
+		blz_serv* srv = list_entry(dev->servs.next, struct blz_serv, dev_node);
+		srv->dev = NULL;
+		list_del(&srv->dev_node);
+	}
+	while (!list_empty(&dev->chars)) {
+		blz_char* ch = list_entry(dev->chars.next, struct blz_char, dev_node);
+		ch->dev = NULL;
+		list_del(&ch->dev_node);
+	}
+
+	/* free */
+	for (int i = 0; dev->service_uuids != NULL && dev->service_uuids[i] != NULL;
+		 i++) {
+		free(dev->service_uuids[i]);
+	}
+	free(dev->service_uuids);
+
+	free(dev);
+}
+
 void blz_disconnect(blz_dev* dev)
 {
 	if (!dev || !dev->ctx || !dev->ctx->bus) {
 		return;
 	}
 
-	if (dev->connect_slot) {
-		dev->connect_slot = sd_bus_slot_unref(dev->connect_slot);
+	/* still used by other callers of blz_connect() */
+	if (--dev->refcnt > 0) {
+		return;
 	}
 
 	if (dev->connected) {
@@ -895,14 +2062,7 @@ void blz_disconnect(blz_dev* dev)
 		sd_bus_error_free(&error);
 	}
 
-	/* free */
-	for (int i = 0; dev->service_uuids != NULL && dev->service_uuids[i] != NULL;
-		 i++) {
-		free(dev->service_uuids[i]);
-	}
-	free(dev->service_uuids);
-
-	free(dev);
+	dev_free(dev);
 }
 
 void blz_serv_free(blz_serv* sv)
@@ -914,52 +2074,117 @@ void blz_serv_free(blz_serv* sv)
 		free(sv->char_uuids[i]);
 	}
 	free(sv->char_uuids);
+	list_del(&sv->dev_node);
 	free(sv);
 }
 
 void blz_char_free(blz_char* ch)
 {
+	if (!ch) {
+		return;
+	}
+	while (!list_empty(&ch->subs)) {
+		sub_free(list_entry(ch->subs.next, struct blz_sub, node));
+	}
+	ch->notify_started = false;
+	chan_detach(ch, false, 0);
+	polls_remove(ch->ctx, ch);
+	ops_fail_char(ch, BLZ_ERR_INVALID_PARAM);
+	notify_batch_purge(ch->ctx, ch);
+	list_del(&ch->dev_node);
+	free(ch->cache);
+	free(ch->latest);
+	hist_free(ch->hist);
 	free(ch);
 }
 
-blz_ret blz_loop_one(blz_ctx* ctx, uint32_t timeout_ms)
+/* process what is already queued, so notifications arriving together are
+ * delivered as one batch. Under sustained traffic the queue never runs empty,
+ * so stop after LOOP_DRAIN_MAX messages or when a timer is due, to let op
+ * deadlines and polls run. Returns the last sd_bus_process() result, the
+ * remaining messages make sd_bus_get_timeout() return 0 */
+static int bus_drain(blz_ctx* ctx, int* cnt)
 {
-	if (!ctx || !ctx->bus) {
-		return BLZ_ERR_INVALID_PARAM;
+	int r = 0;
+
+	while (*cnt < LOOP_DRAIN_MAX && (r = sd_bus_process(ctx->bus, NULL)) > 0) {
+		(*cnt)++;
+		if (timer_now() >= timer_next(&ctx->timers)) {
+			break;
+		}
 	}
+	return r;
+}
 
-	int r = sd_bus_process(ctx->bus, NULL);
+/* wait at most timeout_us, or less if a timer expires earlier */
+static blz_ret loop_run(blz_ctx* ctx, uint64_t timeout_us)
+{
+	int cnt = 0;
+	int r = bus_drain(ctx, &cnt);
 	if (r < 0) {
 		LOG_ERR("BLZ: Loop process error: %s", strerror(-r));
+		notify_batch_flush(ctx);
 		return BLZ_ERR_BUS;
 	}
 
-	/* sd_bus_wait() should be called only if sd_bus_process() returned 0 */
-	if (r > 0) {
+	/* sd_bus_wait() should be called only if sd_bus_process() returned 0
+	 * the first time */
+	if (cnt > 0) {
+		notify_batch_flush(ctx);
+		timer_run(&ctx->timers, timer_now());
 		return BLZ_OK;
 	}
 
-	r = sd_bus_wait(ctx->bus, timeout_ms * 1000);
+	uint64_t next = timer_next(&ctx->timers);
+	if (next != TIMER_NONE) {
+		uint64_t now = timer_now();
+		uint64_t timer_us = next > now ? (next - now + 999) / 1000 : 0;
+		timeout_us = MIN(timeout_us, timer_us);
+	}
+
+	r = sd_bus_wait(ctx->bus, timeout_us);
 	if (r < 0 && -r != EINTR) {
 		LOG_ERR("BLZ: Loop wait error: %s", strerror(-r));
 	}
+
+	timer_run(&ctx->timers, timer_now());
 	return r >= 0 ? BLZ_OK : BLZ_ERR;
 }
 
+static blz_ret loop_one(blz_ctx* ctx, uint64_t timeout_us)
+{
+	blz_ret ret;
+
+	if (!ctx || !ctx->bus) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+	if (in_dispatch(ctx)) {
+		LOG_ERR("BLZ: Loop can not run inside a handler");
+		return BLZ_ERR;
+	}
+
+	ctx->dispatching++;
+	ret = loop_run(ctx, timeout_us);
+	ctx->dispatching--;
+	return ret;
+}
+
+blz_ret blz_loop_one(blz_ctx* ctx, uint32_t timeout_ms)
+{
+	return loop_one(ctx, (uint64_t)timeout_ms * 1000);
+}
+
 /** returns BLZ_OK, BLZ_ERR_TIMEOUT on timeout, BLZ_ERR on error */
 blz_ret blz_loop_wait(blz_ctx* ctx, bool* check, uint32_t timeout_ms)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	uint32_t current_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
-	uint32_t end_ms = current_ms + timeout_ms;
+	uint64_t now = timer_now();
+	uint64_t end = now + (uint64_t)timeout_ms * 1000000;
 
-	while (!*check && current_ms < end_ms) {
-		if (blz_loop_one(ctx, end_ms - current_ms) != BLZ_OK) {
+	while (!*check && now < end) {
+		if (loop_one(ctx, (end - now + 999) / 1000) != BLZ_OK) {
 			return BLZ_ERR;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		current_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		now = timer_now();
 	}
 
 	return *check ? BLZ_OK : BLZ_ERR_TIMEOUT;
@@ -970,13 +2195,47 @@ int blz_get_fd(blz_ctx* ctx)
 	return sd_bus_get_fd(ctx->bus);
 }
 
+int blz_get_timeout(blz_ctx* ctx)
+{
+	uint64_t bus_us = UINT64_MAX;
+	uint64_t next = timer_next(&ctx->timers);
+	uint64_t now = timer_now();
+
+	/* sd-bus reports an absolute CLOCK_MONOTONIC time as well */
+	if (sd_bus_get_timeout(ctx->bus, &bus_us) >= 0 && bus_us != UINT64_MAX) {
+		next = MIN(next, bus_us * 1000);
+	}
+
+	if (next == TIMER_NONE) {
+		return -1;
+	}
+	if (next <= now) {
+		return 0;
+	}
+	return MIN((next - now + 999999) / 1000000, INT_MAX);
+}
+
 void blz_handle_read(blz_ctx* ctx)
 {
-	int r = sd_bus_process(ctx->bus, NULL);
+	int cnt = 0;
+	int r;
+
+	if (in_dispatch(ctx)) {
+		LOG_ERR("BLZ: Loop can not run inside a handler");
+		return;
+	}
+
+	/* sd-bus may have more messages queued than are signalled on the fd,
+	 * blz_get_timeout() returns 0 for the ones left by the drain limit */
+	ctx->dispatching++;
+	r = bus_drain(ctx, &cnt);
 	if (r < 0) {
 		LOG_ERR("BLZ: Handle read process error: %s", strerror(-r));
-		return;
 	}
+
+	notify_batch_flush(ctx);
+	timer_run(&ctx->timers, timer_now());
+	ctx->dispatching--;
 }
 
 const char* blz_errstr(blz_ret r)
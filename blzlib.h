@@ -30,31 +30,225 @@ typedef enum {
 
 enum blz_addr_type { BLZ_ADDR_UNKNOWN, BLZ_ADDR_PUBLIC, BLZ_ADDR_RANDOM };
 
+/* choice of the adapter for new connections of a context with several */
+enum blz_placement { BLZ_PLACE_FEWEST_LINKS, BLZ_PLACE_BEST_RSSI };
+
+enum blz_adapter_state {
+	BLZ_ADAPTER_IDLE,
+	BLZ_ADAPTER_SCANNING,
+	BLZ_ADAPTER_SCAN_PAUSED, /* off period of the scan duty cycle */
+	BLZ_ADAPTER_CONNECTING,	 /* scan is paused while connecting */
+	_BLZ_ADAPTER_STATE_LAST,
+};
+
+/* cached properties of a device, bits of the property change handler */
+enum blz_dev_prop {
+	BLZ_DEV_RSSI = 0x01,
+	BLZ_DEV_NAME = 0x02,
+	BLZ_DEV_TX_POWER = 0x04,
+	BLZ_DEV_CONNECTED = 0x08,
+	BLZ_DEV_SERVICES_RESOLVED = 0x10,
+};
+
+#define BLZ_TX_POWER_UNKNOWN 127
+
+/* GATT operations are queued per device and sent in priority order */
+enum blz_prio {
+	BLZ_PRIO_CONTROL, /* notify enable, blocking writes */
+	BLZ_PRIO_NORMAL,  /* blocking reads */
+	BLZ_PRIO_BULK,	  /* polling and bulk transfers */
+	_BLZ_PRIO_LAST,
+};
+
 typedef struct blz_context blz_ctx;
 typedef struct blz_dev blz_dev;
 typedef struct blz_char blz_char;
 typedef struct blz_serv blz_serv;
+typedef struct blz_poll blz_poll;
+typedef struct blz_sub blz_sub;
+typedef struct blz_profile blz_profile;
+typedef struct blz_conn_req blz_conn_req;
+typedef struct blz_discovery blz_discovery;
+
+/** value lent from a read reply, valid until blz_view_release() */
+typedef struct blz_view {
+	const uint8_t* data;
+	size_t len;
+	void* priv;
+} blz_view;
+
+/** streams a long value through a caller supplied ring buffer */
+typedef struct blz_read_iter {
+	blz_char* ch;
+	uint8_t* ring;
+	size_t size;
+	size_t head;   /* bytes put into ring */
+	size_t tail;   /* bytes taken out of ring */
+	size_t offset; /* attribute offset of the next byte */
+	blz_view view; /* pending reply data not yet in the ring */
+	size_t view_pos;
+	bool eof;
+} blz_read_iter;
 
 typedef void (*blz_notify_handler_t)(const uint8_t* data, size_t len,
 									 blz_char* ch, void* user);
+
+/** arrival information of a notification. notifications carry no sequence
+ * number on the air, so gaps and lost are estimated from the inter-arrival
+ * times of periodic notifications */
+struct blz_notify_info {
+	uint64_t ts;	  /* CLOCK_MONOTONIC ns of dispatch */
+	uint32_t seq;	  /* per characteristic, first is 1 */
+	uint32_t gaps;	  /* number of gaps detected so far */
+	uint32_t lost;	  /* notifications estimated lost in all gaps */
+	uint32_t dropped; /* received but not delivered by blzlib */
+};
+
+/** little endian field types for history downsampling */
+enum blz_hist_type {
+	BLZ_HIST_U8,
+	BLZ_HIST_S8,
+	BLZ_HIST_U16,
+	BLZ_HIST_S16,
+	BLZ_HIST_U32,
+	BLZ_HIST_S32,
+	BLZ_HIST_FLOAT,
+};
+
+struct blz_hist_stat {
+	uint64_t start; /* window start, CLOCK_MONOTONIC ns */
+	size_t count;	/* entries in window, others are 0 if none */
+	double min;
+	double max;
+	double mean;
+};
+
+typedef void (*blz_notify_ext_handler_t)(const uint8_t* data, size_t len,
+										 const struct blz_notify_info* info,
+										 blz_char* ch, void* user);
+
+struct blz_notify_batch {
+	blz_char* ch;
+	const uint8_t* data;
+	size_t len;
+	uint64_t ts; /* CLOCK_MONOTONIC ns */
+	uint32_t seq;
+	uint32_t lost;
+};
+/** batch and data are only valid during the callback */
+typedef void (*blz_notify_batch_handler_t)(const struct blz_notify_batch* b,
+										   size_t n, void* user);
 typedef void (*blz_scan_handler_t)(const uint8_t* mac, enum blz_addr_type atype,
 								   int8_t rssi, const uint8_t* data, size_t len,
 								   void* user);
+/** connected is false when the link was lost and true when it was restored
+ * and all handles of the device are usable again */
+typedef void (*blz_reconnect_handler_t)(blz_dev* dev, bool connected,
+										void* user);
+struct blz_connect_info {
+	uint64_t queue_ns;	   /* from request until the first attempt */
+	uint64_t connect_ns;   /* duration of the last attempt */
+	unsigned int attempts; /* 0: handle of a connected device was shared */
+};
+
+/** dev is NULL when ret is not BLZ_OK */
+typedef void (*blz_connect_handler_t)(blz_dev* dev, blz_ret ret,
+									  const struct blz_connect_info* info,
+									  void* user);
+/* inventory of a discovery job */
+struct blz_inv_char {
+	char uuid[37];
+	uint8_t flags; /* GATT characteristic properties */
+};
+
+struct blz_inv_serv {
+	char uuid[37];
+	struct blz_inv_char* chars;
+	size_t chars_cnt;
+};
+
+struct blz_inv_dev {
+	char mac[18];
+	blz_ret ret; /* of the step which failed, BLZ_OK when complete */
+	struct blz_inv_serv* servs;
+	size_t servs_cnt;
+	unsigned int attempts;
+	uint64_t queue_ns;		/* waiting for a connect slot */
+	uint64_t connect_ns;	/* last attempt until services resolved */
+	uint64_t enum_ns;		/* listing services and characteristics */
+	uint64_t disconnect_ns; /* Disconnect call */
+	uint64_t total_ns;		/* from the start of the job */
+};
+
+/** ret is BLZ_OK when all adapters are powered on */
+typedef void (*blz_ready_handler_t)(blz_ctx* ctx, blz_ret ret, void* user);
+typedef void (*blz_discovery_handler_t)(blz_discovery* d, void* user);
+/** changed are the enum blz_dev_prop bits of properties which changed */
+typedef void (*blz_dev_prop_handler_t)(blz_dev* dev, uint32_t changed,
+									   void* user);
 typedef void (*blz_conn_handler_t)(bool connect, uint16_t conn_hdl, bool periph,
 								   void* user);
+/** data is only valid during the callback and NULL on error or for writes */
+typedef void (*blz_op_handler_t)(blz_ret ret, const uint8_t* data, size_t len,
+								 blz_char* ch, void* user);
 
 blz_ctx* blz_init(const char* dev);
+/** one context for n adapters, e.g. {"hci0", "hci1"}. Scans run on all of
+ * them, connections are placed as set by blz_set_placement() */
+blz_ctx* blz_init_multi(const char* const* devs, unsigned int n);
+/** returns without waiting for the adapters. Those which are not powered are
+ * powered on, and cb is called from the loop when all of them reported
+ * Powered, or with an error after timeout_ms (0: 10 sec). Scan or connect
+ * only after that, on error call blz_fini() */
+blz_ctx* blz_init_async(const char* const* devs, unsigned int n,
+						uint32_t timeout_ms, blz_ready_handler_t cb,
+						void* user);
+/** fewest links (default) or best RSSI of a scan in the last 30 seconds */
+void blz_set_placement(blz_ctx* ctx, enum blz_placement placement);
+/** number of connected devices of the idx-th adapter */
+unsigned int blz_adapter_links(blz_ctx* ctx, unsigned int idx);
+/** scan for on_ms and pause for off_ms alternately, 0 scans continuously
+ * (default). Independent of this, scans pause while connecting */
+void blz_set_scan_duty(blz_ctx* ctx, uint32_t on_ms, uint32_t off_ms);
+/** ns spent in each enum blz_adapter_state by the idx-th adapter */
+blz_ret blz_adapter_state_times(blz_ctx* ctx, unsigned int idx,
+								uint64_t ns[_BLZ_ADAPTER_STATE_LAST]);
+/** object path of the adapter dev is connected by */
+const char* blz_dev_adapter(blz_dev* dev);
 void blz_fini(blz_ctx* ctx);
 
 blz_ret blz_known_devices(blz_ctx* ctx, blz_scan_handler_t cb, void* user);
 blz_ret blz_scan_start(blz_ctx* ctx, blz_scan_handler_t cb, void* user);
 blz_ret blz_scan_stop(blz_ctx* ctx);
 
+/** returns the existing handle when the device is already connected by the
+ * context. Every blz_connect() needs its blz_disconnect() */
 blz_dev* blz_connect(blz_ctx* ctx, const char* macstr,
 					 enum blz_addr_type atype);
 
 void blz_set_connect_handler(blz_ctx* ctx, blz_conn_handler_t cb, void* user);
 
+/** reconnect dev whenever the link is lost, with a jittered delay doubling
+ * from min_ms up to max_ms. Service and characteristic handles stay valid
+ * and notifications are started again. max_ms 0 disables */
+blz_ret blz_dev_supervise(blz_dev* dev, uint32_t min_ms, uint32_t max_ms,
+						  blz_reconnect_handler_t cb, void* user);
+
+/* last values sent by BlueZ, reading them causes no bus traffic. RSSI is 0
+ * when unknown, BlueZ only updates it while discovering */
+int16_t blz_dev_rssi(blz_dev* dev);
+const char* blz_dev_name(blz_dev* dev);
+int16_t blz_dev_tx_power(blz_dev* dev);
+bool blz_dev_connected(blz_dev* dev);
+bool blz_dev_services_resolved(blz_dev* dev);
+/** call cb when one of the enum blz_dev_prop bits in mask changed, one
+ * handler per device, NULL removes it */
+void blz_dev_set_prop_handler(blz_dev* dev, uint32_t mask,
+							  blz_dev_prop_handler_t cb, void* user);
+
+/** default timeout for GATT operations, 0 resets to 25 sec */
+void blz_set_op_timeout(blz_ctx* ctx, uint32_t timeout_ms);
+
 /** returns NULL terminated list of service UUID strings, don't free them */
 char** blz_list_service_uuids(blz_dev* dev);
 blz_serv* blz_get_serv_from_uuid(blz_dev* dev, const char* uuid_srv);
@@ -63,24 +257,215 @@ blz_serv* blz_get_serv_from_uuid(blz_dev* dev, const char* uuid_srv);
 char** blz_list_char_uuids(blz_serv* srv);
 blz_char* blz_get_char_from_uuid(blz_serv* srv, const char* uuid_char);
 
+/** record the object paths and flags of all service and characteristic
+ * handles of dev, for devices of the same model and firmware */
+blz_profile* blz_profile_learn(blz_dev* dev);
+/** check with one property read that dev matches the profile. Afterwards
+ * blz_get_serv_from_uuid() and blz_get_char_from_uuid() take paths from the
+ * profile without searching. The profile must outlive the device */
+blz_ret blz_profile_apply(blz_profile* p, blz_dev* dev);
+void blz_profile_free(blz_profile* p);
+/** stable over restarts, identifies the profile in the device database */
+uint32_t blz_profile_id(const blz_profile* p);
+
+struct blz_devdb_entry {
+	enum blz_addr_type atype;
+	int16_t rssi;		 /* last seen in a scan */
+	uint32_t profile_id; /* last applied profile, 0 none */
+	uint32_t connect_ms; /* duration of the last blz_connect(), 0 never */
+	uint64_t last_seen;	 /* unix time */
+	char name[24];
+};
+
+/** keep learned address types and metadata of up to max_devices in a file
+ * which is mapped into memory. blz_connect() with BLZ_ADDR_UNKNOWN tries the
+ * learned address type first. A file of a different size is reset. When it
+ * is full, devices only seen in scans do not replace connected ones */
+blz_ret blz_devdb_open(blz_ctx* ctx, const char* path, unsigned int max_devices);
+void blz_devdb_close(blz_ctx* ctx);
+blz_ret blz_devdb_get(blz_ctx* ctx, const char* macstr,
+					  struct blz_devdb_entry* out);
+
+/** remove devices which are not paired, connected or used by a handle from
+ * BlueZ when they were not seen in a scan for ttl_sec, and the least
+ * recently seen of them while the adapters have more than max_devices.
+ * Checked periodically, both 0 disables */
+blz_ret blz_set_device_ttl(blz_ctx* ctx, uint32_t ttl_sec,
+						   unsigned int max_devices);
+
+/* GATT operations fail with BLZ_ERR_NOT_CONNECTED without any bus traffic
+ * when the device is known to be disconnected and with BLZ_ERR_TIMEOUT when
+ * the operation timeout (blz_set_op_timeout or _timeout variant) expired.
+ *
+ * The blocking calls (reads, writes, notify start and stop, unsubscribe) run
+ * the loop until they complete: other handlers and timers run meanwhile and
+ * must not free the handle in use. Called from inside a handler they can not
+ * run the loop, they block on the reply without dispatching anything else,
+ * for no longer than the operation timeout or the timeout_ms of the _timeout
+ * variant */
 blz_ret blz_char_write(blz_char* ch, const uint8_t* data, size_t len);
+blz_ret blz_char_write_timeout(blz_char* ch, const uint8_t* data, size_t len,
+							   uint32_t timeout_ms);
 blz_ret blz_char_write_cmd(blz_char* ch, const uint8_t* data, size_t len);
 blz_ret blz_char_read(blz_char* ch, uint8_t* data, size_t* len);
+blz_ret blz_char_read_timeout(blz_char* ch, uint8_t* data, size_t* len,
+							  uint32_t timeout_ms);
+/** read without copying and without length limit. The view keeps the reply
+ * message referenced and has to be released with blz_view_release() */
+blz_ret blz_char_read_view(blz_char* ch, blz_view* view);
+void blz_view_release(blz_view* view);
+/** long values: read from or write to the attribute at offset. BlueZ reads
+ * from offset up to the end of the value, writes use prepared writes */
+blz_ret blz_char_read_range(blz_char* ch, uint16_t offset, uint8_t* data,
+							size_t* len);
+blz_ret blz_char_write_range(blz_char* ch, uint16_t offset,
+							 const uint8_t* data, size_t len);
+/** read a long value in MTU sized chunks into ring. Call fill until it
+ * returns an error or done is true and take data out with get. After an error
+ * fill resumes at the offset where it failed */
+void blz_read_iter_init(blz_read_iter* it, blz_char* ch, uint8_t* ring,
+						size_t size);
+blz_ret blz_read_iter_fill(blz_read_iter* it);
+size_t blz_read_iter_get(blz_read_iter* it, uint8_t* dst, size_t len);
+bool blz_read_iter_done(const blz_read_iter* it);
+void blz_read_iter_release(blz_read_iter* it);
+/** let blz_char_read return the last value seen from a read or notification
+ * if it is not older than ttl_ms, without ATT traffic. The cached value is
+ * dropped when the device disconnects. 0 disables the cache */
+blz_ret blz_char_set_cache_ttl(blz_char* ch, uint32_t ttl_ms);
+/** read n characteristics with overlapping requests. lens are in/out like
+ * for blz_char_read, status gets the result per characteristic (BLZ_ERR_SIZE
+ * if the buffer was too small). returns the first error or BLZ_OK */
+blz_ret blz_char_read_multi(blz_char** chars, uint8_t** bufs, size_t* lens,
+							blz_ret* status, size_t n);
+/** the handler may be called, and may stop again, before this returns.
+ * Called from a handler while another handle of the characteristic starts,
+ * it returns before the start completed: if that fails, both are stopped */
 blz_ret blz_char_notify_start(blz_char* ch, blz_notify_handler_t cb,
 							  void* user);
 blz_ret blz_char_indicate_start(blz_char* ch, blz_notify_handler_t cb,
 								void* user);
+/** like blz_char_notify_start() with dispatch timestamp, sequence number
+ * and loss counters passed to the handler */
+blz_ret blz_char_notify_start_ext(blz_char* ch, blz_notify_ext_handler_t cb,
+								  void* user);
+/** add a subscriber to notifications of a characteristic. Any number of
+ * subscribers on any handles of the same characteristic share a single
+ * StartNotify, which is stopped with the last one. The handler of
+ * blz_char_notify_start() counts as one subscriber of the handle */
+blz_sub* blz_char_subscribe(blz_char* ch, blz_notify_ext_handler_t cb,
+							void* user);
+blz_ret blz_char_unsubscribe(blz_sub* sub);
+/** start notifications which only keep the newest value (up to max_len
+ * bytes) in a slot that can be read lock-free from any thread with
+ * blz_char_latest(). seq counts the notifications, 0 means none yet.
+ * When already started with blz_char_notify_start() the handler is still
+ * called as well */
+blz_ret blz_char_notify_start_latest(blz_char* ch, size_t max_len);
+blz_ret blz_char_latest(blz_char* ch, uint8_t* buf, size_t* len, uint32_t* seq);
+/** keep the last capacity notifications with up to stride bytes each in a
+ * preallocated ring. 0 capacity disables and frees it. Payloads are
+ * truncated or zero padded to stride. Only access from the loop thread */
+blz_ret blz_char_history_enable(blz_char* ch, size_t capacity, size_t stride);
+size_t blz_char_history_len(blz_char* ch);
+/** copy up to max entries with from <= ts < to, oldest first, into the
+ * columns ts, data (stride bytes each) and lens. Each may be NULL.
+ * Returns number of entries */
+size_t blz_char_history_range(blz_char* ch, uint64_t from, uint64_t to,
+							  uint64_t* ts, uint8_t* data, size_t* lens,
+							  size_t max);
+/** min/max/mean of the field at offset for n consecutive windows of
+ * window_ns starting at from */
+blz_ret blz_char_history_downsample(blz_char* ch, uint64_t from,
+									uint64_t window_ns, size_t offset,
+									enum blz_hist_type type,
+									struct blz_hist_stat* out, size_t n);
+/** when set, notifications of all characteristics received in one drain of
+ * the bus (blz_loop_one, blz_handle_read) are delivered in one call instead
+ * of the per characteristic handlers. cb may be NULL in notify_start then.
+ * Pending entries of a characteristic are dropped when it is freed, entries
+ * already passed to the handler must not be used after freeing theirs */
+void blz_set_notify_batch_handler(blz_ctx* ctx, blz_notify_batch_handler_t cb,
+								  void* user);
 blz_ret blz_char_notify_stop(blz_char* ch);
+blz_ret blz_char_notify_stop_timeout(blz_char* ch, uint32_t timeout_ms);
+/* asynchronous operations, cb is called from blz_loop_one/blz_handle_read.
+ * Not more than per_dev operations of one device and total operations overall
+ * are sent to BlueZ at the same time, 0 resets to the default (2 and 64) */
+blz_ret blz_char_read_async(blz_char* ch, enum blz_prio prio,
+							blz_op_handler_t cb, void* user);
+blz_ret blz_char_write_async(blz_char* ch, const uint8_t* data, size_t len,
+							 enum blz_prio prio, blz_op_handler_t cb,
+							 void* user);
+/** like blz_char_notify_start_ext() and blz_char_notify_stop(), done gets
+ * the result. When BLZ_OK is returned it is always called, right away if
+ * there is nothing to wait for. A failed start stops the handle again.
+ * Stopping or freeing the handle while its start is in flight fails the
+ * start with BLZ_ERR */
+blz_ret blz_char_notify_start_async(blz_char* ch, blz_notify_ext_handler_t cb,
+									void* user, blz_op_handler_t done,
+									void* done_user);
+blz_ret blz_char_notify_stop_async(blz_char* ch, blz_op_handler_t done,
+								   void* user);
+void blz_set_max_inflight(blz_ctx* ctx, unsigned int per_dev,
+						  unsigned int total);
+
+/** read ch every period_ms and pass the result to cb. Reads are skipped while
+ * the device is disconnected and the period is stretched while the link can
+ * not keep up. Polls are removed by blz_char_free() */
+blz_poll* blz_poll_add(blz_char* ch, uint32_t period_ms, blz_op_handler_t cb,
+					   void* user);
+void blz_poll_remove(blz_poll* p);
+
 /** returns fd or -1 on error. need to close(fd) to release */
 int blz_char_write_fd_acquire(blz_char* ch);
 
+/** the loop functions fail with BLZ_ERR inside handlers, so does the loop of
+ * blz_connect() unless the device is already connected */
 blz_ret blz_loop_one(blz_ctx* ctx, uint32_t timeout_ms);
 blz_ret blz_loop_wait(blz_ctx* ctx, bool* check, uint32_t timeout_ms);
 int blz_get_fd(blz_ctx* ctx);
+/** returns ms until blz_handle_read() has to be called even when the fd did
+ * not become readable (pending timers), or -1 for infinite. For poll() */
+int blz_get_timeout(blz_ctx* ctx);
+/** call when fd is readable or the timeout from blz_get_timeout() expired */
 void blz_handle_read(blz_ctx* ctx);
 
-/* this frees dev */
+/* this frees dev when it is the last reference */
 void blz_disconnect(blz_dev* dev);
+
+/** queue a connect request. Up to max (see blz_set_max_connecting) requests
+ * per adapter are connecting at a time, the others wait by priority. A
+ * request that is not connected deadline_ms (0: no limit) after it was queued
+ * fails with BLZ_ERR_TIMEOUT. blz_connect() is a request of highest priority
+ * without retries. Requests for a device which is connected or being
+ * connected complete with another reference to the same blz_dev. The handle
+ * is valid until cb is called */
+blz_conn_req* blz_connect_async(blz_ctx* ctx, const char* macstr,
+								enum blz_addr_type atype, enum blz_prio prio,
+								uint32_t deadline_ms, blz_connect_handler_t cb,
+								void* user);
+/** cb is not called */
+void blz_connect_cancel(blz_conn_req* req);
+/** max connects in progress per adapter. Failed attempts are retried up to
+ * retries times with a delay doubling from one second. max 0 resets to the
+ * default (1) */
+void blz_set_max_connecting(blz_ctx* ctx, unsigned int max,
+							unsigned int retries);
+unsigned int blz_connect_queue_len(blz_ctx* ctx);
+
+/** connect to n devices, list their services and characteristics and
+ * disconnect again, with up to width devices in progress at a time. How many
+ * of them are connecting at the same time is still limited by
+ * blz_set_max_connecting(). cb is called once when all devices are done, the
+ * job has to be freed with blz_discovery_free() before blz_fini() */
+blz_discovery* blz_discovery_start(blz_ctx* ctx, const char* const* macs,
+								   size_t n, unsigned int width,
+								   blz_discovery_handler_t cb, void* user);
+/** inventory in the order of the MACs, valid until the job is freed */
+const struct blz_inv_dev* blz_discovery_result(blz_discovery* d, size_t* n);
+/** cancels devices still in progress, cb is not called */
+void blz_discovery_free(blz_discovery* d);
 void blz_serv_free(blz_serv* srv);
 void blz_char_free(blz_char* ch);
 
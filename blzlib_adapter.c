@@ -0,0 +1,483 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Adapters of a context
+ *
+ * A context can span several adapters. Scans run on all of them and the
+ * results are delivered to the same handler, while the last RSSI of every
+ * device per adapter is kept in a small direct mapped cache. New connections
+ * are placed on the adapter with the fewest links or, if configured and the
+ * device was seen recently, on the adapter which received it best.
+ *
+ * Each adapter also owns its discovery: it is stopped while connections are
+ * being set up on the adapter, which otherwise slows them down badly, and
+ * restarted afterwards if a scan is running. A scan can be duty cycled with
+ * on and off periods. The time spent in each state is accounted.
+ *
+ * At initialization, adapters which are not powered are powered on, and the
+ * context is ready when all of them reported Powered in a PropertiesChanged
+ * signal. All of this is done with asynchronous calls for all adapters at
+ * once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define RSSI_CACHE_SIZE 256
+#define RSSI_MAX_AGE	30 /* sec */
+
+/* clang-format off */
+struct adapter_rssi {
+	uint8_t		mac[6];
+	int8_t		rssi[ADAPTERS_MAX];
+	uint64_t	ts[ADAPTERS_MAX]; /* ns, 0 not seen */
+};
+/* clang-format on */
+
+static unsigned int rssi_slot(const uint8_t* mac)
+{
+	/* the low bytes of a MAC address are random enough */
+	return (mac[0] ^ (mac[1] << 3) ^ (mac[2] << 5)) % RSSI_CACHE_SIZE;
+}
+
+static void adapter_timer_cb(struct blz_timer* t, void* user);
+static void adapters_ready_timer_cb(struct blz_timer* t, void* user);
+
+blz_ret adapters_init(blz_ctx* ctx, const char* const* devs, unsigned int n)
+{
+	uint64_t now = timer_now();
+
+	timer_init(&ctx->ready_timer, adapters_ready_timer_cb, ctx);
+	for (unsigned int i = 0; i < ADAPTERS_MAX; i++) {
+		ctx->adapters[i].ctx = ctx;
+		ctx->adapters[i].state_ts = now;
+		timer_init(&ctx->adapters[i].duty_timer, adapter_timer_cb,
+				   &ctx->adapters[i]);
+	}
+
+	if (n == 0 || n > ADAPTERS_MAX) {
+		LOG_ERR("BLZ: Invalid number of adapters %u", n);
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		int r = snprintf(ctx->adapters[i].path, DBUS_PATH_MAX_LEN,
+						 "/org/bluez/%s", devs[i]);
+		if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
+			LOG_ERR("BLZ: Failed to construct path");
+			return BLZ_ERR_INVALID_PARAM;
+		}
+	}
+	ctx->adapters_cnt = n;
+
+	if (n > 1) {
+		ctx->rssi_cache = calloc(RSSI_CACHE_SIZE, sizeof(struct adapter_rssi));
+		if (ctx->rssi_cache == NULL) {
+			LOG_ERR("BLZ: RSSI cache alloc failed");
+			return BLZ_ERR;
+		}
+	}
+	return BLZ_OK;
+}
+
+static void adapters_power_stop(blz_ctx* ctx)
+{
+	timer_cancel(&ctx->ready_timer);
+	for (unsigned int i = 0; i < ADAPTERS_MAX; i++) {
+		struct blz_adapter* a = &ctx->adapters[i];
+		a->power_slot = sd_bus_slot_unref(a->power_slot);
+		a->power_match = sd_bus_slot_unref(a->power_match);
+	}
+}
+
+void adapters_fini(blz_ctx* ctx)
+{
+	adapters_power_stop(ctx);
+	for (unsigned int i = 0; i < ADAPTERS_MAX; i++) {
+		timer_cancel(&ctx->adapters[i].duty_timer);
+		ctx->adapters[i].disc_slot
+			= sd_bus_slot_unref(ctx->adapters[i].disc_slot);
+	}
+	free(ctx->rssi_cache);
+	ctx->rssi_cache = NULL;
+}
+
+static void adapters_ready(blz_ctx* ctx, blz_ret ret)
+{
+	blz_ready_handler_t cb = ctx->ready_cb;
+
+	if (!ctx->ready_pending) {
+		return;
+	}
+	ctx->ready_pending = false;
+	adapters_power_stop(ctx);
+
+	if (cb) {
+		cb(ctx, ret, ctx->ready_user);
+	}
+}
+
+static void adapters_ready_check(blz_ctx* ctx)
+{
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		if (!ctx->adapters[i].powered) {
+			return;
+		}
+	}
+	adapters_ready(ctx, BLZ_OK);
+}
+
+static void adapters_ready_timer_cb(struct blz_timer* t, void* user)
+{
+	blz_ctx* ctx = user;
+
+	LOG_ERR("BLZ: Timeout waiting for adapters to power on");
+	adapters_ready(ctx, BLZ_ERR_TIMEOUT);
+}
+
+static int adapter_props_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct blz_adapter* a = user;
+
+	/* error logging done in function */
+	msg_parse_interface(m, MSG_ADAPTER, NULL, a);
+	if (a->powered) {
+		LOG_INF("BLZ: Adapter %s powered", a->path);
+		adapters_ready_check(a->ctx);
+	}
+	return 0;
+}
+
+static int adapter_power_set_cb(sd_bus_message* reply, void* user,
+								sd_bus_error* err)
+{
+	struct blz_adapter* a = user;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+
+	a->power_slot = sd_bus_slot_unref(a->power_slot);
+
+	/* success is confirmed by PropertiesChanged */
+	if (e != NULL) {
+		LOG_ERR("BLZ: Failed to power on %s: %s", a->path, e->message);
+		adapters_ready(a->ctx, BLZ_ERR);
+	}
+	return 0;
+}
+
+static int adapter_powered_cb(sd_bus_message* reply, void* user,
+							  sd_bus_error* err)
+{
+	struct blz_adapter* a = user;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+	int b = 0;
+	int r;
+
+	a->power_slot = sd_bus_slot_unref(a->power_slot);
+
+	if (e != NULL) {
+		if (sd_bus_error_has_name(e, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
+			LOG_ERR("BLZ: Adapter %s not known", a->path);
+		} else {
+			LOG_ERR("BLZ: Failed to get Powered: %s", e->message);
+		}
+		adapters_ready(a->ctx, BLZ_ERR);
+		return 0;
+	}
+
+	if (msg_read_variant(reply, "b", &b) >= 0 && b) {
+		a->powered = true;
+		adapters_ready_check(a->ctx);
+		return 0;
+	}
+
+	LOG_INF("BLZ: Powering on %s", a->path);
+	r = sd_bus_call_method_async(a->ctx->bus, &a->power_slot, "org.bluez",
+								 a->path, "org.freedesktop.DBus.Properties",
+								 "Set", adapter_power_set_cb, a, "ssv",
+								 "org.bluez.Adapter1", "Powered", "b", 1);
+	if (r < 0) {
+		LOG_ERR("BLZ: Failed to power on %s", a->path);
+		adapters_ready(a->ctx, BLZ_ERR_BUS);
+	}
+	return 0;
+}
+
+/** power on all adapters which are not, cb is called when they all are */
+blz_ret adapters_power_on(blz_ctx* ctx, uint32_t timeout_ms,
+						  blz_ready_handler_t cb, void* user)
+{
+	int r;
+
+	ctx->ready_cb = cb;
+	ctx->ready_user = user;
+	ctx->ready_pending = true;
+	timer_arm(&ctx->timers, &ctx->ready_timer,
+			  timer_now() + (uint64_t)timeout_ms * 1000000);
+
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		struct blz_adapter* a = &ctx->adapters[i];
+
+		/* subscribe first, so the change can't be missed */
+		r = sd_bus_match_signal(ctx->bus, &a->power_match, "org.bluez",
+								a->path, "org.freedesktop.DBus.Properties",
+								"PropertiesChanged", adapter_props_cb, a);
+		if (r >= 0) {
+			r = sd_bus_call_method_async(
+				ctx->bus, &a->power_slot, "org.bluez", a->path,
+				"org.freedesktop.DBus.Properties", "Get", adapter_powered_cb,
+				a, "ss", "org.bluez.Adapter1", "Powered");
+		}
+		if (r < 0) {
+			LOG_ERR("BLZ: Failed to get Powered of %s", a->path);
+			ctx->ready_pending = false;
+			adapters_power_stop(ctx);
+			return BLZ_ERR_BUS;
+		}
+	}
+	return BLZ_OK;
+}
+
+/** adapter of a device object path or NULL if it is not one of ours */
+struct blz_adapter* adapter_of(blz_ctx* ctx, const char* opath)
+{
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		size_t len = strlen(ctx->adapters[i].path);
+		if (strncmp(opath, ctx->adapters[i].path, len) == 0
+			&& (opath[len] == '/' || opath[len] == '\0')) {
+			return &ctx->adapters[i];
+		}
+	}
+	return NULL;
+}
+
+void adapter_seen(blz_ctx* ctx, struct blz_adapter* a, const uint8_t* mac,
+				  int16_t rssi)
+{
+	struct adapter_rssi* e;
+	unsigned int idx = a - ctx->adapters;
+
+	if (ctx->rssi_cache == NULL || rssi == 0) {
+		return;
+	}
+
+	e = &ctx->rssi_cache[rssi_slot(mac)];
+	if (memcmp(e->mac, mac, 6) != 0) {
+		memset(e, 0, sizeof(*e));
+		memcpy(e->mac, mac, 6);
+	}
+	e->rssi[idx] = MAX(rssi, INT8_MIN);
+	e->ts[idx] = timer_now();
+}
+
+static struct blz_adapter* adapter_best_rssi(blz_ctx* ctx, const uint8_t* mac)
+{
+	struct adapter_rssi* e;
+	uint64_t now = timer_now();
+	int best = -1;
+
+	if (ctx->rssi_cache == NULL) {
+		return NULL;
+	}
+
+	e = &ctx->rssi_cache[rssi_slot(mac)];
+	if (memcmp(e->mac, mac, 6) != 0) {
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		if (e->ts[i] != 0 && now - e->ts[i] < RSSI_MAX_AGE * 1000000000ULL
+			&& (best < 0 || e->rssi[i] > e->rssi[best])) {
+			best = i;
+		}
+	}
+	return best >= 0 ? &ctx->adapters[best] : NULL;
+}
+
+/** adapter for a new connection to mac, NULL when it has to wait for a free
+ * connect slot */
+struct blz_adapter* adapter_place(blz_ctx* ctx, const uint8_t* mac)
+{
+	struct blz_adapter* best = NULL;
+
+	if (ctx->placement == BLZ_PLACE_BEST_RSSI) {
+		struct blz_adapter* a = adapter_best_rssi(ctx, mac);
+		if (a != NULL) {
+			return a->conn_inflight < ctx->conn_max_inflight ? a : NULL;
+		}
+	}
+
+	/* connections being set up count as links */
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		struct blz_adapter* a = &ctx->adapters[i];
+		if (a->conn_inflight < ctx->conn_max_inflight
+			&& (best == NULL
+				|| a->links + a->conn_inflight
+					   < best->links + best->conn_inflight)) {
+			best = a;
+		}
+	}
+	return best;
+}
+
+/** keep the link count of the adapter of dev up to date */
+void adapter_link(blz_dev* dev, bool up)
+{
+	if (dev->adapter == NULL || dev->linked == up) {
+		return;
+	}
+	dev->linked = up;
+	if (up) {
+		dev->adapter->links++;
+	} else {
+		dev->adapter->links--;
+	}
+}
+
+static int adapter_disc_cb(sd_bus_message* reply, void* user,
+						   sd_bus_error* err)
+{
+	struct blz_adapter* a = user;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+
+	if (e != NULL) {
+		LOG_ERR("BLZ: Failed to %s scan on %s: %s",
+				a->discovering ? "start" : "stop", a->path, e->message);
+	}
+	a->disc_slot = sd_bus_slot_unref(a->disc_slot);
+	return 0;
+}
+
+static void adapter_discovery(struct blz_adapter* a, bool on)
+{
+	int r;
+
+	if (a->discovering == on) {
+		return;
+	}
+
+	/* calls are handled in order by BlueZ, a stop is always done before a
+	 * connect which is sent later */
+	a->discovering = on;
+	a->disc_slot = sd_bus_slot_unref(a->disc_slot);
+	r = sd_bus_call_method_async(a->ctx->bus, &a->disc_slot, "org.bluez",
+								 a->path, "org.bluez.Adapter1",
+								 on ? "StartDiscovery" : "StopDiscovery",
+								 adapter_disc_cb, a, "");
+	if (r < 0) {
+		LOG_ERR("BLZ: Failed to %s scan on %s", on ? "start" : "stop",
+				a->path);
+	}
+}
+
+static void adapter_enter(struct blz_adapter* a, enum blz_adapter_state st)
+{
+	blz_ctx* ctx = a->ctx;
+	uint64_t now = timer_now();
+
+	a->state_ns[a->state] += now - a->state_ts;
+	a->state_ts = now;
+	a->state = st;
+
+	timer_cancel(&a->duty_timer);
+	if (st == BLZ_ADAPTER_SCANNING && ctx->scan_off_ms > 0) {
+		timer_arm(&ctx->timers, &a->duty_timer,
+				  now + (uint64_t)ctx->scan_on_ms * 1000000);
+	} else if (st == BLZ_ADAPTER_SCAN_PAUSED) {
+		timer_arm(&ctx->timers, &a->duty_timer,
+				  now + (uint64_t)ctx->scan_off_ms * 1000000);
+	}
+
+	adapter_discovery(a, st == BLZ_ADAPTER_SCANNING);
+}
+
+static void adapter_timer_cb(struct blz_timer* t, void* user)
+{
+	struct blz_adapter* a = user;
+
+	adapter_enter(a, a->state == BLZ_ADAPTER_SCANNING ? BLZ_ADAPTER_SCAN_PAUSED
+													  : BLZ_ADAPTER_SCANNING);
+}
+
+/** bring discovery in line with connects in progress and the scan */
+void adapter_update(struct blz_adapter* a)
+{
+	enum blz_adapter_state st;
+
+	if (a->conn_inflight > 0) {
+		st = BLZ_ADAPTER_CONNECTING;
+	} else if (!a->ctx->scan_wanted) {
+		st = BLZ_ADAPTER_IDLE;
+	} else if (a->state == BLZ_ADAPTER_SCAN_PAUSED) {
+		st = BLZ_ADAPTER_SCAN_PAUSED;
+	} else {
+		st = BLZ_ADAPTER_SCANNING;
+	}
+
+	if (st != a->state) {
+		adapter_enter(a, st);
+	}
+}
+
+void adapters_update(blz_ctx* ctx)
+{
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		adapter_update(&ctx->adapters[i]);
+	}
+}
+
+void blz_set_scan_duty(blz_ctx* ctx, uint32_t on_ms, uint32_t off_ms)
+{
+	ctx->scan_on_ms = on_ms;
+	ctx->scan_off_ms = on_ms > 0 ? off_ms : 0;
+
+	/* start the new cycle */
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		struct blz_adapter* a = &ctx->adapters[i];
+		if (a->state == BLZ_ADAPTER_SCANNING
+			|| a->state == BLZ_ADAPTER_SCAN_PAUSED) {
+			adapter_enter(a, BLZ_ADAPTER_SCANNING);
+		}
+	}
+}
+
+blz_ret blz_adapter_state_times(blz_ctx* ctx, unsigned int idx,
+								uint64_t ns[_BLZ_ADAPTER_STATE_LAST])
+{
+	struct blz_adapter* a;
+
+	if (ctx == NULL || idx >= ctx->adapters_cnt || ns == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	a = &ctx->adapters[idx];
+	memcpy(ns, a->state_ns, sizeof(a->state_ns));
+	ns[a->state] += timer_now() - a->state_ts;
+	return BLZ_OK;
+}
+
+void blz_set_placement(blz_ctx* ctx, enum blz_placement placement)
+{
+	ctx->placement = placement;
+}
+
+unsigned int blz_adapter_links(blz_ctx* ctx, unsigned int idx)
+{
+	return idx < ctx->adapters_cnt ? ctx->adapters[idx].links : 0;
+}
+
+const char* blz_dev_adapter(blz_dev* dev)
+{
+	return dev->adapter->path;
+}
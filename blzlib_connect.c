@@ -0,0 +1,820 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Connection manager
+ *
+ * Controllers stall or fail when too many LE connections are being created
+ * at the same time, so connect requests are queued by priority and at most
+ * conn_max_inflight of them are worked on per adapter at a time.
+ * Each request is a chain of asynchronous calls: the Connected property
+ * tells whether BlueZ knows the device, then Device1.Connect or
+ * Adapter1.ConnectDevice is called and ServicesResolved is awaited. Failed
+ * attempts free their slot and are queued again after a doubling delay,
+ * unless the retries or the deadline of the request are used up.
+ * blz_connect() is a request of the highest priority without retries.
+ *
+ * A device which is already connected by a handle of the registry is not
+ * connected again, the request completes with another reference to it. A
+ * request for a device which is being connected joins the request in
+ * progress and completes with it, with another reference to the same handle.
+ * A cancelled request which others have joined goes on for them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+enum conn_step {
+	CONN_QUEUED,
+	CONN_STATUS,   /* Get Connected */
+	CONN_RESOLVED, /* Get ServicesResolved of a connected device */
+	CONN_KNOWN,	   /* Device1.Connect */
+	CONN_NEW,	   /* Adapter1.ConnectDevice */
+	CONN_RESOLVING,
+	CONN_ATYPE, /* Get AddressType */
+	CONN_BACKOFF,
+	CONN_REUSED, /* completes with the registered handle */
+	CONN_JOINED, /* waits for the request of the same device */
+};
+
+/* clang-format off */
+struct blz_conn_req {
+	struct blz_list		node; /* in conn_queue, conn_active or waiters */
+	blz_ctx*			ctx;
+	char				mac[MAC_STR_LEN];
+	uint8_t				mac_b[6];
+	enum blz_addr_type	atype; /* as requested */
+	enum blz_prio		prio;
+	enum conn_step		step;
+	bool				pub; /* address type of ConnectDevice */
+	bool				tried_other;
+	unsigned int		retries;
+	unsigned int		attempts;
+	uint64_t			enqueued;	/* ns */
+	uint64_t			started;	/* ns, first attempt */
+	uint64_t			attempt_ts; /* ns, current attempt */
+	uint64_t			deadline;	/* ns, 0 none */
+	struct blz_timer	timer;
+	sd_bus_slot*		slot;
+	struct blz_adapter*	adapter; /* of the current attempt */
+	blz_dev*			dev;
+	blz_connect_handler_t cb;
+	void*				user;
+	struct blz_conn_req* joined; /* CONN_JOINED: the request waited for */
+	struct blz_list		waiters; /* requests which joined this one */
+	bool				orphan; /* cancelled, goes on for the waiters */
+};
+/* clang-format on */
+
+static void conn_dispatch(blz_ctx* ctx);
+
+static uint64_t conn_timeout(struct blz_conn_req* req, uint64_t timeout_ns)
+{
+	uint64_t now = timer_now();
+
+	if (req->deadline != 0) {
+		timeout_ns = MIN(timeout_ns,
+						 req->deadline > now ? req->deadline - now : 1000);
+	}
+	return timeout_ns;
+}
+
+static int conn_reply_cb(sd_bus_message* reply, void* user, sd_bus_error* err);
+
+static int conn_get_property(struct blz_conn_req* req, const char* name)
+{
+	return sd_bus_call_method_async(
+		req->ctx->bus, &req->slot, "org.bluez", req->dev->path,
+		"org.freedesktop.DBus.Properties", "Get", conn_reply_cb, req, "ss",
+		"org.bluez.Device1", name);
+}
+
+static int conn_send_known(struct blz_conn_req* req)
+{
+	sd_bus_message* call = NULL;
+	int r;
+
+	req->step = CONN_KNOWN;
+	r = sd_bus_message_new_method_call(req->ctx->bus, &call, "org.bluez",
+									   req->dev->path, "org.bluez.Device1",
+									   "Connect");
+	if (r >= 0) {
+		/* can take longer than the normal sd_bus timeout */
+		r = sd_bus_call_async(
+			req->ctx->bus, &req->slot, call, conn_reply_cb, req,
+			conn_timeout(req, CONNECT_TIMEOUT * 1000000000ULL) / 1000);
+	}
+	sd_bus_message_unref(call);
+	return r;
+}
+
+static int conn_send_new(struct blz_conn_req* req)
+{
+	sd_bus_message* call = NULL;
+	int r;
+
+	req->step = CONN_NEW;
+	LOG_INF("BLZ: Connect new to %s (%s)", req->mac,
+			req->pub ? "public" : "random");
+
+	/* ConnectDevice is only supported from Bluez 5.49 on */
+	r = sd_bus_message_new_method_call(req->ctx->bus, &call, "org.bluez",
+									   req->adapter->path, "org.bluez.Adapter1",
+									   "ConnectDevice");
+	if (r >= 0) {
+		r = sd_bus_message_open_container(call, 'a', "{sv}");
+	}
+	if (r >= 0) {
+		r = msg_append_property(call, "Address", 's', req->mac);
+	}
+	/* AddressType must either be public or random for BLE, otherwise a
+	 * Bluetooth classic connection (BR/EDR) is attempted */
+	if (r >= 0) {
+		r = msg_append_property(call, "AddressType", 's',
+								req->pub ? "public" : "random");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(call);
+	}
+	if (r >= 0) {
+		r = sd_bus_call_async(
+			req->ctx->bus, &req->slot, call, conn_reply_cb, req,
+			conn_timeout(req, CONNECT_TIMEOUT * 1000000000ULL) / 1000);
+	}
+	sd_bus_message_unref(call);
+	return r;
+}
+
+/* free the device of a failed attempt. Connect calls may have failed with
+ * timeout, in this situation bluez is still trying to open the connection.
+ * Calling Disconnect cancels the connection attempt */
+static void conn_drop_dev(struct blz_conn_req* req)
+{
+	blz_dev* dev = req->dev;
+
+	if (dev == NULL) {
+		return;
+	}
+	if (req->step == CONN_REUSED) {
+		dev->refcnt--;
+		req->dev = NULL;
+		return;
+	}
+	if (req->step >= CONN_KNOWN) {
+		sd_bus_call_method_async(req->ctx->bus, NULL, "org.bluez", dev->path,
+								 "org.bluez.Device1", "Disconnect", NULL, NULL,
+								 "");
+	}
+	dev->creq = NULL;
+	dev_unref(dev);
+	req->dev = NULL;
+}
+
+static void conn_release(struct blz_conn_req* req)
+{
+	if (req->step != CONN_QUEUED && req->step != CONN_BACKOFF
+		&& req->step != CONN_REUSED) {
+		req->adapter->conn_inflight--;
+	}
+	timer_cancel(&req->timer);
+	req->slot = sd_bus_slot_unref(req->slot);
+	list_del(&req->node);
+}
+
+/* a joined request spends all its time waiting */
+static void conn_waiter_done(struct blz_conn_req* w, blz_ret ret)
+{
+	struct blz_connect_info info = {
+		.queue_ns = timer_now() - w->enqueued,
+	};
+
+	timer_cancel(&w->timer);
+	if (w->cb) {
+		w->cb(w->dev, ret, &info, w->user);
+	}
+	free(w);
+}
+
+/* unlink a joined request. An orphaned request nobody waits for any more is
+ * cancelled */
+static void conn_leave(struct blz_conn_req* w)
+{
+	struct blz_conn_req* req = w->joined;
+
+	list_del(&w->node);
+	w->joined = NULL;
+	if (req != NULL && req->orphan && list_empty(&req->waiters)) {
+		blz_connect_cancel(req);
+	}
+}
+
+/* free joined requests without calling their handlers */
+static void conn_drop_waiters(struct blz_conn_req* req)
+{
+	while (!list_empty(&req->waiters)) {
+		struct blz_conn_req* w
+			= list_entry(req->waiters.next, struct blz_conn_req, node);
+		list_del(&w->node);
+		timer_cancel(&w->timer);
+		free(w);
+	}
+}
+
+static void conn_finish(struct blz_conn_req* req, blz_ret ret)
+{
+	blz_ctx* ctx = req->ctx;
+	uint64_t now = timer_now();
+	blz_dev* dev = req->dev;
+	struct blz_list waiters;
+	struct blz_connect_info info = {
+		.queue_ns = req->started - req->enqueued,
+		.connect_ns = now - req->attempt_ts,
+		.attempts = req->attempts,
+	};
+
+	conn_release(req);
+	list_init(&waiters);
+	list_splice_tail(&waiters, &req->waiters);
+
+	if (ret == BLZ_OK) {
+		dev->creq = NULL;
+		dev->connected = true;
+		adapter_link(dev, true);
+		if (req->attempts > 0) {
+			devdb_connected(dev, info.connect_ns / 1000000);
+		}
+	} else {
+		conn_drop_dev(req);
+		dev = NULL;
+		if (req->started == 0) {
+			info.queue_ns = now - req->enqueued;
+			info.connect_ns = 0;
+		}
+	}
+
+	/* every waiter holds its reference before any handler can drop one */
+	for (struct blz_list* n = waiters.next; n != &waiters; n = n->next) {
+		struct blz_conn_req* w = list_entry(n, struct blz_conn_req, node);
+		w->joined = NULL;
+		if (dev != NULL) {
+			w->dev = dev;
+			dev->refcnt++;
+		}
+	}
+	if (req->orphan && dev != NULL) {
+		dev_unref(dev);
+	}
+
+	if (req->cb) {
+		req->cb(dev, ret, &info, req->user);
+	}
+	free(req);
+
+	/* handlers may cancel the waiters after them */
+	while (!list_empty(&waiters)) {
+		struct blz_conn_req* w
+			= list_entry(waiters.next, struct blz_conn_req, node);
+		list_del(&w->node);
+		conn_waiter_done(w, ret);
+	}
+
+	conn_dispatch(ctx);
+}
+
+static void conn_failed(struct blz_conn_req* req, blz_ret ret)
+{
+	uint64_t now = timer_now();
+	uint64_t delay;
+
+	if (req->attempts > req->retries
+		|| (req->deadline != 0 && now >= req->deadline)) {
+		conn_finish(req, ret);
+		return;
+	}
+
+	delay = (uint64_t)CONNECT_RETRY_MS << MIN(req->attempts - 1, 4);
+	delay *= 1000000;
+	if (req->deadline != 0 && now + delay >= req->deadline) {
+		conn_finish(req, ret);
+		return;
+	}
+
+	LOG_INF("BLZ: Connect %s failed, retry in %u ms", req->mac,
+			(unsigned int)(delay / 1000000));
+
+	/* give the slot to the next request while waiting */
+	conn_drop_dev(req);
+	req->slot = sd_bus_slot_unref(req->slot);
+	req->adapter->conn_inflight--;
+	req->step = CONN_BACKOFF;
+	timer_arm(&req->ctx->timers, &req->timer, now + delay);
+	conn_dispatch(req->ctx);
+}
+
+static void conn_wait_resolved(struct blz_conn_req* req)
+{
+	/* we usually receive connected = true before ServicesResolved, but at
+	 * that time we are not ready yet to look up service and characteristic
+	 * UUIDs */
+	if (req->dev->services_resolved) {
+		connect_resolved(req->dev);
+		return;
+	}
+	req->step = CONN_RESOLVING;
+	timer_arm(&req->ctx->timers, &req->timer,
+			  timer_now()
+				  + conn_timeout(req, SERV_RESOLV_TIMEOUT * 1000000000ULL));
+}
+
+/** called from the device PropertiesChanged handler */
+void connect_resolved(blz_dev* dev)
+{
+	struct blz_conn_req* req = dev->creq;
+
+	if (req == NULL || !dev->services_resolved
+		|| (req->step != CONN_RESOLVING && req->step != CONN_RESOLVED
+			&& req->step != CONN_KNOWN && req->step != CONN_NEW)) {
+		return;
+	}
+
+	timer_cancel(&req->timer);
+	req->slot = sd_bus_slot_unref(req->slot);
+
+	/* remember the address type for reconnecting with ConnectDevice */
+	if (dev->atype == BLZ_ADDR_UNKNOWN) {
+		req->step = CONN_ATYPE;
+		if (conn_get_property(req, "AddressType") >= 0) {
+			return;
+		}
+	}
+	conn_finish(req, BLZ_OK);
+}
+
+static int conn_reply_cb(sd_bus_message* reply, void* user, sd_bus_error* e)
+{
+	struct blz_conn_req* req = user;
+	blz_dev* dev = req->dev;
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+	const char* str;
+	int b = 0;
+	int r = 0;
+
+	req->slot = sd_bus_slot_unref(req->slot);
+
+	switch (req->step) {
+	case CONN_STATUS:
+		/* device is unknown, use ConnectDevice API */
+		if (err != NULL
+			&& sd_bus_error_has_name(err, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
+			r = conn_send_new(req);
+			break;
+		}
+		if (err != NULL || msg_read_variant(reply, "b", &b) < 0) {
+			LOG_ERR("BLZ: Failed to get connected: %s",
+					err ? err->message : "invalid reply");
+			conn_failed(req, BLZ_ERR_BUS);
+			return 0;
+		}
+		if (!b) {
+			r = conn_send_known(req);
+			break;
+		}
+		LOG_NOTI("BLZ: Device %s already was connected", req->mac);
+		req->step = CONN_RESOLVED;
+		r = conn_get_property(req, "ServicesResolved");
+		break;
+
+	case CONN_RESOLVED:
+		if (err != NULL || msg_read_variant(reply, "b", &b) < 0) {
+			LOG_ERR("BLZ: Failed to get ServicesResolved: %s",
+					err ? err->message : "invalid reply");
+			conn_failed(req, BLZ_ERR_BUS);
+			return 0;
+		}
+		dev->services_resolved = b;
+		conn_wait_resolved(req);
+		break;
+
+	case CONN_KNOWN:
+		if (err != NULL) {
+			LOG_INF("BLZ: Connect error: %s '%s'", err->name, err->message);
+			conn_failed(req, BLZ_ERR);
+			return 0;
+		}
+		conn_wait_resolved(req);
+		break;
+
+	case CONN_NEW:
+		if (err != NULL) {
+			if (sd_bus_error_has_name(err, SD_BUS_ERROR_UNKNOWN_METHOD)) {
+				LOG_NOTI("BLZ: Connect new failed: Bluez < 5.49 (with -E"
+						 " flag) doesn't support ConnectDevice");
+				conn_finish(req, BLZ_ERR);
+				return 0;
+			}
+			LOG_INF("BLZ: Connect new error: %s '%s'", err->name,
+					err->message);
+			/* when addr type is unknown, try the other type */
+			if (req->atype == BLZ_ADDR_UNKNOWN && !req->tried_other) {
+				req->tried_other = true;
+				req->pub = !req->pub;
+				r = conn_send_new(req);
+				break;
+			}
+			conn_failed(req, BLZ_ERR);
+			return 0;
+		}
+		if (sd_bus_message_read_basic(reply, 'o', &str) < 0
+			|| strcmp(str, dev->path) != 0) {
+			LOG_ERR("BLZ: Connect new device paths don't match");
+			conn_failed(req, BLZ_ERR);
+			return 0;
+		}
+		dev->atype = req->pub ? BLZ_ADDR_PUBLIC : BLZ_ADDR_RANDOM;
+		conn_wait_resolved(req);
+		break;
+
+	case CONN_ATYPE:
+		if (err == NULL && msg_read_variant(reply, "s", &str) >= 0) {
+			dev->atype = strcmp(str, "public") == 0 ? BLZ_ADDR_PUBLIC
+													: BLZ_ADDR_RANDOM;
+		}
+		conn_finish(req, BLZ_OK);
+		return 0;
+
+	default:
+		break;
+	}
+
+	if (r < 0) {
+		LOG_ERR("BLZ: Connect %s failed to send (%d)", req->mac, r);
+		conn_failed(req, BLZ_ERR_BUS);
+	}
+	return 0;
+}
+
+static void conn_start(struct blz_conn_req* req, struct blz_adapter* a)
+{
+	blz_ctx* ctx = req->ctx;
+	uint64_t now = timer_now();
+	enum blz_addr_type guess;
+
+	req->adapter = a;
+	a->conn_inflight++;
+	/* stop discovery before connecting */
+	adapter_update(a);
+	req->attempts++;
+	req->attempt_ts = now;
+	if (req->started == 0) {
+		req->started = now;
+	}
+	list_add_tail(&ctx->conn_active, &req->node);
+
+	req->step = CONN_STATUS;
+	req->tried_other = false;
+	req->dev = dev_new(ctx, a, req->mac, req->atype);
+	if (req->dev == NULL) {
+		conn_failed(req, BLZ_ERR);
+		return;
+	}
+	req->dev->creq = req;
+
+	/* guess the address type learned before first */
+	guess = req->atype != BLZ_ADDR_UNKNOWN ? req->atype
+										   : devdb_atype(ctx, req->mac_b);
+	req->pub = guess == BLZ_ADDR_PUBLIC;
+
+	/* check if it already is connected. this also serves as a mean to check
+	 * wether the object path is known in DBus */
+	if (conn_get_property(req, "Connected") < 0) {
+		LOG_ERR("BLZ: Connect %s failed to send", req->mac);
+		conn_failed(req, BLZ_ERR_BUS);
+	}
+}
+
+static bool conn_slot_free(blz_ctx* ctx)
+{
+	for (unsigned int i = 0; i < ctx->adapters_cnt; i++) {
+		if (ctx->adapters[i].conn_inflight < ctx->conn_max_inflight) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* start the first request in priority order which can be placed on an
+ * adapter, as long as there is one. Requests placed by RSSI may have to wait
+ * for their adapter while others go ahead */
+static void conn_dispatch(blz_ctx* ctx)
+{
+	struct blz_conn_req* req = NULL;
+	struct blz_adapter* a = NULL;
+
+	do {
+		if (!conn_slot_free(ctx)) {
+			break;
+		}
+
+		a = NULL;
+		for (int p = 0; p < _BLZ_PRIO_LAST && a == NULL; p++) {
+			for (struct blz_list* n = ctx->conn_queue[p].next;
+				 n != &ctx->conn_queue[p] && a == NULL; n = n->next) {
+				req = list_entry(n, struct blz_conn_req, node);
+				a = adapter_place(ctx, req->mac_b);
+			}
+		}
+
+		if (a != NULL) {
+			list_del(&req->node);
+			timer_cancel(&req->timer);
+			conn_start(req, a);
+		}
+	} while (a != NULL);
+
+	/* resume discovery on adapters which are done connecting */
+	adapters_update(ctx);
+}
+
+static void conn_timer_cb(struct blz_timer* t, void* user)
+{
+	struct blz_conn_req* req = user;
+
+	switch (req->step) {
+	case CONN_QUEUED:
+		LOG_INF("BLZ: Connect %s deadline passed in queue", req->mac);
+		conn_finish(req, BLZ_ERR_TIMEOUT);
+		break;
+	case CONN_BACKOFF:
+		list_del(&req->node);
+		req->step = CONN_QUEUED;
+		list_add_tail(&req->ctx->conn_queue[req->prio], &req->node);
+		if (req->deadline != 0) {
+			timer_arm(&req->ctx->timers, &req->timer, req->deadline);
+		}
+		conn_dispatch(req->ctx);
+		break;
+	case CONN_RESOLVING:
+		LOG_ERR("BLZ: Timeout waiting for ServicesResolved");
+		conn_failed(req, BLZ_ERR_TIMEOUT);
+		break;
+	case CONN_REUSED:
+		conn_finish(req, BLZ_OK);
+		break;
+	case CONN_JOINED:
+		LOG_INF("BLZ: Connect %s deadline passed waiting", req->mac);
+		conn_leave(req);
+		conn_waiter_done(req, BLZ_ERR_TIMEOUT);
+		break;
+	default:
+		break;
+	}
+}
+
+/* the queued or connecting request of a device, REUSED ones complete anyway */
+static struct blz_conn_req* conn_find(blz_ctx* ctx, const uint8_t* mac)
+{
+	struct blz_conn_req* req;
+
+	for (struct blz_list* n = ctx->conn_active.next; n != &ctx->conn_active;
+		 n = n->next) {
+		req = list_entry(n, struct blz_conn_req, node);
+		if (req->step != CONN_REUSED && memcmp(req->mac_b, mac, 6) == 0) {
+			return req;
+		}
+	}
+	for (int p = 0; p < _BLZ_PRIO_LAST; p++) {
+		for (struct blz_list* n = ctx->conn_queue[p].next;
+			 n != &ctx->conn_queue[p]; n = n->next) {
+			req = list_entry(n, struct blz_conn_req, node);
+			if (memcmp(req->mac_b, mac, 6) == 0) {
+				return req;
+			}
+		}
+	}
+	return NULL;
+}
+
+static struct blz_conn_req* conn_submit(blz_ctx* ctx, const char* macstr,
+										enum blz_addr_type atype,
+										enum blz_prio prio,
+										uint32_t deadline_ms,
+										unsigned int retries,
+										blz_connect_handler_t cb, void* user)
+{
+	struct blz_conn_req* req;
+	struct blz_conn_req* other;
+
+	if (ctx == NULL || macstr == NULL || strlen(macstr) >= MAC_STR_LEN
+		|| prio >= _BLZ_PRIO_LAST) {
+		return NULL;
+	}
+
+	req = calloc(1, sizeof(struct blz_conn_req));
+	if (req == NULL) {
+		LOG_ERR("BLZ: Connect request alloc failed");
+		return NULL;
+	}
+
+	req->ctx = ctx;
+	strcpy(req->mac, macstr);
+	blz_string_to_mac(macstr, req->mac_b);
+	req->atype = atype;
+	req->prio = prio;
+	req->retries = retries;
+	req->enqueued = timer_now();
+	req->cb = cb;
+	req->user = user;
+	list_init(&req->waiters);
+	timer_init(&req->timer, conn_timer_cb, req);
+
+	/* completed from the loop, the handle is returned first */
+	req->dev = dev_find(ctx, req->mac_b);
+	if (req->dev != NULL) {
+		req->dev->refcnt++;
+		req->step = CONN_REUSED;
+		req->started = req->attempt_ts = req->enqueued;
+		list_add_tail(&ctx->conn_active, &req->node);
+		timer_arm(&ctx->timers, &req->timer, req->enqueued);
+		return req;
+	}
+
+	if (deadline_ms > 0) {
+		req->deadline = req->enqueued + (uint64_t)deadline_ms * 1000000;
+		timer_arm(&ctx->timers, &req->timer, req->deadline);
+	}
+
+	/* one handle per device: wait for the request already there, which
+	 * goes ahead with the higher priority of both while queued */
+	other = conn_find(ctx, req->mac_b);
+	if (other != NULL) {
+		req->step = CONN_JOINED;
+		req->joined = other;
+		list_add_tail(&other->waiters, &req->node);
+		if (other->step == CONN_QUEUED && prio < other->prio) {
+			list_del(&other->node);
+			other->prio = prio;
+			list_add_tail(&ctx->conn_queue[prio], &other->node);
+		}
+		return req;
+	}
+
+	list_add_tail(&ctx->conn_queue[prio], &req->node);
+	conn_dispatch(ctx);
+	return req;
+}
+
+blz_conn_req* blz_connect_async(blz_ctx* ctx, const char* macstr,
+								enum blz_addr_type atype, enum blz_prio prio,
+								uint32_t deadline_ms, blz_connect_handler_t cb,
+								void* user)
+{
+	if (ctx == NULL) {
+		return NULL;
+	}
+	return conn_submit(ctx, macstr, atype, prio, deadline_ms,
+					   ctx->conn_retries, cb, user);
+}
+
+void blz_connect_cancel(blz_conn_req* req)
+{
+	blz_ctx* ctx;
+
+	if (req == NULL) {
+		return;
+	}
+	if (req->step == CONN_JOINED) {
+		/* the reference of a completed request not yet called back */
+		if (req->dev != NULL) {
+			dev_unref(req->dev);
+		}
+		conn_leave(req);
+		timer_cancel(&req->timer);
+		free(req);
+		return;
+	}
+	if (!list_empty(&req->waiters)) {
+		req->orphan = true;
+		req->cb = NULL;
+		return;
+	}
+
+	ctx = req->ctx;
+	conn_release(req);
+	conn_drop_dev(req);
+	free(req);
+	conn_dispatch(ctx);
+}
+
+void blz_set_max_connecting(blz_ctx* ctx, unsigned int max,
+							unsigned int retries)
+{
+	ctx->conn_max_inflight = max > 0 ? max : CONNECT_MAX_INFLIGHT;
+	ctx->conn_retries = retries;
+	conn_dispatch(ctx);
+}
+
+unsigned int blz_connect_queue_len(blz_ctx* ctx)
+{
+	unsigned int n = 0;
+
+	for (int p = 0; p < _BLZ_PRIO_LAST; p++) {
+		for (struct blz_list* l = ctx->conn_queue[p].next;
+			 l != &ctx->conn_queue[p]; l = l->next) {
+			n++;
+		}
+	}
+	return n;
+}
+
+void connect_init(blz_ctx* ctx)
+{
+	for (int p = 0; p < _BLZ_PRIO_LAST; p++) {
+		list_init(&ctx->conn_queue[p]);
+	}
+	list_init(&ctx->conn_active);
+	ctx->conn_max_inflight = CONNECT_MAX_INFLIGHT;
+	ctx->conn_retries = CONNECT_RETRIES;
+}
+
+/** cancel all requests without calling their handlers */
+void connect_fini(blz_ctx* ctx)
+{
+	struct blz_conn_req* req;
+
+	/* nothing is dispatched any more */
+	ctx->conn_max_inflight = 0;
+	while (!list_empty(&ctx->conn_active)) {
+		req = list_entry(ctx->conn_active.next, struct blz_conn_req, node);
+		conn_drop_waiters(req);
+		blz_connect_cancel(req);
+	}
+	for (int p = 0; p < _BLZ_PRIO_LAST; p++) {
+		while (!list_empty(&ctx->conn_queue[p])) {
+			req = list_entry(ctx->conn_queue[p].next, struct blz_conn_req,
+							 node);
+			conn_drop_waiters(req);
+			blz_connect_cancel(req);
+		}
+	}
+}
+
+struct connect_wait {
+	bool done;
+	blz_dev* dev;
+};
+
+static void connect_wait_done(blz_dev* dev, blz_ret ret,
+							  const struct blz_connect_info* info, void* user)
+{
+	struct connect_wait* w = user;
+	w->dev = dev;
+	w->done = true;
+}
+
+blz_dev* blz_connect(blz_ctx* ctx, const char* macstr, enum blz_addr_type atype)
+{
+	struct connect_wait w = {0};
+	struct blz_conn_req* req;
+	blz_dev* dev;
+	uint8_t mac[6];
+
+	if (ctx == NULL || macstr == NULL) {
+		return NULL;
+	}
+
+	/* share the handle of a connected device */
+	blz_string_to_mac(macstr, mac);
+	dev = dev_find(ctx, mac);
+	if (dev != NULL) {
+		dev->refcnt++;
+		return dev;
+	}
+
+	req = conn_submit(ctx, macstr, atype, BLZ_PRIO_CONTROL, 0, 0,
+					  connect_wait_done, &w);
+	if (req == NULL) {
+		return NULL;
+	}
+
+	/* all steps time out by themselves, this is only a safety net */
+	if (blz_loop_wait(ctx, &w.done,
+					  (2 * CONNECT_TIMEOUT + SERV_RESOLV_TIMEOUT + 10) * 1000)
+		!= BLZ_OK) {
+		if (!w.done) {
+			LOG_ERR("BLZ: Connect %s timeout", macstr);
+			blz_connect_cancel(req);
+			return NULL;
+		}
+	}
+	return w.dev;
+}
@@ -0,0 +1,296 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Device database
+ *
+ * A file mapped into memory with a fixed number of records, found by an
+ * open addressing hash of the MAC address. It keeps what was learned about
+ * devices over restarts: most importantly the address type, so connecting
+ * to a device which BlueZ does not know (yet) does not have to guess.
+ * Records are written in place, the kernel writes them back to the file.
+ * When the table is full, the record seen least recently is replaced. Scans
+ * see many more devices than are ever connected, so a device only seen in a
+ * scan never replaces one which was connected or had a profile applied, and
+ * is recorded only once its address type is known.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <systemd/sd-bus.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define DEVDB_MAGIC	  0x62647a62 /* "bzdb" */
+#define DEVDB_VERSION 1
+
+/* clang-format off */
+struct devdb_rec {
+	uint8_t		mac[6];
+	uint8_t		used;
+	uint8_t		atype;		/* enum blz_addr_type */
+	int16_t		rssi;
+	uint16_t	reserved;
+	uint32_t	profile_id;
+	uint32_t	connect_ms;
+	uint64_t	last_seen;	/* CLOCK_REALTIME sec */
+	char		name[NAME_STR_LEN];
+};
+
+struct devdb_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	cap;
+	uint32_t	rec_size;
+};
+
+struct blz_devdb {
+	int					fd;
+	size_t				size;
+	struct devdb_hdr*	hdr;
+	struct devdb_rec*	recs;
+};
+/* clang-format on */
+
+static uint32_t devdb_hash(const uint8_t* mac)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 6; i++) {
+		h = (h ^ mac[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* what can not be learned again from a scan */
+static bool devdb_learned(const struct devdb_rec* rec)
+{
+	return rec->connect_ms != 0 || rec->profile_id != 0;
+}
+
+/* find the record of mac. With create a new one replaces an unused record,
+ * the oldest scan-only one, or with learned also the oldest learned one */
+static struct devdb_rec* devdb_find(struct blz_devdb* db, const uint8_t* mac,
+									bool create, bool learned)
+{
+	uint32_t cap = db->hdr->cap;
+	uint32_t idx = devdb_hash(mac) % cap;
+	struct devdb_rec* oldest = NULL;
+	struct devdb_rec* oldest_learned = NULL;
+
+	for (uint32_t i = 0; i < cap; i++) {
+		struct devdb_rec* rec = &db->recs[(idx + i) % cap];
+		struct devdb_rec** o;
+		if (!rec->used) {
+			if (!create) {
+				return NULL;
+			}
+			oldest = rec;
+			break;
+		}
+		if (memcmp(rec->mac, mac, 6) == 0) {
+			return rec;
+		}
+		o = devdb_learned(rec) ? &oldest_learned : &oldest;
+		if (*o == NULL || rec->last_seen < (*o)->last_seen) {
+			*o = rec;
+		}
+	}
+
+	/* records are never removed, so a probe ends at the first unused one
+	 * and replacing the oldest keeps all others reachable */
+	if (oldest == NULL && learned) {
+		oldest = oldest_learned;
+	}
+	if (!create || oldest == NULL) {
+		return NULL;
+	}
+	memset(oldest, 0, sizeof(*oldest));
+	memcpy(oldest->mac, mac, 6);
+	oldest->used = 1;
+	return oldest;
+}
+
+blz_ret blz_devdb_open(blz_ctx* ctx, const char* path, unsigned int max_devices)
+{
+	struct blz_devdb* db;
+	struct stat st;
+	size_t size;
+	void* map;
+
+	if (ctx == NULL || path == NULL || max_devices == 0) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	blz_devdb_close(ctx);
+
+	db = calloc(1, sizeof(struct blz_devdb));
+	if (db == NULL) {
+		LOG_ERR("BLZ: Device DB alloc failed");
+		return BLZ_ERR;
+	}
+
+	db->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (db->fd < 0 || fstat(db->fd, &st) < 0) {
+		LOG_ERR("BLZ: Failed to open device DB %s", path);
+		goto err;
+	}
+
+	size = sizeof(struct devdb_hdr)
+		   + (size_t)max_devices * sizeof(struct devdb_rec);
+	if ((size_t)st.st_size != size && ftruncate(db->fd, size) < 0) {
+		LOG_ERR("BLZ: Failed to size device DB %s", path);
+		goto err;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+	if (map == MAP_FAILED) {
+		LOG_ERR("BLZ: Failed to map device DB %s", path);
+		goto err;
+	}
+
+	db->size = size;
+	db->hdr = map;
+	db->recs = (struct devdb_rec*)(db->hdr + 1);
+
+	/* start over when the file is new or was written with another layout */
+	if (db->hdr->magic != DEVDB_MAGIC || db->hdr->version != DEVDB_VERSION
+		|| db->hdr->cap != max_devices
+		|| db->hdr->rec_size != sizeof(struct devdb_rec)) {
+		if (st.st_size > 0) {
+			LOG_NOTI("BLZ: Device DB %s reset", path);
+		}
+		memset(map, 0, size);
+		db->hdr->magic = DEVDB_MAGIC;
+		db->hdr->version = DEVDB_VERSION;
+		db->hdr->cap = max_devices;
+		db->hdr->rec_size = sizeof(struct devdb_rec);
+	}
+
+	ctx->devdb = db;
+	return BLZ_OK;
+
+err:
+	if (db->fd >= 0) {
+		close(db->fd);
+	}
+	free(db);
+	return BLZ_ERR;
+}
+
+void blz_devdb_close(blz_ctx* ctx)
+{
+	struct blz_devdb* db = ctx->devdb;
+
+	if (db == NULL) {
+		return;
+	}
+	msync(db->hdr, db->size, MS_ASYNC);
+	munmap(db->hdr, db->size);
+	close(db->fd);
+	free(db);
+	ctx->devdb = NULL;
+}
+
+blz_ret blz_devdb_get(blz_ctx* ctx, const char* macstr,
+					  struct blz_devdb_entry* out)
+{
+	struct devdb_rec* rec;
+	uint8_t mac[6];
+
+	if (ctx == NULL || macstr == NULL || out == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+	if (ctx->devdb == NULL) {
+		return BLZ_ERR;
+	}
+
+	blz_string_to_mac(macstr, mac);
+	rec = devdb_find(ctx->devdb, mac, false, false);
+	if (rec == NULL) {
+		return BLZ_ERR;
+	}
+
+	out->atype = rec->atype;
+	out->rssi = rec->rssi;
+	out->profile_id = rec->profile_id;
+	out->connect_ms = rec->connect_ms;
+	out->last_seen = rec->last_seen;
+	memcpy(out->name, rec->name, NAME_STR_LEN);
+	out->name[NAME_STR_LEN] = '\0';
+	return BLZ_OK;
+}
+
+enum blz_addr_type devdb_atype(blz_ctx* ctx, const uint8_t* mac)
+{
+	struct devdb_rec* rec;
+
+	if (ctx->devdb == NULL) {
+		return BLZ_ADDR_UNKNOWN;
+	}
+	rec = devdb_find(ctx->devdb, mac, false, false);
+	return rec != NULL ? rec->atype : BLZ_ADDR_UNKNOWN;
+}
+
+/* update the record of dev, creating it if create is set. learned records
+ * may replace other learned ones */
+static struct devdb_rec* devdb_touch(blz_ctx* ctx, const blz_dev* dev,
+									 bool create, bool learned)
+{
+	static const uint8_t no_mac[6];
+	struct devdb_rec* rec;
+
+	if (ctx->devdb == NULL || memcmp(dev->mac, no_mac, 6) == 0) {
+		return NULL;
+	}
+	rec = devdb_find(ctx->devdb, dev->mac, create, learned);
+	if (rec != NULL) {
+		rec->last_seen = time(NULL);
+		if (dev->atype != BLZ_ADDR_UNKNOWN) {
+			rec->atype = dev->atype;
+		}
+		if (dev->name[0] != '\0') {
+			strncpy(rec->name, dev->name, NAME_STR_LEN);
+		}
+	}
+	return rec;
+}
+
+/** record a device seen in a scan, new ones only with their address type */
+void devdb_seen(blz_ctx* ctx, const blz_dev* dev)
+{
+	struct devdb_rec* rec
+		= devdb_touch(ctx, dev, dev->atype != BLZ_ADDR_UNKNOWN, false);
+	if (rec != NULL && dev->rssi != 0) {
+		rec->rssi = dev->rssi;
+	}
+}
+
+void devdb_connected(blz_dev* dev, uint32_t connect_ms)
+{
+	struct devdb_rec* rec = devdb_touch(dev->ctx, dev, true, true);
+	if (rec != NULL) {
+		/* never 0, which means not connected */
+		rec->connect_ms = MAX(connect_ms, 1);
+	}
+}
+
+void devdb_profile(blz_dev* dev, uint32_t profile_id)
+{
+	struct devdb_rec* rec = devdb_touch(dev->ctx, dev, true, true);
+	if (rec != NULL) {
+		rec->profile_id = profile_id;
+	}
+}
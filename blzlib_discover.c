@@ -0,0 +1,399 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Discovery jobs
+ *
+ * A job connects to a list of devices, collects their services and
+ * characteristics and disconnects again. Up to width devices are in
+ * progress at a time, each one a chain of asynchronous steps: a connect
+ * request of bulk priority, one GetManagedObjects call whose objects below
+ * the device are collected into the inventory, and Disconnect. While one
+ * device waits for its connection, others are listed or disconnected.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/* clang-format off */
+struct disc_obj {
+	char		path[DBUS_PATH_MAX_LEN];
+	char		uuid[UUID_STR_LEN];
+	uint8_t		flags;
+	bool		is_char;
+};
+
+struct disc_dev {
+	struct blz_discovery*	job;
+	struct blz_inv_dev*		inv;
+	blz_conn_req*			req;
+	bool					connecting;
+	blz_dev*				dev;
+	sd_bus_slot*			slot;
+	uint64_t				step_ts; /* ns */
+	struct disc_obj*		objs;
+	size_t					objs_cnt;
+	size_t					objs_size;
+};
+
+struct blz_discovery {
+	blz_ctx*				ctx;
+	size_t					n;
+	size_t					next; /* device to start next */
+	size_t					done;
+	unsigned int			width;
+	unsigned int			running;
+	bool					starting;
+	uint64_t				start; /* ns */
+	struct blz_timer		timer;
+	struct blz_inv_dev*		inv;
+	struct disc_dev*		devs;
+	blz_discovery_handler_t	cb;
+	void*					user;
+};
+/* clang-format on */
+
+static void disc_next(struct blz_discovery* d);
+
+/** called from message parsing for each service and characteristic */
+int discovery_obj(struct disc_dev* dd, const char* opath, const char* uuid,
+				  uint8_t flags, bool is_char)
+{
+	struct disc_obj* o;
+
+	if (dd->objs_cnt == dd->objs_size) {
+		size_t size = dd->objs_size > 0 ? dd->objs_size * 2 : 16;
+		o = realloc(dd->objs, size * sizeof(struct disc_obj));
+		if (o == NULL) {
+			LOG_ERR("BLZ: Discovery alloc failed");
+			return -ENOMEM;
+		}
+		dd->objs = o;
+		dd->objs_size = size;
+	}
+
+	o = &dd->objs[dd->objs_cnt++];
+	snprintf(o->path, DBUS_PATH_MAX_LEN, "%s", opath);
+	snprintf(o->uuid, UUID_STR_LEN, "%s", uuid);
+	o->flags = flags;
+	o->is_char = is_char;
+	return 0;
+}
+
+static int disc_obj_cmp(const void* a, const void* b)
+{
+	return strcmp(((const struct disc_obj*)a)->path,
+				  ((const struct disc_obj*)b)->path);
+}
+
+/* sorted by path, characteristics follow the service they belong to */
+static blz_ret disc_inventory(struct disc_dev* dd)
+{
+	struct blz_inv_dev* inv = dd->inv;
+	struct blz_inv_serv* srv = NULL;
+	size_t ns = 0;
+
+	qsort(dd->objs, dd->objs_cnt, sizeof(struct disc_obj), disc_obj_cmp);
+
+	for (size_t i = 0; i < dd->objs_cnt; i++) {
+		if (!dd->objs[i].is_char) {
+			ns++;
+		}
+	}
+	if (ns == 0) {
+		return BLZ_OK;
+	}
+
+	inv->servs = calloc(ns, sizeof(struct blz_inv_serv));
+	if (inv->servs == NULL) {
+		LOG_ERR("BLZ: Discovery alloc failed");
+		return BLZ_ERR;
+	}
+
+	for (size_t i = 0; i < dd->objs_cnt; i++) {
+		struct disc_obj* o = &dd->objs[i];
+		if (!o->is_char) {
+			size_t nc = 0;
+			while (i + nc + 1 < dd->objs_cnt && dd->objs[i + nc + 1].is_char) {
+				nc++;
+			}
+			srv = &inv->servs[inv->servs_cnt++];
+			strcpy(srv->uuid, o->uuid);
+			if (nc > 0) {
+				srv->chars = calloc(nc, sizeof(struct blz_inv_char));
+				if (srv->chars == NULL) {
+					LOG_ERR("BLZ: Discovery alloc failed");
+					return BLZ_ERR;
+				}
+			}
+		} else if (srv != NULL) {
+			struct blz_inv_char* ch = &srv->chars[srv->chars_cnt++];
+			strcpy(ch->uuid, o->uuid);
+			ch->flags = o->flags;
+		}
+	}
+	return BLZ_OK;
+}
+
+static void disc_done(struct disc_dev* dd, blz_ret ret)
+{
+	struct blz_discovery* d = dd->job;
+
+	dd->inv->ret = ret;
+	dd->inv->total_ns = timer_now() - d->start;
+	free(dd->objs);
+	dd->objs = NULL;
+	dd->objs_cnt = dd->objs_size = 0;
+
+	LOG_INF("BLZ: Discovery of %s done (%s), %zu services", dd->inv->mac,
+			blz_errstr(ret), dd->inv->servs_cnt);
+
+	d->running--;
+	d->done++;
+	disc_next(d);
+}
+
+static int disc_disconnect_cb(sd_bus_message* reply, void* user,
+							  sd_bus_error* err)
+{
+	struct disc_dev* dd = user;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+
+	/* the inventory is complete anyway */
+	if (e != NULL) {
+		LOG_ERR("BLZ: Failed to disconnect %s: %s", dd->inv->mac, e->message);
+	}
+
+	dd->slot = sd_bus_slot_unref(dd->slot);
+	dd->inv->disconnect_ns = timer_now() - dd->step_ts;
+	dev_unref(dd->dev);
+	dd->dev = NULL;
+	disc_done(dd, dd->inv->ret);
+	return 0;
+}
+
+static void disc_disconnect(struct disc_dev* dd, blz_ret ret)
+{
+	int r;
+
+	dd->inv->ret = ret;
+	dd->step_ts = timer_now();
+
+	/* the device was already connected by others, keep it */
+	if (dd->dev->refcnt > 1) {
+		dd->dev->refcnt--;
+		dd->dev = NULL;
+		disc_done(dd, ret);
+		return;
+	}
+
+	r = sd_bus_call_method_async(dd->job->ctx->bus, &dd->slot, "org.bluez",
+								 dd->dev->path, "org.bluez.Device1",
+								 "Disconnect", disc_disconnect_cb, dd, "");
+	if (r < 0) {
+		LOG_ERR("BLZ: Failed to disconnect %s", dd->inv->mac);
+		dev_unref(dd->dev);
+		dd->dev = NULL;
+		disc_done(dd, ret);
+	}
+}
+
+static int disc_objects_cb(sd_bus_message* reply, void* user,
+						   sd_bus_error* err)
+{
+	struct disc_dev* dd = user;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+	blz_ret ret;
+
+	dd->slot = sd_bus_slot_unref(dd->slot);
+
+	if (e != NULL) {
+		LOG_ERR("BLZ: Failed to get managed objects: %s", e->message);
+		ret = msg_error_ret(0, e);
+	} else if (msg_parse_objects(reply, dd->dev->path, MSG_INVENTORY, dd) < 0) {
+		ret = BLZ_ERR;
+	} else {
+		ret = disc_inventory(dd);
+	}
+
+	dd->inv->enum_ns = timer_now() - dd->step_ts;
+	disc_disconnect(dd, ret);
+	return 0;
+}
+
+static void disc_connect_cb(blz_dev* dev, blz_ret ret,
+							const struct blz_connect_info* info, void* user)
+{
+	struct disc_dev* dd = user;
+	int r;
+
+	dd->connecting = false;
+	dd->req = NULL;
+	dd->inv->queue_ns = info->queue_ns;
+	dd->inv->connect_ns = info->connect_ns;
+	dd->inv->attempts = info->attempts;
+
+	if (ret != BLZ_OK) {
+		disc_done(dd, ret);
+		return;
+	}
+
+	dd->dev = dev;
+	dd->step_ts = timer_now();
+	r = sd_bus_call_method_async(dd->job->ctx->bus, &dd->slot, "org.bluez", "/",
+								 "org.freedesktop.DBus.ObjectManager",
+								 "GetManagedObjects", disc_objects_cb, dd, "");
+	if (r < 0) {
+		LOG_ERR("BLZ: Failed to get managed objects");
+		disc_disconnect(dd, BLZ_ERR_BUS);
+	}
+}
+
+static void disc_timer_cb(struct blz_timer* t, void* user)
+{
+	struct blz_discovery* d = user;
+
+	d->cb(d, d->user);
+}
+
+static void disc_next(struct blz_discovery* d)
+{
+	/* connect requests may fail right away, the loop below goes on */
+	if (d->starting) {
+		return;
+	}
+	d->starting = true;
+
+	while (d->running < d->width && d->next < d->n) {
+		struct disc_dev* dd = &d->devs[d->next++];
+		blz_conn_req* req;
+
+		d->running++;
+		dd->connecting = true;
+		req = blz_connect_async(d->ctx, dd->inv->mac, BLZ_ADDR_UNKNOWN,
+								BLZ_PRIO_BULK, 0, disc_connect_cb, dd);
+		if (dd->connecting) {
+			dd->req = req;
+			if (req == NULL) {
+				dd->connecting = false;
+				disc_done(dd, BLZ_ERR_INVALID_PARAM);
+			}
+		}
+	}
+
+	d->starting = false;
+
+	/* the handler is called from the loop, never from within a call of the
+	 * job, so it can free the job */
+	if (d->done == d->n && d->cb != NULL) {
+		timer_arm(&d->ctx->timers, &d->timer, timer_now());
+	}
+}
+
+blz_discovery* blz_discovery_start(blz_ctx* ctx, const char* const* macs,
+								   size_t n, unsigned int width,
+								   blz_discovery_handler_t cb, void* user)
+{
+	struct blz_discovery* d;
+
+	if (ctx == NULL || macs == NULL || n == 0 || width == 0) {
+		return NULL;
+	}
+
+	d = calloc(1, sizeof(struct blz_discovery));
+	if (d != NULL) {
+		d->inv = calloc(n, sizeof(struct blz_inv_dev));
+		d->devs = calloc(n, sizeof(struct disc_dev));
+	}
+	if (d == NULL || d->inv == NULL || d->devs == NULL) {
+		LOG_ERR("BLZ: Discovery alloc failed");
+		if (d != NULL) {
+			free(d->inv);
+			free(d->devs);
+			free(d);
+		}
+		return NULL;
+	}
+
+	d->ctx = ctx;
+	d->n = n;
+	d->width = width;
+	d->cb = cb;
+	d->user = user;
+	d->start = timer_now();
+	timer_init(&d->timer, disc_timer_cb, d);
+
+	for (size_t i = 0; i < n; i++) {
+		snprintf(d->inv[i].mac, MAC_STR_LEN, "%s", macs[i]);
+		d->devs[i].job = d;
+		d->devs[i].inv = &d->inv[i];
+	}
+
+	LOG_INF("BLZ: Discovery of %zu devices, %u at a time", n, width);
+	disc_next(d);
+	return d;
+}
+
+const struct blz_inv_dev* blz_discovery_result(blz_discovery* d, size_t* n)
+{
+	if (d == NULL) {
+		return NULL;
+	}
+	if (n != NULL) {
+		*n = d->n;
+	}
+	return d->inv;
+}
+
+void blz_discovery_free(blz_discovery* d)
+{
+	if (d == NULL) {
+		return;
+	}
+
+	/* cancelling a request may complete others, don't start new ones */
+	d->starting = true;
+	timer_cancel(&d->timer);
+
+	for (size_t i = 0; i < d->n; i++) {
+		struct disc_dev* dd = &d->devs[i];
+		if (dd->req != NULL) {
+			blz_conn_req* req = dd->req;
+			dd->req = NULL;
+			blz_connect_cancel(req);
+		}
+		dd->slot = sd_bus_slot_unref(dd->slot);
+		if (dd->dev != NULL && dd->dev->refcnt > 1) {
+			dd->dev->refcnt--;
+		} else if (dd->dev != NULL) {
+			sd_bus_call_method_async(d->ctx->bus, NULL, "org.bluez",
+									 dd->dev->path, "org.bluez.Device1",
+									 "Disconnect", NULL, NULL, "");
+			dev_unref(dd->dev);
+		}
+		free(dd->objs);
+	}
+
+	for (size_t i = 0; i < d->n; i++) {
+		for (size_t j = 0; j < d->inv[i].servs_cnt; j++) {
+			free(d->inv[i].servs[j].chars);
+		}
+		free(d->inv[i].servs);
+	}
+
+	free(d->inv);
+	free(d->devs);
+	free(d);
+}
@@ -0,0 +1,265 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Notification history
+ *
+ * A fixed capacity ring of the last notifications of a characteristic,
+ * allocated once when enabled. It is stored in columns: all timestamps in
+ * one array, so time lookups are a binary search over contiguous memory,
+ * and payloads with a fixed stride in another, so a field of many entries
+ * can be scanned with a constant step. Payloads longer than the stride are
+ * truncated, shorter ones are zero padded. Timestamps are kept monotonic.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/* clang-format off */
+struct blz_hist {
+	size_t		cap;
+	size_t		stride;
+	size_t		count;	/* valid entries, up to cap */
+	size_t		head;	/* index of the next entry to write */
+	uint64_t*	ts;		/* cap timestamps, ns */
+	uint16_t*	lens;	/* cap original payload lengths */
+	uint8_t*	data;	/* cap * stride payload bytes */
+};
+/* clang-format on */
+
+/* ring index of the i-th oldest entry */
+static inline size_t hist_idx(const struct blz_hist* h, size_t i)
+{
+	size_t idx = h->head + h->cap - h->count + i;
+	return idx >= h->cap ? idx - h->cap : idx;
+}
+
+/* first logical entry with ts >= t */
+static size_t hist_lower_bound(const struct blz_hist* h, uint64_t t)
+{
+	size_t lo = 0;
+	size_t hi = h->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (h->ts[hist_idx(h, mid)] < t) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+void hist_free(struct blz_hist* h)
+{
+	if (h == NULL) {
+		return;
+	}
+	free(h->ts);
+	free(h->lens);
+	free(h->data);
+	free(h);
+}
+
+void hist_add(struct blz_hist* h, uint64_t ts, const void* data, size_t len)
+{
+	size_t n = MIN(len, h->stride);
+	uint8_t* dst = h->data + h->head * h->stride;
+
+	/* binary search needs ordered timestamps */
+	if (h->count > 0) {
+		uint64_t last = h->ts[hist_idx(h, h->count - 1)];
+		ts = MAX(ts, last);
+	}
+
+	h->ts[h->head] = ts;
+	h->lens[h->head] = MIN(len, UINT16_MAX);
+	memcpy(dst, data, n);
+	memset(dst + n, 0, h->stride - n);
+
+	h->head = h->head + 1 == h->cap ? 0 : h->head + 1;
+	if (h->count < h->cap) {
+		h->count++;
+	}
+}
+
+blz_ret blz_char_history_enable(blz_char* ch, size_t capacity, size_t stride)
+{
+	struct blz_hist* h;
+
+	if (ch == NULL || (capacity > 0 && stride == 0)) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	hist_free(ch->hist);
+	ch->hist = NULL;
+
+	if (capacity == 0) {
+		return BLZ_OK;
+	}
+
+	h = calloc(1, sizeof(struct blz_hist));
+	if (h == NULL) {
+		LOG_ERR("BLZ: History alloc failed");
+		return BLZ_ERR;
+	}
+
+	h->cap = capacity;
+	h->stride = stride;
+	h->ts = malloc(capacity * sizeof(uint64_t));
+	h->lens = malloc(capacity * sizeof(uint16_t));
+	h->data = malloc(capacity * stride);
+	if (h->ts == NULL || h->lens == NULL || h->data == NULL) {
+		LOG_ERR("BLZ: History alloc failed");
+		hist_free(h);
+		return BLZ_ERR;
+	}
+
+	ch->hist = h;
+	return BLZ_OK;
+}
+
+size_t blz_char_history_len(blz_char* ch)
+{
+	return ch != NULL && ch->hist != NULL ? ch->hist->count : 0;
+}
+
+size_t blz_char_history_range(blz_char* ch, uint64_t from, uint64_t to,
+							  uint64_t* ts, uint8_t* data, size_t* lens,
+							  size_t max)
+{
+	struct blz_hist* h;
+
+	if (ch == NULL || ch->hist == NULL || from >= to) {
+		return 0;
+	}
+
+	h = ch->hist;
+	size_t first = hist_lower_bound(h, from);
+	size_t end = hist_lower_bound(h, to);
+	size_t n = MIN(end - first, max);
+
+	for (size_t i = 0; i < n; i++) {
+		size_t idx = hist_idx(h, first + i);
+		if (ts != NULL) {
+			ts[i] = h->ts[idx];
+		}
+		if (data != NULL) {
+			memcpy(data + i * h->stride, h->data + idx * h->stride, h->stride);
+		}
+		if (lens != NULL) {
+			lens[i] = h->lens[idx];
+		}
+	}
+
+	return n;
+}
+
+static size_t hist_type_size(enum blz_hist_type type)
+{
+	switch (type) {
+	case BLZ_HIST_U8:
+	case BLZ_HIST_S8:
+		return 1;
+	case BLZ_HIST_U16:
+	case BLZ_HIST_S16:
+		return 2;
+	case BLZ_HIST_U32:
+	case BLZ_HIST_S32:
+	case BLZ_HIST_FLOAT:
+		return 4;
+	}
+	return 0;
+}
+
+/* little endian field value, like all GATT values */
+static double hist_field(const uint8_t* p, enum blz_hist_type type)
+{
+	uint32_t v = 0;
+
+	for (size_t i = hist_type_size(type); i > 0; i--) {
+		v = (v << 8) | p[i - 1];
+	}
+
+	switch (type) {
+	case BLZ_HIST_U8:
+	case BLZ_HIST_U16:
+	case BLZ_HIST_U32:
+		return v;
+	case BLZ_HIST_S8:
+		return (int8_t)v;
+	case BLZ_HIST_S16:
+		return (int16_t)v;
+	case BLZ_HIST_S32:
+		return (int32_t)v;
+	case BLZ_HIST_FLOAT: {
+		float f;
+		memcpy(&f, &v, sizeof(f));
+		return f;
+	}
+	}
+	return 0;
+}
+
+blz_ret blz_char_history_downsample(blz_char* ch, uint64_t from,
+									uint64_t window_ns, size_t offset,
+									enum blz_hist_type type,
+									struct blz_hist_stat* out, size_t n)
+{
+	struct blz_hist* h;
+	size_t tsize = hist_type_size(type);
+
+	if (ch == NULL || ch->hist == NULL || out == NULL || window_ns == 0
+		|| tsize == 0 || offset + tsize > ch->hist->stride) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	h = ch->hist;
+	size_t i = hist_lower_bound(h, from);
+
+	for (size_t w = 0; w < n; w++) {
+		struct blz_hist_stat* s = &out[w];
+		uint64_t end = from + (w + 1) * window_ns;
+		double sum = 0;
+
+		s->start = from + w * window_ns;
+		s->count = 0;
+		s->min = 0;
+		s->max = 0;
+		s->mean = 0;
+
+		/* entries are ordered, so the windows are one linear scan */
+		for (; i < h->count; i++) {
+			size_t idx = hist_idx(h, i);
+			if (h->ts[idx] >= end) {
+				break;
+			}
+			double v = hist_field(h->data + idx * h->stride + offset, type);
+			if (s->count == 0 || v < s->min) {
+				s->min = v;
+			}
+			if (s->count == 0 || v > s->max) {
+				s->max = v;
+			}
+			sum += v;
+			s->count++;
+		}
+
+		if (s->count > 0) {
+			s->mean = sum / s->count;
+		}
+	}
+
+	return BLZ_OK;
+}
@@ -14,34 +14,232 @@
 #define NAME_STR_LEN		20
 #define CONNECT_TIMEOUT		60 /* sec */
 #define SERV_RESOLV_TIMEOUT 60 /* sec */
+#define POWER_TIMEOUT		10 /* sec, adapter power on */
+#define CONNECT_MAX_INFLIGHT 1 /* connects in progress per adapter */
+#define CONNECT_RETRIES		2
+#define CONNECT_RETRY_MS	1000 /* doubled for every retry */
+#define ADAPTERS_MAX		4
+#define DEV_HASH_SIZE		64 /* buckets of the device registry */
+#define PRUNE_INTERVAL		60 /* sec, at most between stale device checks */
+#define ATT_DEFAULT_MTU		23
+#define OP_TIMEOUT			25 /* sec, same as the sd-bus default */
+#define MAX_INFLIGHT_DEV	2  /* ops in flight per device */
+#define MAX_INFLIGHT		64 /* dbus-daemon allows 128 pending replies */
+#define LOOP_DRAIN_MAX		64 /* messages processed before timers run */
 
 /* this return value is used to indicate that we found what was searched */
 #define RETURN_FOUND 1000
 
+/* intrusive doubly linked list, heads point to themselves when empty */
+struct blz_list {
+	struct blz_list* next;
+	struct blz_list* prev;
+};
+
+#define list_entry(ptr, type, member)                                          \
+	((type*)((char*)(ptr) - offsetof(type, member)))
+
+static inline void list_init(struct blz_list* l)
+{
+	l->next = l;
+	l->prev = l;
+}
+
+static inline bool list_empty(const struct blz_list* l)
+{
+	return l->next == l;
+}
+
+static inline void list_add_tail(struct blz_list* head, struct blz_list* n)
+{
+	n->prev = head->prev;
+	n->next = head;
+	head->prev->next = n;
+	head->prev = n;
+}
+
+static inline void list_del(struct blz_list* n)
+{
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	list_init(n);
+}
+
+/* moves all entries of src to the end of dst, leaving src empty */
+static inline void list_splice_tail(struct blz_list* dst, struct blz_list* src)
+{
+	if (list_empty(src)) {
+		return;
+	}
+	src->next->prev = dst->prev;
+	src->prev->next = dst;
+	dst->prev->next = src->next;
+	dst->prev = src->prev;
+	list_init(src);
+}
+
+/* Hierarchical timer wheel: TIMER_LEVELS wheels of TIMER_SLOTS slots each,
+ * level 0 has a resolution of one tick, each further level covers
+ * TIMER_SLOTS times the range of the one below. Deadlines are absolute
+ * CLOCK_MONOTONIC nanoseconds, rounded up to the next tick so timers never
+ * fire early. Insert and cancel are O(1), finding the next deadline is
+ * O(TIMER_LEVELS) */
+#define TIMER_LEVELS	 6
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS		 (1 << TIMER_LEVEL_BITS)
+#define TIMER_TICK_NS	 1000000ULL /* 1 ms, 6 levels span 2^36 ms, 2.2 years */
+#define TIMER_NONE		 UINT64_MAX
+
+struct blz_timer;
+typedef void (*blz_timer_cb)(struct blz_timer* t, void* user);
+
+/* clang-format off */
+struct blz_timer_wheel {
+	uint64_t		now;	/* last processed tick */
+	uint64_t		pending[TIMER_LEVELS]; /* bitmap of non-empty slots */
+	struct blz_list	slots[TIMER_LEVELS][TIMER_SLOTS];
+	size_t			count;
+};
+
+struct blz_timer {
+	struct blz_list			node;
+	struct blz_timer_wheel*	tw;
+	uint64_t				tick;
+	uint8_t					level;
+	uint8_t					slot;
+	blz_timer_cb			cb;
+	void*					user;
+};
+/* clang-format on */
+
 /* clang-format off */
+struct blz_adapter {
+	struct blz_context* ctx;
+	char			   path[DBUS_PATH_MAX_LEN];
+	unsigned int	   links; /* connected devices */
+	unsigned int	   conn_inflight; /* connects in progress */
+
+	/* discovery coordination */
+	enum blz_adapter_state state;
+	uint64_t		   state_ts; /* ns, entered state */
+	uint64_t		   state_ns[_BLZ_ADAPTER_STATE_LAST];
+	bool			   discovering; /* as last requested */
+	sd_bus_slot*	   disc_slot;
+	struct blz_timer   duty_timer;
+
+	/* power on at initialization */
+	bool			   powered;
+	sd_bus_slot*	   power_slot; /* pending Get or Set */
+	sd_bus_slot*	   power_match;
+};
+
 struct blz_context {
 	sd_bus*			   bus;
-	char			   path[DBUS_PATH_MAX_LEN];
+	struct blz_adapter adapters[ADAPTERS_MAX];
+	unsigned int	   adapters_cnt;
+	enum blz_placement placement;
+	struct adapter_rssi* rssi_cache;
+	blz_ready_handler_t ready_cb;
+	void*			   ready_user;
+	bool			   ready_pending;
+	struct blz_timer   ready_timer;
 	blz_scan_handler_t scan_cb;
 	sd_bus_slot*	   scan_slot;
+	bool			   scan_wanted;
+	uint32_t		   scan_on_ms;
+	uint32_t		   scan_off_ms; /* 0: scan continuously */
 	void*              scan_user;
 
 	blz_conn_handler_t connect_cb;
 	void*              connect_user;
+
+	struct blz_timer_wheel timers;
+	uint32_t           op_timeout_ms;
+	unsigned int       dispatching; /* loop runs calling handlers */
+
+	/* operation scheduler: devices with queued ops, served round-robin */
+	struct blz_list    sched_ready;
+	unsigned int       ops_inflight;
+	unsigned int       max_inflight;
+	unsigned int       max_inflight_dev;
+
+	struct blz_list    polls;
+	struct blz_list    notify_chans; /* per characteristic path */
+	uint32_t           poll_seq;
+	uint32_t           rand_state;
+	struct blz_devdb*  devdb;
+	struct blz_prune*  prune;
+
+	/* device registry by MAC, all Device1 property changes in one match */
+	struct blz_list    dev_hash[DEV_HASH_SIZE];
+	sd_bus_slot*	   dev_slot;
+
+	/* connection manager */
+	struct blz_list    conn_queue[_BLZ_PRIO_LAST];
+	struct blz_list    conn_active; /* connecting or waiting to retry */
+	unsigned int       conn_max_inflight; /* per adapter */
+	unsigned int       conn_retries;
+
+	/* notifications collected during one drain of the bus */
+	blz_notify_batch_handler_t batch_cb;
+	void*              batch_user;
+	struct blz_notify_batch* batch;
+	sd_bus_message**   batch_msgs;
+	size_t             batch_len;
+	size_t             batch_size;
+};
+
+enum rc_state { RC_IDLE, RC_WAIT, RC_CONNECTING, RC_RESOLVING };
+
+struct blz_reconnect {
+	uint32_t			  min_ms; /* backoff */
+	uint32_t			  max_ms; /* 0: not supervised */
+	unsigned int		  attempt;
+	enum rc_state		  state;
+	struct blz_timer	  timer;
+	sd_bus_slot*		  slot; /* pending Connect call */
+	sd_bus_slot*		  objs_slot; /* pending GetManagedObjects */
+	bool				  use_connect_device;
+	blz_reconnect_handler_t cb;
+	void*				  user;
 };
 
 struct blz_dev {
 	struct blz_context*	  ctx;
 	char				  path[DBUS_PATH_MAX_LEN];
 	uint8_t				  mac[6];
-	char				  name[NAME_STR_LEN];
-	sd_bus_slot*		  connect_slot;
-	bool				  connect_async_done;
-	int					  connect_async_result;
+	char				  name[NAME_STR_LEN + 1];
+	struct blz_list		  hash_node; /* in ctx->dev_hash */
+	unsigned int		  refcnt; /* blz_disconnect() calls to free */
+	struct blz_conn_req*  creq; /* while being connected */
+	struct blz_adapter*	  adapter;
+	bool				  linked; /* counted in adapter->links */
 	bool				  connected;
 	bool				  services_resolved;
+	bool				  paired;
 	int16_t				  rssi;
+	int16_t				  tx_power;
 	char**				  service_uuids;
+	enum blz_addr_type	  atype;
+
+	/* handles, kept valid over reconnects */
+	struct blz_list		  servs;
+	struct blz_list		  chars;
+	struct blz_reconnect  rc;
+	struct blz_profile*	  profile; /* applied GATT profile */
+
+	/* property changes, bits of enum blz_dev_prop */
+	uint32_t			  changed; /* since the handler was called */
+	uint32_t			  prop_mask;
+	blz_dev_prop_handler_t prop_cb;
+	void*				  prop_user;
+
+	/* operation scheduler */
+	struct blz_list		  ops[_BLZ_PRIO_LAST];
+	struct blz_list		  ops_inflight;
+	struct blz_list		  sched_node;
+	unsigned int		  ops_queued;
+	unsigned int		  ops_inflight_cnt;
 };
 
 struct blz_serv {
@@ -51,6 +249,7 @@ struct blz_serv {
 	char				uuid[UUID_STR_LEN];
 	char**				char_uuids;
 	size_t				chars_idx;
+	struct blz_list		dev_node; /* in dev->servs */
 };
 
 /* Characteristic Flags (Characteristic Properties bit field) */
@@ -68,11 +267,82 @@ struct blz_char {
 	struct blz_dev*		 dev;
 	char				 path[DBUS_PATH_MAX_LEN];
 	char				 uuid[UUID_STR_LEN];
+	char				 serv_uuid[UUID_STR_LEN]; /* to find it again */
 	uint32_t			 flags;
+	uint16_t			 mtu;
+	struct blz_list		 dev_node; /* in dev->chars */
 	blz_notify_handler_t notify_cb;
-	sd_bus_slot*		 notify_slot;
-	bool				 notifying;
+	bool				 notify_started;
+	struct blz_notify_chan* chan;
+	struct blz_list		 chan_node; /* in chan->chars */
+	struct blz_list		 subs;
+	struct blz_list*	 sub_cursor; /* next sub during dispatch */
 	void*                notify_user;
+	uint8_t				 ops_busy; /* bit per op_type in flight */
+
+	/* last value seen from reads or notifications */
+	uint32_t			 cache_ttl_ms;
+	uint8_t*			 cache;
+	size_t				 cache_len;
+	size_t				 cache_size;
+	uint64_t			 cache_ts; /* ns */
+
+	/* notification arrival tracking */
+	blz_notify_ext_handler_t notify_ext_cb;
+	uint64_t			 notify_ts;	  /* ns, last arrival */
+	uint64_t			 notify_ewma; /* ns, mean inter-arrival time */
+	uint32_t			 notify_seq;
+	uint32_t			 notify_gaps;
+	uint32_t			 notify_lost;
+	uint32_t			 notify_dropped;
+
+	struct blz_latest*	 latest; /* conflation slot, see blzlib.c */
+	struct blz_hist*	 hist;
+};
+
+/* notification state shared by all handles of one characteristic: a single
+ * match and a single StartNotify, delivered to every attached handle */
+struct blz_notify_chan {
+	struct blz_list		node;	/* in ctx->notify_chans */
+	char				path[DBUS_PATH_MAX_LEN];
+	sd_bus_slot*		slot;
+	bool				notifying;
+	struct blz_op*		start_op;	/* StartNotify in flight */
+	struct blz_list		waiters;	/* of the start, see chan_attach() */
+	struct blz_list		chars;	/* attached blz_char */
+	unsigned int		refs;	/* attached chars and running dispatch */
+	struct blz_list*	cursor;	/* next char during dispatch */
+	blz_char*			cur;	/* char during dispatch, NULL if detached */
+};
+
+struct blz_sub {
+	struct blz_list		node;	/* in ch->subs */
+	blz_char*			ch;
+	blz_notify_ext_handler_t cb;
+	void*				user;
+};
+
+enum op_type { OP_READ, OP_WRITE, OP_NOTIFY_START, OP_NOTIFY_STOP };
+
+struct blz_op;
+typedef void (*op_done_cb)(struct blz_op* op, blz_ret ret,
+						   sd_bus_message* reply);
+
+struct blz_op {
+	struct blz_list		 node; /* in device queue or in flight list */
+	struct blz_char*	 ch;
+	enum op_type		 type;
+	enum blz_prio		 prio;
+	bool				 inflight;
+	uint16_t			 offset;
+	uint8_t*			 data;
+	size_t				 len;
+	uint64_t			 deadline; /* ns */
+	struct blz_timer	 timer;
+	sd_bus_slot*		 slot;
+	op_done_cb			 done; /* reply only valid during the call */
+	blz_op_handler_t	 cb;
+	void*				 user;
 };
 /* clang-format on */
 
@@ -83,7 +353,10 @@ enum msg_act {
 	MSG_DEVICE_SCAN,
 	MSG_CHAR_COUNT,
 	MSG_CHARS_ALL,
-	MSG_SERV_FIND
+	MSG_SERV_FIND,
+	MSG_INVENTORY,
+	MSG_PRUNE,
+	MSG_ADAPTER
 };
 
 int msg_parse_objects(sd_bus_message* m, const char* match_path,
@@ -92,11 +365,87 @@ int msg_parse_object(sd_bus_message* m, const char* match_path,
 					 enum msg_act act, void* user);
 int msg_parse_interface(sd_bus_message* m, enum msg_act act, const char* opath,
 						void* user);
-int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
+int msg_parse_notify(sd_bus_message* m, bool* notifying, const void** ptr,
 					 size_t* len);
 int msg_append_property(sd_bus_message* m, const char* name, char type,
 						const void* value);
 int msg_read_variant(sd_bus_message* m, char* type, void* dest);
 int msg_read_variant_strv(sd_bus_message* m, char*** dest);
+blz_ret msg_error_ret(int r, const sd_bus_error* error);
+uint64_t msg_timestamp(sd_bus_message* m);
+
+void sched_dev_init(blz_dev* dev);
+struct blz_op* op_new(blz_char* ch, enum op_type type, enum blz_prio prio,
+					  uint32_t timeout_ms, op_done_cb done, void* user);
+void op_free(struct blz_op* op);
+blz_ret op_set_data(struct blz_op* op, const uint8_t* data, size_t len);
+blz_ret op_submit(struct blz_op* op);
+blz_ret op_call(struct blz_op* op);
+void op_cancel(struct blz_op* op, blz_ret ret);
+void ops_fail_dev(blz_dev* dev, blz_ret ret);
+void ops_fail_char(blz_char* ch, blz_ret ret);
+
+void polls_remove(blz_ctx* ctx, blz_char* ch);
+void char_cache_update(blz_char* ch, const void* data, size_t len);
+void notify_batch_flush(blz_ctx* ctx);
+
+void notify_chans_restart(blz_dev* dev);
+
+blz_dev* dev_new(blz_ctx* ctx, struct blz_adapter* adapter,
+				 const char* macstr, enum blz_addr_type atype);
+void dev_free(blz_dev* dev);
+void dev_unref(blz_dev* dev);
+blz_dev* dev_find(blz_ctx* ctx, const uint8_t* mac);
+bool dev_in_use(blz_ctx* ctx, const uint8_t* mac);
+
+blz_ret adapters_init(blz_ctx* ctx, const char* const* devs, unsigned int n);
+void adapters_fini(blz_ctx* ctx);
+blz_ret adapters_power_on(blz_ctx* ctx, uint32_t timeout_ms,
+						  blz_ready_handler_t cb, void* user);
+struct blz_adapter* adapter_of(blz_ctx* ctx, const char* opath);
+void adapter_seen(blz_ctx* ctx, struct blz_adapter* a, const uint8_t* mac,
+				  int16_t rssi);
+struct blz_adapter* adapter_place(blz_ctx* ctx, const uint8_t* mac);
+void adapter_link(blz_dev* dev, bool up);
+void adapter_update(struct blz_adapter* a);
+void adapters_update(blz_ctx* ctx);
+
+void connect_init(blz_ctx* ctx);
+void connect_fini(blz_ctx* ctx);
+void connect_resolved(blz_dev* dev);
+
+struct disc_dev;
+int discovery_obj(struct disc_dev* dd, const char* opath, const char* uuid,
+				  uint8_t flags, bool is_char);
+
+enum blz_addr_type devdb_atype(blz_ctx* ctx, const uint8_t* mac);
+void devdb_seen(blz_ctx* ctx, const blz_dev* dev);
+void devdb_connected(blz_dev* dev, uint32_t connect_ms);
+void devdb_profile(blz_dev* dev, uint32_t profile_id);
+
+void prune_seen(blz_ctx* ctx, struct blz_adapter* a, const uint8_t* mac);
+int prune_obj(blz_ctx* ctx, struct blz_adapter* a, const blz_dev* dev);
+void prune_fini(blz_ctx* ctx);
+
+bool profile_find_serv(blz_serv* srv);
+bool profile_find_char(blz_char* ch, const char* serv_path);
+
+void reconnect_init(blz_dev* dev);
+void reconnect_lost(blz_dev* dev);
+void reconnect_resolved(blz_dev* dev);
+void reconnect_stop(blz_dev* dev);
+
+void hist_add(struct blz_hist* h, uint64_t ts, const void* data, size_t len);
+void hist_free(struct blz_hist* h);
+
+uint64_t timer_now(void);
+void timer_wheel_init(struct blz_timer_wheel* tw, uint64_t now_ns);
+void timer_init(struct blz_timer* t, blz_timer_cb cb, void* user);
+void timer_arm(struct blz_timer_wheel* tw, struct blz_timer* t,
+			   uint64_t expire_ns);
+void timer_cancel(struct blz_timer* t);
+bool timer_armed(const struct blz_timer* t);
+void timer_run(struct blz_timer_wheel* tw, uint64_t now_ns);
+uint64_t timer_next(const struct blz_timer_wheel* tw);
 
 #endif
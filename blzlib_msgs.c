@@ -5,6 +5,7 @@
  * Version 3. See the file COPYING for more details.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +22,7 @@ static int msg_parse_characteristic1(sd_bus_message* m, const char* opath,
 	const char* str;
 	const char* uuid;
 	char** flags;
+	uint16_t mtu = 0;
 
 	/* enter array of dict entries */
 	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
@@ -50,6 +52,12 @@ static int msg_parse_characteristic1(sd_bus_message* m, const char* opath,
 			if (r < 0) {
 				return r;
 			}
+		} else if (strcmp(str, "MTU") == 0) {
+			/* only available since Bluez 5.62 */
+			r = msg_read_variant(m, "q", &mtu);
+			if (r < 0) {
+				return r;
+			}
 		} else {
 			r = sd_bus_message_skip(m, "v");
 			if (r < 0) {
@@ -87,6 +95,7 @@ static int msg_parse_characteristic1(sd_bus_message* m, const char* opath,
 		if (ch->uuid[0] == '\0') {
 			strncpy(ch->uuid, uuid, UUID_STR_LEN);
 		}
+		ch->mtu = mtu > 0 ? mtu : ATT_DEFAULT_MTU;
 
 		/* convert flags */
 		for (int i = 0; flags != NULL && flags[i] != NULL; i++) {
@@ -220,13 +229,23 @@ static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
 			if (r < 0) {
 				return r;
 			}
-			strncpy(dev->name, str, NAME_STR_LEN);
+			if (strncmp(dev->name, str, NAME_STR_LEN) != 0) {
+				strncpy(dev->name, str, NAME_STR_LEN);
+				dev->changed |= BLZ_DEV_NAME;
+			}
 		} else if (strcmp(str, "Address") == 0) {
 			r = msg_read_variant(m, "s", &str);
 			if (r < 0) {
 				return r;
 			}
 			blz_string_to_mac(str, dev->mac);
+		} else if (strcmp(str, "AddressType") == 0) {
+			r = msg_read_variant(m, "s", &str);
+			if (r < 0) {
+				return r;
+			}
+			dev->atype = strcmp(str, "public") == 0 ? BLZ_ADDR_PUBLIC
+													: BLZ_ADDR_RANDOM;
 		} else if (strcmp(str, "UUIDs") == 0) {
 			r = msg_read_variant_strv(m, &dev->service_uuids);
 			if (r < 0) {
@@ -239,7 +258,17 @@ static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
 			if (r < 0) {
 				return r;
 			}
-			dev->services_resolved = b;
+			if (dev->services_resolved != b) {
+				dev->services_resolved = b;
+				dev->changed |= BLZ_DEV_SERVICES_RESOLVED;
+			}
+		} else if (strcmp(str, "Paired") == 0) {
+			int b;
+			r = msg_read_variant(m, "b", &b);
+			if (r < 0) {
+				return r;
+			}
+			dev->paired = b;
 		} else if (strcmp(str, "Connected") == 0) {
 			/* note: bool in sd-dbus is expected to be int type */
 			int b;
@@ -247,15 +276,33 @@ static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
 			if (r < 0) {
 				return r;
 			}
-			dev->connected = b;
+			if (dev->connected != b) {
+				dev->connected = b;
+				dev->changed |= BLZ_DEV_CONNECTED;
+			}
 			if (dev && dev->ctx && dev->ctx->connect_cb) {
 				dev->ctx->connect_cb(b, 0, false, dev->ctx->connect_user);
 			}
 		} else if (strcmp(str, "RSSI") == 0) {
-			r = msg_read_variant(m, "n", &dev->rssi);
+			int16_t rssi;
+			r = msg_read_variant(m, "n", &rssi);
+			if (r < 0) {
+				return r;
+			}
+			if (dev->rssi != rssi) {
+				dev->rssi = rssi;
+				dev->changed |= BLZ_DEV_RSSI;
+			}
+		} else if (strcmp(str, "TxPower") == 0) {
+			int16_t tx_power;
+			r = msg_read_variant(m, "n", &tx_power);
 			if (r < 0) {
 				return r;
 			}
+			if (dev->tx_power != tx_power) {
+				dev->tx_power = tx_power;
+				dev->changed |= BLZ_DEV_TX_POWER;
+			}
 		} else {
 			r = sd_bus_message_skip(m, "v");
 			if (r < 0) {
@@ -287,6 +334,63 @@ static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
 	return r;
 }
 
+static int msg_parse_adapter1(sd_bus_message* m, struct blz_adapter* a)
+{
+	const char* str;
+
+	/* enter array of dict entries */
+	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
+	if (r < 0) {
+		LOG_ERR("BLZ error parse adapter 1");
+		return r;
+	}
+
+	/* enter next dict */
+	while ((r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+		/* property name */
+		r = sd_bus_message_read_basic(m, 's', &str);
+		if (r < 0) {
+			LOG_ERR("BLZ error parse adapter 2");
+			return r;
+		}
+
+		if (strcmp(str, "Powered") == 0) {
+			/* note: bool in sd-dbus is expected to be int type */
+			int b;
+			r = msg_read_variant(m, "b", &b);
+			if (r < 0) {
+				return r;
+			}
+			a->powered = b;
+		} else {
+			r = sd_bus_message_skip(m, "v");
+			if (r < 0) {
+				LOG_ERR("BLZ error parse adapter 3");
+				return r;
+			}
+		}
+
+		/* exit dict */
+		r = sd_bus_message_exit_container(m);
+		if (r < 0) {
+			LOG_ERR("BLZ error parse adapter 4");
+			return r;
+		}
+	}
+
+	if (r < 0) {
+		LOG_ERR("BLZ error parse adapter 5");
+		return r;
+	}
+
+	/* exit array */
+	r = sd_bus_message_exit_container(m);
+	if (r < 0) {
+		LOG_ERR("BLZ error parse adapter 6");
+	}
+	return r;
+}
+
 int msg_parse_interface(sd_bus_message* m, enum msg_act act, const char* opath,
 						void* user)
 {
@@ -332,6 +436,28 @@ int msg_parse_interface(sd_bus_message* m, enum msg_act act, const char* opath,
 		srv->char_uuids[srv->chars_idx] = strdup(ch.uuid);
 		srv->chars_idx++;
 		return 0; // override RETURN_FOUND this would stop the loop
+	} else if (act == MSG_INVENTORY
+			   && strcmp(intf, "org.bluez.GattService1") == 0) {
+		/* collect all services and characteristics of a device, user
+		 * points to the device of a discovery job */
+		blz_serv srv = {0};
+		r = msg_parse_service1(m, opath, &srv);
+		if (r < 0) {
+			return r;
+		}
+		return discovery_obj(user, opath, srv.uuid, 0, false);
+	} else if (act == MSG_INVENTORY
+			   && strcmp(intf, "org.bluez.GattCharacteristic1") == 0) {
+		blz_char ch = {0};
+		r = msg_parse_characteristic1(m, opath, &ch);
+		if (r < 0) {
+			return r;
+		}
+		return discovery_obj(user, opath, ch.uuid, ch.flags, true);
+	} else if (act == MSG_ADAPTER
+			   && strcmp(intf, "org.bluez.Adapter1") == 0) {
+		/* parse adapter properties, user points to the adapter */
+		r = msg_parse_adapter1(m, user);
 	} else if (act == MSG_DEVICE && strcmp(intf, "org.bluez.Device1") == 0) {
 		/* parse device properties, user points to device */
 		r = msg_parse_device1(m, opath, user);
@@ -346,14 +472,39 @@ int msg_parse_interface(sd_bus_message* m, enum msg_act act, const char* opath,
 			return r;
 		}
 
-		/* callback */
+		/* callback, for devices of our adapters only */
 		blz_ctx* ctx = user;
-		if (ctx != NULL && ctx->scan_cb != NULL) {
-			ctx->scan_cb(dev.mac, BLZ_ADDR_UNKNOWN, dev.rssi, NULL, 0,
-						 ctx->scan_user);
+		struct blz_adapter* a = ctx != NULL ? adapter_of(ctx, opath) : NULL;
+		if (a != NULL) {
+			adapter_seen(ctx, a, dev.mac, dev.rssi);
+			devdb_seen(ctx, &dev);
+			prune_seen(ctx, a, dev.mac);
+		}
+		if (a != NULL && ctx->scan_cb != NULL) {
+			ctx->scan_cb(dev.mac, dev.atype, dev.rssi, NULL, 0, ctx->scan_user);
 		}
 
 		/* free uuids of temporary device */
+		for (int i = 0;
+			 dev.service_uuids != NULL && dev.service_uuids[i] != NULL; i++) {
+			free(dev.service_uuids[i]);
+		}
+		free(dev.service_uuids);
+	} else if (act == MSG_PRUNE && strcmp(intf, "org.bluez.Device1") == 0) {
+		/* collect the devices of our adapters for removing stale ones,
+		 * user points to the context */
+		blz_dev dev = {0};
+		r = msg_parse_device1(m, opath, &dev);
+		if (r < 0) {
+			return r;
+		}
+
+		blz_ctx* ctx = user;
+		struct blz_adapter* a = adapter_of(ctx, opath);
+		if (a != NULL) {
+			r = prune_obj(ctx, a, &dev);
+		}
+
 		for (int i = 0;
 			 dev.service_uuids != NULL && dev.service_uuids[i] != NULL; i++) {
 			free(dev.service_uuids[i]);
@@ -473,7 +624,7 @@ int msg_parse_objects(sd_bus_message* m, const char* match_path,
 	return r;
 }
 
-int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
+int msg_parse_notify(sd_bus_message* m, bool* notifying, const void** ptr,
 					 size_t* len)
 {
 	int r;
@@ -521,7 +672,7 @@ int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
 		if (r < 0) {
 			return -2;
 		}
-		ch->notifying = b;
+		*notifying = b;
 	} else if (strcmp(str, "Value") == 0) {
 		/* enter variant */
 		r = sd_bus_message_enter_container(m, 'v', "ay");
@@ -562,7 +713,8 @@ int msg_append_property(sd_bus_message* m, const char* name, char type,
 	}
 
 	/* open variant */
-	r = sd_bus_message_open_container(m, 'v', "s");
+	char sig[2] = {type, '\0'};
+	r = sd_bus_message_open_container(m, 'v', sig);
 	if (r < 0) {
 		LOG_ERR("BLZ failed to create property");
 		return r;
@@ -638,3 +790,32 @@ int msg_read_variant_strv(sd_bus_message* m, char*** dest)
 
 	return r;
 }
+
+/** map a failed method call to our return codes */
+blz_ret msg_error_ret(int r, const sd_bus_error* error)
+{
+	if (r == -ETIMEDOUT || sd_bus_error_has_name(error, SD_BUS_ERROR_NO_REPLY)
+		|| sd_bus_error_has_name(error, SD_BUS_ERROR_TIMEOUT)) {
+		return BLZ_ERR_TIMEOUT;
+	} else if (r == -ENOTCONN
+			   || sd_bus_error_has_name(error, "org.bluez.Error.NotConnected")) {
+		return BLZ_ERR_NOT_CONNECTED;
+	} else if (sd_bus_error_has_name(error, "org.bluez.Error.NotAuthorized")
+			   || sd_bus_error_has_name(error, "org.bluez.Error.NotPermitted")) {
+		return BLZ_ERR_AUTH;
+	}
+	return BLZ_ERR;
+}
+
+/** dispatch time of a message in CLOCK_MONOTONIC ns. sd-bus has no receive
+ * timestamps on socket transports, so this is when the message is taken
+ * from its queue, unless the bus ever attaches one */
+uint64_t msg_timestamp(sd_bus_message* m)
+{
+	uint64_t usec;
+
+	if (sd_bus_message_get_monotonic_usec(m, &usec) >= 0) {
+		return usec * 1000;
+	}
+	return timer_now();
+}
@@ -0,0 +1,462 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * GATT operation scheduler
+ *
+ * All ReadValue, WriteValue, StartNotify and StopNotify calls are queued per
+ * device and priority and sent asynchronously. Devices with queued operations
+ * are kept in a ready list which is served round-robin, one operation at a
+ * time, so a busy link can not starve the others. The number of operations
+ * in flight is bounded per device and per context: BlueZ answers "In
+ * Progress" for a second read or write on the same characteristic and
+ * dbus-daemon limits pending replies per connection (128 on the system bus).
+ * Blocking calls from inside handlers can not run the loop to wait for their
+ * reply, they are sent directly with op_call().
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+static const char* op_method[] = {
+	[OP_READ] = "ReadValue",
+	[OP_WRITE] = "WriteValue",
+	[OP_NOTIFY_START] = "StartNotify",
+	[OP_NOTIFY_STOP] = "StopNotify",
+};
+
+static void sched_dispatch(blz_ctx* ctx);
+
+void sched_dev_init(blz_dev* dev)
+{
+	for (int i = 0; i < _BLZ_PRIO_LAST; i++) {
+		list_init(&dev->ops[i]);
+	}
+	list_init(&dev->ops_inflight);
+	list_init(&dev->sched_node);
+	dev->ops_queued = 0;
+	dev->ops_inflight_cnt = 0;
+}
+
+/* device is in the ready list when it has queued ops and room in flight */
+static void sched_dev_update(blz_dev* dev)
+{
+	blz_ctx* ctx = dev->ctx;
+	bool ready
+		= dev->ops_queued > 0 && dev->ops_inflight_cnt < ctx->max_inflight_dev;
+
+	if (ready && list_empty(&dev->sched_node)) {
+		list_add_tail(&ctx->sched_ready, &dev->sched_node);
+	} else if (!ready && !list_empty(&dev->sched_node)) {
+		list_del(&dev->sched_node);
+	}
+}
+
+void op_free(struct blz_op* op)
+{
+	free(op->data);
+	free(op);
+}
+
+/* remove op from wherever it is, call its handler and free it */
+static void op_complete(struct blz_op* op, blz_ret ret, sd_bus_message* reply)
+{
+	blz_dev* dev = op->ch->dev;
+	blz_ctx* ctx = op->ch->ctx;
+
+	timer_cancel(&op->timer);
+	op->slot = sd_bus_slot_unref(op->slot);
+	list_del(&op->node);
+
+	if (op->inflight) {
+		op->ch->ops_busy &= ~(1 << op->type);
+		dev->ops_inflight_cnt--;
+		ctx->ops_inflight--;
+	} else {
+		dev->ops_queued--;
+	}
+	sched_dev_update(dev);
+
+	if (op->done) {
+		op->done(op, ret, reply);
+	}
+	op_free(op);
+
+	sched_dispatch(ctx);
+}
+
+/* the signal for the Value change can come later than the reply */
+static void op_cache_update(struct blz_op* op, sd_bus_message* reply)
+{
+	const void* ptr;
+	size_t len;
+
+	if (op->type != OP_READ || op->ch->cache_ttl_ms == 0) {
+		return;
+	}
+	if (sd_bus_message_read_array(reply, 'y', &ptr, &len) >= 0) {
+		char_cache_update(op->ch, ptr, len);
+	}
+	sd_bus_message_rewind(reply, true);
+}
+
+static int op_reply_cb(sd_bus_message* reply, void* user, sd_bus_error* err)
+{
+	struct blz_op* op = user;
+	blz_ret ret = BLZ_OK;
+
+	const sd_bus_error* error = sd_bus_message_get_error(reply);
+	if (error != NULL) {
+		ret = msg_error_ret(-sd_bus_message_get_errno(reply), error);
+		LOG_ERR("BLZ: %s failed: %s", op_method[op->type], error->message);
+	} else {
+		op_cache_update(op, reply);
+	}
+
+	op_complete(op, ret, error == NULL ? reply : NULL);
+	return 0;
+}
+
+static void op_timeout_cb(struct blz_timer* t, void* user)
+{
+	struct blz_op* op = user;
+
+	LOG_ERR("BLZ: %s timeout", op_method[op->type]);
+	op_complete(op, BLZ_ERR_TIMEOUT, NULL);
+}
+
+static int op_message(struct blz_op* op, sd_bus_message** call)
+{
+	int r;
+
+	r = sd_bus_message_new_method_call(op->ch->ctx->bus, call, "org.bluez",
+									   op->ch->path,
+									   "org.bluez.GattCharacteristic1",
+									   op_method[op->type]);
+	if (r < 0) {
+		return r;
+	}
+
+	if (op->type == OP_WRITE) {
+		r = sd_bus_message_append_array(*call, 'y', op->data, op->len);
+		if (r < 0) {
+			return r;
+		}
+	}
+
+	if (op->type == OP_READ || op->type == OP_WRITE) {
+		r = sd_bus_message_open_container(*call, 'a', "{sv}");
+		if (r < 0) {
+			return r;
+		}
+
+		if (op->offset > 0) {
+			r = msg_append_property(*call, "offset", 'q', &op->offset);
+			if (r < 0) {
+				return r;
+			}
+		}
+
+		r = sd_bus_message_close_container(*call);
+	}
+	return r;
+}
+
+/* the deadline timer covers time in queue and in flight, sd-bus gets the
+ * remainder so it does not use its default timeout */
+static uint64_t op_usec(struct blz_op* op)
+{
+	uint64_t now = timer_now();
+	return op->deadline > now ? (op->deadline - now) / 1000 : 1;
+}
+
+static int op_send(struct blz_op* op)
+{
+	sd_bus_message* call = NULL;
+	int r;
+
+	r = op_message(op, &call);
+	if (r >= 0) {
+		r = sd_bus_call_async(op->ch->ctx->bus, &op->slot, call, op_reply_cb,
+							  op, op_usec(op));
+	}
+	if (r < 0) {
+		LOG_ERR("BLZ: %s failed to send: %s", op_method[op->type],
+				strerror(-r));
+	}
+	sd_bus_message_unref(call);
+	return r;
+}
+
+/* first op in priority order whose characteristic is not already busy with
+ * the same kind of operation */
+static struct blz_op* sched_next_op(blz_dev* dev)
+{
+	for (int p = 0; p < _BLZ_PRIO_LAST; p++) {
+		for (struct blz_list* n = dev->ops[p].next; n != &dev->ops[p];
+			 n = n->next) {
+			struct blz_op* op = list_entry(n, struct blz_op, node);
+			if (!(op->ch->ops_busy & (1 << op->type))) {
+				return op;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void sched_dispatch(blz_ctx* ctx)
+{
+	while (ctx->ops_inflight < ctx->max_inflight
+		   && !list_empty(&ctx->sched_ready)) {
+		blz_dev* dev
+			= list_entry(ctx->sched_ready.next, struct blz_dev, sched_node);
+		list_del(&dev->sched_node);
+
+		/* ops of a disconnected device are failed by ops_fail_dev() */
+		struct blz_op* op = dev->connected ? sched_next_op(dev) : NULL;
+		if (op == NULL) {
+			/* all blocked, re-added when one of its ops completes */
+			continue;
+		}
+
+		list_del(&op->node);
+		dev->ops_queued--;
+		list_add_tail(&dev->ops_inflight, &op->node);
+		dev->ops_inflight_cnt++;
+		ctx->ops_inflight++;
+		op->ch->ops_busy |= 1 << op->type;
+		op->inflight = true;
+
+		/* round-robin: back to the end of the list */
+		sched_dev_update(dev);
+
+		if (op_send(op) < 0) {
+			op_complete(op, BLZ_ERR_BUS, NULL);
+		}
+	}
+}
+
+struct blz_op* op_new(blz_char* ch, enum op_type type, enum blz_prio prio,
+					  uint32_t timeout_ms, op_done_cb done, void* user)
+{
+	struct blz_op* op = calloc(1, sizeof(struct blz_op));
+	if (op == NULL) {
+		LOG_ERR("BLZ: op alloc failed");
+		return NULL;
+	}
+
+	list_init(&op->node);
+	timer_init(&op->timer, op_timeout_cb, op);
+	op->ch = ch;
+	op->type = type;
+	op->prio = prio < _BLZ_PRIO_LAST ? prio : BLZ_PRIO_BULK;
+	op->deadline = timer_now() + (uint64_t)timeout_ms * 1000000;
+	op->done = done;
+	op->user = user;
+	return op;
+}
+
+/** on error the op is freed */
+blz_ret op_set_data(struct blz_op* op, const uint8_t* data, size_t len)
+{
+	op->data = malloc(len > 0 ? len : 1);
+	if (op->data == NULL) {
+		LOG_ERR("BLZ: op data alloc failed");
+		op_free(op);
+		return BLZ_ERR;
+	}
+	memcpy(op->data, data, len);
+	op->len = len;
+	return BLZ_OK;
+}
+
+/** on error the op is freed without calling the handler */
+blz_ret op_submit(struct blz_op* op)
+{
+	blz_dev* dev = op->ch->dev;
+	blz_ctx* ctx = op->ch->ctx;
+
+	/* dev is NULL when the handle outlived its device */
+	if (dev == NULL || !dev->connected) {
+		op_free(op);
+		return BLZ_ERR_NOT_CONNECTED;
+	}
+
+	list_add_tail(&dev->ops[op->prio], &op->node);
+	dev->ops_queued++;
+	timer_arm(&ctx->timers, &op->timer, op->deadline);
+
+	sched_dev_update(dev);
+	sched_dispatch(ctx);
+	return BLZ_OK;
+}
+
+/** send op and block on its reply until its deadline, without the scheduler
+ * and without dispatching anything else. For blocking calls from inside
+ * handlers, where the loop can not run. Like op_submit() on error the op is
+ * freed without calling the handler, otherwise it was called */
+blz_ret op_call(struct blz_op* op)
+{
+	blz_dev* dev = op->ch->dev;
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message* call = NULL;
+	sd_bus_message* reply = NULL;
+	blz_ret ret = BLZ_OK;
+	int r;
+
+	if (dev == NULL || !dev->connected) {
+		op_free(op);
+		return BLZ_ERR_NOT_CONNECTED;
+	}
+
+	r = op_message(op, &call);
+	if (r < 0) {
+		LOG_ERR("BLZ: %s failed to send: %s", op_method[op->type],
+				strerror(-r));
+		ret = BLZ_ERR_BUS;
+	} else {
+		r = sd_bus_call(op->ch->ctx->bus, call, op_usec(op), &error, &reply);
+		if (r < 0) {
+			ret = msg_error_ret(r, &error);
+			LOG_ERR("BLZ: %s failed: %s", op_method[op->type],
+					error.message != NULL ? error.message : strerror(-r));
+		} else {
+			op_cache_update(op, reply);
+		}
+	}
+
+	if (op->done) {
+		op->done(op, ret, ret == BLZ_OK ? reply : NULL);
+	}
+	op_free(op);
+	sd_bus_message_unref(reply);
+	sd_bus_message_unref(call);
+	sd_bus_error_free(&error);
+	return BLZ_OK;
+}
+
+/** completes op with ret, calling its handler */
+void op_cancel(struct blz_op* op, blz_ret ret)
+{
+	op_complete(op, ret, NULL);
+}
+
+static void ops_fail_list(struct blz_list* l, blz_char* ch, blz_ret ret)
+{
+	struct blz_list* n = l->next;
+
+	while (n != l) {
+		struct blz_op* op = list_entry(n, struct blz_op, node);
+		n = n->next;
+		if (ch == NULL || op->ch == ch) {
+			op_complete(op, ret, NULL);
+			/* handlers may have completed other ops as well */
+			n = l->next;
+		}
+	}
+}
+
+/** fail all queued and in flight ops of a device, e.g. on disconnect */
+void ops_fail_dev(blz_dev* dev, blz_ret ret)
+{
+	for (int p = 0; p < _BLZ_PRIO_LAST; p++) {
+		ops_fail_list(&dev->ops[p], NULL, ret);
+	}
+	ops_fail_list(&dev->ops_inflight, NULL, ret);
+}
+
+/** fail all ops of a characteristic, e.g. before it is freed */
+void ops_fail_char(blz_char* ch, blz_ret ret)
+{
+	/* the ops were failed when the device was freed */
+	if (ch->dev == NULL) {
+		return;
+	}
+	for (int p = 0; p < _BLZ_PRIO_LAST; p++) {
+		ops_fail_list(&ch->dev->ops[p], ch, ret);
+	}
+	ops_fail_list(&ch->dev->ops_inflight, ch, ret);
+}
+
+void blz_set_max_inflight(blz_ctx* ctx, unsigned int per_dev,
+						  unsigned int total)
+{
+	ctx->max_inflight_dev = per_dev > 0 ? per_dev : MAX_INFLIGHT_DEV;
+	ctx->max_inflight = total > 0 ? total : MAX_INFLIGHT;
+	sched_dispatch(ctx);
+}
+
+/*
+ * Public asynchronous operations
+ */
+
+struct async_op {
+	blz_op_handler_t cb;
+	void* user;
+};
+
+static void async_done(struct blz_op* op, blz_ret ret, sd_bus_message* reply)
+{
+	const void* ptr = NULL;
+	size_t len = 0;
+
+	if (ret == BLZ_OK && reply != NULL && op->type == OP_READ) {
+		if (sd_bus_message_read_array(reply, 'y', &ptr, &len) < 0) {
+			LOG_ERR("BLZ: Failed to read result");
+			ret = BLZ_ERR;
+		}
+	}
+
+	if (op->cb) {
+		op->cb(ret, ptr, len, op->ch, op->user);
+	}
+}
+
+blz_ret blz_char_read_async(blz_char* ch, enum blz_prio prio,
+							blz_op_handler_t cb, void* user)
+{
+	if (!(ch->flags & BLZ_CHAR_READ)) {
+		LOG_ERR("BLZ: Characteristic does not support read");
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	struct blz_op* op
+		= op_new(ch, OP_READ, prio, ch->ctx->op_timeout_ms, async_done, user);
+	if (op == NULL) {
+		return BLZ_ERR;
+	}
+	op->cb = cb;
+	return op_submit(op);
+}
+
+blz_ret blz_char_write_async(blz_char* ch, const uint8_t* data, size_t len,
+							 enum blz_prio prio, blz_op_handler_t cb,
+							 void* user)
+{
+	if (!(ch->flags & (BLZ_CHAR_WRITE | BLZ_CHAR_WRITE_WITHOUT_RESPONSE))) {
+		LOG_ERR("BLZ: Characteristic does not support write");
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	struct blz_op* op
+		= op_new(ch, OP_WRITE, prio, ch->ctx->op_timeout_ms, async_done, user);
+	if (op == NULL) {
+		return BLZ_ERR;
+	}
+	if (op_set_data(op, data, len) != BLZ_OK) {
+		return BLZ_ERR;
+	}
+	op->cb = cb;
+	return op_submit(op);
+}
@@ -0,0 +1,175 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Periodic read engine
+ *
+ * Every registered characteristic has a timer on the context timer wheel
+ * which submits a bulk priority read to the operation scheduler. The first
+ * reads are spread over the period so many entries with the same period do
+ * not fire at once. When the previous read of an entry has not completed
+ * when the next one is due, the link is falling behind: that cycle is
+ * skipped and the period is stretched, and relaxed again as reads complete
+ * in time. Disconnected devices are skipped without bus traffic.
+ */
+
+#include <stdlib.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/* stretch period up to this factor when the link falls behind */
+#define POLL_MAX_STRETCH 8
+
+/* clang-format off */
+struct blz_poll {
+	struct blz_list		node; /* in ctx->polls */
+	struct blz_char*	ch;
+	uint32_t			period_ms;
+	uint32_t			cur_period_ms;
+	uint64_t			next; /* ns */
+	struct blz_timer	timer;
+	struct blz_op*		op;   /* outstanding read */
+	blz_op_handler_t	cb;
+	void*				user;
+};
+/* clang-format on */
+
+static void poll_done(struct blz_op* op, blz_ret ret, sd_bus_message* reply)
+{
+	struct blz_poll* p = op->user;
+	const void* ptr = NULL;
+	size_t len = 0;
+
+	p->op = NULL;
+
+	/* recover from stretching gradually */
+	if (ret == BLZ_OK && p->cur_period_ms > p->period_ms) {
+		p->cur_period_ms = MAX(p->period_ms, p->cur_period_ms * 3 / 4);
+	}
+
+	if (ret == BLZ_OK
+		&& sd_bus_message_read_array(reply, 'y', &ptr, &len) < 0) {
+		LOG_ERR("BLZ: Failed to read poll result");
+		ret = BLZ_ERR;
+	}
+
+	if (p->cb) {
+		p->cb(ret, ptr, len, p->ch, p->user);
+	}
+}
+
+static void poll_timer_cb(struct blz_timer* t, void* user)
+{
+	struct blz_poll* p = user;
+	blz_ctx* ctx = p->ch->ctx;
+	uint64_t now = timer_now();
+
+	/* keep the phase, unless we are more than a period late */
+	p->next += (uint64_t)p->cur_period_ms * 1000000;
+	if (p->next <= now) {
+		p->next = now + (uint64_t)p->cur_period_ms * 1000000;
+	}
+	timer_arm(&ctx->timers, &p->timer, p->next);
+
+	/* the device may also have been freed before the characteristic */
+	if (p->ch->dev == NULL || !p->ch->dev->connected) {
+		return;
+	}
+
+	if (p->op != NULL) {
+		/* previous read still queued or in flight: skip and slow down */
+		p->cur_period_ms
+			= MIN(p->cur_period_ms * 2, p->period_ms * POLL_MAX_STRETCH);
+		LOG_DBG("BLZ: Poll %s behind, period %u ms", p->ch->uuid,
+				p->cur_period_ms);
+		return;
+	}
+
+	/* reads must not pile up longer than the link needs to catch up */
+	uint32_t timeout
+		= MIN(ctx->op_timeout_ms, p->period_ms * POLL_MAX_STRETCH);
+	struct blz_op* op
+		= op_new(p->ch, OP_READ, BLZ_PRIO_BULK, timeout, poll_done, p);
+	if (op == NULL) {
+		return;
+	}
+
+	p->op = op;
+	if (op_submit(op) != BLZ_OK) {
+		p->op = NULL;
+	}
+}
+
+blz_poll* blz_poll_add(blz_char* ch, uint32_t period_ms, blz_op_handler_t cb,
+					   void* user)
+{
+	blz_ctx* ctx;
+
+	if (ch == NULL || period_ms == 0 || !(ch->flags & BLZ_CHAR_READ)) {
+		LOG_ERR("BLZ: Invalid poll parameters");
+		return NULL;
+	}
+
+	struct blz_poll* p = calloc(1, sizeof(struct blz_poll));
+	if (p == NULL) {
+		LOG_ERR("BLZ: blz_poll alloc failed");
+		return NULL;
+	}
+
+	ctx = ch->ctx;
+	p->ch = ch;
+	p->period_ms = period_ms;
+	p->cur_period_ms = period_ms;
+	p->cb = cb;
+	p->user = user;
+	timer_init(&p->timer, poll_timer_cb, p);
+	list_add_tail(&ctx->polls, &p->node);
+
+	/* spread first reads over the period with the golden ratio sequence,
+	 * so any number of entries is evenly distributed */
+	uint32_t frac = ctx->poll_seq++ * 2654435769u;
+	uint64_t offset_ms = (uint64_t)period_ms * frac >> 32;
+	p->next = timer_now() + offset_ms * 1000000;
+	timer_arm(&ctx->timers, &p->timer, p->next);
+
+	return p;
+}
+
+void blz_poll_remove(blz_poll* p)
+{
+	if (p == NULL) {
+		return;
+	}
+
+	timer_cancel(&p->timer);
+	p->cb = NULL;
+	if (p->op != NULL) {
+		op_cancel(p->op, BLZ_ERR);
+	}
+	list_del(&p->node);
+	free(p);
+}
+
+/** remove all polls of a characteristic, or all if ch is NULL */
+void polls_remove(blz_ctx* ctx, blz_char* ch)
+{
+	struct blz_list* n = ctx->polls.next;
+
+	while (n != &ctx->polls) {
+		struct blz_poll* p = list_entry(n, struct blz_poll, node);
+		n = n->next;
+		if (ch == NULL || p->ch == ch) {
+			blz_poll_remove(p);
+			/* handlers of completed ops may have removed others */
+			n = ctx->polls.next;
+		}
+	}
+}
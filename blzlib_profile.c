@@ -0,0 +1,253 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * GATT profiles
+ *
+ * BlueZ assigns the same object paths below the device (serviceNNNN and
+ * serviceNNNN/charMMMM) to devices running the same firmware. A profile
+ * records these relative paths with UUIDs and flags from one device whose
+ * handles were found the usual way. When it is applied to another device,
+ * only the UUID of one service object is checked, and afterwards service
+ * and characteristic handles are created from the profile without walking
+ * all objects of BlueZ. UUIDs not in the profile are still looked up.
+ * The MTU belongs to the connection, not to the model, and is read when it
+ * is first needed.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define PROFILE_REL_LEN 32 /* "/serviceNNNN/charMMMM" */
+
+/* clang-format off */
+struct blz_profile_entry {
+	char		uuid[UUID_STR_LEN];
+	char		rel[PROFILE_REL_LEN]; /* path relative to the device */
+	uint32_t	flags; /* characteristics only */
+};
+
+struct blz_profile {
+	struct blz_profile_entry*	servs;
+	size_t						servs_cnt;
+	struct blz_profile_entry*	chars;
+	size_t						chars_cnt;
+};
+/* clang-format on */
+
+static bool profile_rel(const blz_dev* dev, const char* path, char* rel)
+{
+	size_t dlen = strlen(dev->path);
+
+	if (strncmp(path, dev->path, dlen) != 0
+		|| strlen(path + dlen) >= PROFILE_REL_LEN) {
+		return false;
+	}
+	strcpy(rel, path + dlen);
+	return true;
+}
+
+static bool profile_path(const blz_dev* dev, const char* rel, char* path)
+{
+	size_t dlen = strlen(dev->path);
+
+	if (dlen + strlen(rel) >= DBUS_PATH_MAX_LEN) {
+		return false;
+	}
+	memcpy(path, dev->path, dlen);
+	strcpy(path + dlen, rel);
+	return true;
+}
+
+static int profile_entry_cmp(const void* a, const void* b)
+{
+	return strcmp(((const struct blz_profile_entry*)a)->rel,
+				  ((const struct blz_profile_entry*)b)->rel);
+}
+
+blz_profile* blz_profile_learn(blz_dev* dev)
+{
+	struct blz_profile* p;
+	size_t ns = 0;
+	size_t nc = 0;
+
+	if (dev == NULL) {
+		return NULL;
+	}
+
+	for (struct blz_list* n = dev->servs.next; n != &dev->servs; n = n->next) {
+		ns++;
+	}
+	for (struct blz_list* n = dev->chars.next; n != &dev->chars; n = n->next) {
+		nc++;
+	}
+
+	if (ns == 0) {
+		LOG_ERR("BLZ: Profile needs at least one service");
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(struct blz_profile));
+	if (p != NULL) {
+		p->servs = calloc(ns, sizeof(struct blz_profile_entry));
+		p->chars = calloc(nc + 1, sizeof(struct blz_profile_entry));
+	}
+	if (p == NULL || p->servs == NULL || p->chars == NULL) {
+		LOG_ERR("BLZ: Profile alloc failed");
+		blz_profile_free(p);
+		return NULL;
+	}
+
+	for (struct blz_list* n = dev->servs.next; n != &dev->servs; n = n->next) {
+		blz_serv* srv = list_entry(n, struct blz_serv, dev_node);
+		struct blz_profile_entry* e = &p->servs[p->servs_cnt];
+		if (profile_rel(dev, srv->path, e->rel)) {
+			strcpy(e->uuid, srv->uuid);
+			p->servs_cnt++;
+		}
+	}
+
+	for (struct blz_list* n = dev->chars.next; n != &dev->chars; n = n->next) {
+		blz_char* ch = list_entry(n, struct blz_char, dev_node);
+		struct blz_profile_entry* e = &p->chars[p->chars_cnt];
+		if (profile_rel(dev, ch->path, e->rel)) {
+			strcpy(e->uuid, ch->uuid);
+			e->flags = ch->flags;
+			p->chars_cnt++;
+		}
+	}
+
+	/* independent of the order the handles were created in */
+	qsort(p->servs, p->servs_cnt, sizeof(struct blz_profile_entry),
+		  profile_entry_cmp);
+	qsort(p->chars, p->chars_cnt, sizeof(struct blz_profile_entry),
+		  profile_entry_cmp);
+
+	LOG_INF("BLZ: Learned profile with %zu services and %zu characteristics",
+			p->servs_cnt, p->chars_cnt);
+	return p;
+}
+
+blz_ret blz_profile_apply(blz_profile* p, blz_dev* dev)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	char path[DBUS_PATH_MAX_LEN];
+	char* uuid = NULL;
+	blz_ret ret = BLZ_OK;
+	int r;
+
+	if (p == NULL || dev == NULL || p->servs_cnt == 0) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	dev->profile = NULL;
+
+	/* one object is enough to tell the firmware apart */
+	if (!profile_path(dev, p->servs[0].rel, path)) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+	r = sd_bus_get_property_string(dev->ctx->bus, "org.bluez", path,
+								   "org.bluez.GattService1", "UUID", &error,
+								   &uuid);
+	if (r < 0) {
+		LOG_ERR("BLZ: Profile does not match %s: %s", dev->path,
+				error.message);
+		ret = BLZ_ERR_BUS;
+	} else if (strcasecmp(uuid, p->servs[0].uuid) != 0) {
+		LOG_ERR("BLZ: Profile does not match %s: %s is %s", dev->path,
+				p->servs[0].rel, uuid);
+		ret = BLZ_ERR;
+	} else {
+		dev->profile = p;
+		devdb_profile(dev, blz_profile_id(p));
+	}
+
+	sd_bus_error_free(&error);
+	free(uuid);
+	return ret;
+}
+
+void blz_profile_free(blz_profile* p)
+{
+	if (p == NULL) {
+		return;
+	}
+	free(p->servs);
+	free(p->chars);
+	free(p);
+}
+
+static uint32_t fnv1a(uint32_t h, const char* str)
+{
+	/* including the terminating zero, it separates the fields */
+	do {
+		h = (h ^ (uint8_t)tolower(*str)) * 16777619u;
+	} while (*str++ != '\0');
+	return h;
+}
+
+uint32_t blz_profile_id(const blz_profile* p)
+{
+	/* FNV-1a over the entries sorted by path: relative path, UUID and for
+	 * characteristics the flags, each field terminated by zero */
+	uint32_t h = 2166136261u;
+	char flags[12];
+
+	for (size_t i = 0; i < p->servs_cnt; i++) {
+		h = fnv1a(h, p->servs[i].rel);
+		h = fnv1a(h, p->servs[i].uuid);
+	}
+	h = fnv1a(h, "");
+	for (size_t i = 0; i < p->chars_cnt; i++) {
+		snprintf(flags, sizeof(flags), "%x", p->chars[i].flags);
+		h = fnv1a(h, p->chars[i].rel);
+		h = fnv1a(h, p->chars[i].uuid);
+		h = fnv1a(h, flags);
+	}
+	return h != 0 ? h : 1;
+}
+
+bool profile_find_serv(blz_serv* srv)
+{
+	const struct blz_profile* p = srv->dev->profile;
+
+	for (size_t i = 0; p != NULL && i < p->servs_cnt; i++) {
+		if (strcasecmp(p->servs[i].uuid, srv->uuid) == 0) {
+			return profile_path(srv->dev, p->servs[i].rel, srv->path);
+		}
+	}
+	return false;
+}
+
+bool profile_find_char(blz_char* ch, const char* serv_path)
+{
+	const struct blz_profile* p = ch->dev->profile;
+	size_t dlen = strlen(ch->dev->path);
+	const char* srel = serv_path + dlen;
+	size_t slen = strlen(srel);
+
+	for (size_t i = 0; p != NULL && i < p->chars_cnt; i++) {
+		const struct blz_profile_entry* e = &p->chars[i];
+		if (strcasecmp(e->uuid, ch->uuid) == 0
+			&& strncmp(e->rel, srel, slen) == 0 && e->rel[slen] == '/'
+			&& profile_path(ch->dev, e->rel, ch->path)) {
+			ch->flags = e->flags;
+			ch->mtu = 0; /* read when needed */
+			return true;
+		}
+	}
+	return false;
+}
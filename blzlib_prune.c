@@ -0,0 +1,323 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Stale device removal
+ *
+ * BlueZ keeps an object for every device it ever received an advertisement
+ * from, and every GetManagedObjects call gets slower with them. The devices
+ * of our adapters are collected periodically with one asynchronous
+ * GetManagedObjects call into an array sorted by adapter and MAC address,
+ * in which scan events update the time a device was last seen. Devices which
+ * are neither paired, connected nor used by a handle are removed with
+ * Adapter1.RemoveDevice when they were not seen for the TTL, and the least
+ * recently seen of them when there are more devices than allowed.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/* clang-format off */
+struct prune_ent {
+	uint8_t		adapter; /* index in ctx->adapters */
+	uint8_t		mac[6];
+	bool		removable;
+	bool		removed;
+	uint64_t	seen; /* ns */
+};
+
+struct blz_prune {
+	uint64_t			ttl_ns;		/* 0 none */
+	unsigned int		max_devices; /* 0 no limit */
+	uint64_t			interval_ns;
+	struct blz_timer	timer;
+	sd_bus_slot*		slot;
+	struct prune_ent*	ents; /* sorted */
+	size_t				ents_cnt;
+	struct prune_ent*	next; /* collected from the reply */
+	size_t				next_cnt;
+	size_t				next_size;
+};
+/* clang-format on */
+
+static int prune_cmp(const void* a, const void* b)
+{
+	const struct prune_ent* ea = a;
+	const struct prune_ent* eb = b;
+
+	if (ea->adapter != eb->adapter) {
+		return ea->adapter - eb->adapter;
+	}
+	return memcmp(ea->mac, eb->mac, 6);
+}
+
+static int prune_seen_cmp(const void* a, const void* b)
+{
+	const struct prune_ent* ea = *(const struct prune_ent* const*)a;
+	const struct prune_ent* eb = *(const struct prune_ent* const*)b;
+
+	return ea->seen < eb->seen ? -1 : ea->seen > eb->seen;
+}
+
+static struct prune_ent* prune_find(struct blz_prune* p, unsigned int adapter,
+									const uint8_t* mac)
+{
+	struct prune_ent key = {.adapter = adapter};
+
+	memcpy(key.mac, mac, 6);
+	return bsearch(&key, p->ents, p->ents_cnt, sizeof(struct prune_ent),
+				   prune_cmp);
+}
+
+/** called for scan events of devices of our adapters */
+void prune_seen(blz_ctx* ctx, struct blz_adapter* a, const uint8_t* mac)
+{
+	struct prune_ent* e;
+
+	if (ctx->prune == NULL || a == NULL) {
+		return;
+	}
+	/* devices new since the last check are added by the next one */
+	e = prune_find(ctx->prune, a - ctx->adapters, mac);
+	if (e != NULL) {
+		e->seen = timer_now();
+	}
+}
+
+/** called from message parsing for each device object of our adapters */
+int prune_obj(blz_ctx* ctx, struct blz_adapter* a, const blz_dev* dev)
+{
+	struct blz_prune* p = ctx->prune;
+	struct prune_ent* old;
+	struct prune_ent* e;
+
+	if (p->next_cnt == p->next_size) {
+		size_t size = p->next_size > 0 ? p->next_size * 2 : 64;
+		e = realloc(p->next, size * sizeof(struct prune_ent));
+		if (e == NULL) {
+			LOG_ERR("BLZ: Prune alloc failed");
+			return -ENOMEM;
+		}
+		p->next = e;
+		p->next_size = size;
+	}
+
+	e = &p->next[p->next_cnt++];
+	memset(e, 0, sizeof(*e));
+	e->adapter = a - ctx->adapters;
+	memcpy(e->mac, dev->mac, 6);
+	e->removable
+		= !dev->paired && !dev->connected && !dev_in_use(ctx, dev->mac);
+
+	/* devices not known before are seen now */
+	old = prune_find(p, e->adapter, e->mac);
+	e->seen = old != NULL ? old->seen : timer_now();
+	return 0;
+}
+
+static int prune_remove_cb(sd_bus_message* reply, void* user,
+						   sd_bus_error* err)
+{
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+
+	if (e != NULL) {
+		LOG_INF("BLZ: Failed to remove device: %s", e->message);
+	}
+	return 0;
+}
+
+static void prune_remove(blz_ctx* ctx, struct prune_ent* e)
+{
+	struct blz_adapter* a = &ctx->adapters[e->adapter];
+	char path[DBUS_PATH_MAX_LEN];
+	int r;
+
+	r = snprintf(path, DBUS_PATH_MAX_LEN,
+				 "%s/dev_%02X_%02X_%02X_%02X_%02X_%02X", a->path,
+				 MAC_PARR(e->mac));
+	if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
+		return;
+	}
+
+	/* floating slot, BlueZ handles calls in order anyway */
+	r = sd_bus_call_method_async(ctx->bus, NULL, "org.bluez", a->path,
+								 "org.bluez.Adapter1", "RemoveDevice",
+								 prune_remove_cb, NULL, "o", path);
+	if (r < 0) {
+		LOG_ERR("BLZ: Failed to remove %s", path);
+		return;
+	}
+	e->removed = true;
+}
+
+static void prune_run(blz_ctx* ctx)
+{
+	struct blz_prune* p = ctx->prune;
+	uint64_t now = timer_now();
+	struct prune_ent** cand;
+	size_t cand_cnt = 0;
+	size_t left = p->ents_cnt;
+	size_t removed;
+	size_t j = 0;
+
+	/* not seen for the TTL */
+	for (size_t i = 0; p->ttl_ns > 0 && i < p->ents_cnt; i++) {
+		struct prune_ent* e = &p->ents[i];
+		if (e->removable && now - e->seen > p->ttl_ns) {
+			prune_remove(ctx, e);
+			left -= e->removed;
+		}
+	}
+
+	/* too many, the least recently seen first */
+	if (p->max_devices > 0 && left > p->max_devices) {
+		cand = malloc(left * sizeof(struct prune_ent*));
+		if (cand == NULL) {
+			LOG_ERR("BLZ: Prune alloc failed");
+		} else {
+			for (size_t i = 0; i < p->ents_cnt; i++) {
+				if (p->ents[i].removable && !p->ents[i].removed) {
+					cand[cand_cnt++] = &p->ents[i];
+				}
+			}
+			qsort(cand, cand_cnt, sizeof(struct prune_ent*), prune_seen_cmp);
+			for (size_t i = 0; i < cand_cnt && left > p->max_devices; i++) {
+				prune_remove(ctx, cand[i]);
+				left -= cand[i]->removed;
+			}
+			free(cand);
+		}
+	}
+
+	/* drop removed devices from the array, it stays sorted */
+	removed = p->ents_cnt - left;
+	for (size_t i = 0; i < p->ents_cnt; i++) {
+		if (!p->ents[i].removed) {
+			p->ents[j++] = p->ents[i];
+		}
+	}
+	p->ents_cnt = j;
+
+	if (removed > 0) {
+		LOG_NOTI("BLZ: Removed %zu stale devices, %zu left", removed, left);
+	}
+}
+
+static int prune_objects_cb(sd_bus_message* reply, void* user,
+							sd_bus_error* err)
+{
+	blz_ctx* ctx = user;
+	struct blz_prune* p = ctx->prune;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+
+	p->slot = sd_bus_slot_unref(p->slot);
+	p->next_cnt = 0;
+
+	if (e != NULL) {
+		LOG_ERR("BLZ: Failed to get managed objects: %s", e->message);
+		return 0;
+	}
+	if (msg_parse_objects(reply, "/org/bluez/", MSG_PRUNE, ctx) < 0) {
+		return 0;
+	}
+
+	/* the collected devices replace the old ones */
+	qsort(p->next, p->next_cnt, sizeof(struct prune_ent), prune_cmp);
+	free(p->ents);
+	p->ents = p->next;
+	p->ents_cnt = p->next_cnt;
+	p->next = NULL;
+	p->next_cnt = p->next_size = 0;
+
+	prune_run(ctx);
+	return 0;
+}
+
+static void prune_timer_cb(struct blz_timer* t, void* user)
+{
+	blz_ctx* ctx = user;
+	struct blz_prune* p = ctx->prune;
+	int r;
+
+	timer_arm(&ctx->timers, &p->timer, timer_now() + p->interval_ns);
+
+	/* the previous check is still going on */
+	if (p->slot != NULL) {
+		return;
+	}
+
+	r = sd_bus_call_method_async(ctx->bus, &p->slot, "org.bluez", "/",
+								 "org.freedesktop.DBus.ObjectManager",
+								 "GetManagedObjects", prune_objects_cb, ctx,
+								 "");
+	if (r < 0) {
+		LOG_ERR("BLZ: Failed to get managed objects");
+	}
+}
+
+void prune_fini(blz_ctx* ctx)
+{
+	struct blz_prune* p = ctx->prune;
+
+	if (p == NULL) {
+		return;
+	}
+	timer_cancel(&p->timer);
+	sd_bus_slot_unref(p->slot);
+	free(p->ents);
+	free(p->next);
+	free(p);
+	ctx->prune = NULL;
+}
+
+blz_ret blz_set_device_ttl(blz_ctx* ctx, uint32_t ttl_sec,
+						   unsigned int max_devices)
+{
+	struct blz_prune* p;
+	uint64_t interval = PRUNE_INTERVAL;
+
+	if (ctx == NULL) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	if (ttl_sec == 0 && max_devices == 0) {
+		prune_fini(ctx);
+		return BLZ_OK;
+	}
+
+	p = ctx->prune;
+	if (p == NULL) {
+		p = calloc(1, sizeof(struct blz_prune));
+		if (p == NULL) {
+			LOG_ERR("BLZ: Prune alloc failed");
+			return BLZ_ERR;
+		}
+		timer_init(&p->timer, prune_timer_cb, ctx);
+		ctx->prune = p;
+	}
+
+	/* check often enough that devices don't stay much longer than the TTL */
+	if (ttl_sec > 0) {
+		interval = MIN(MAX(ttl_sec / 2, 1), PRUNE_INTERVAL);
+	}
+
+	p->ttl_ns = (uint64_t)ttl_sec * 1000000000ULL;
+	p->max_devices = max_devices;
+	p->interval_ns = interval * 1000000000ULL;
+
+	/* the first check only collects the devices, unless there are too many */
+	timer_arm(&ctx->timers, &p->timer, timer_now());
+	return BLZ_OK;
+}
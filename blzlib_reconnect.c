@@ -0,0 +1,343 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Reconnect supervisor
+ *
+ * When a supervised device loses its link, it is reconnected in the
+ * background with exponential backoff. Every delay is drawn uniformly from
+ * the upper half of the current backoff, so many devices which dropped at
+ * the same time do not reconnect in lockstep. After the services are
+ * resolved again, the object paths of all service and characteristic
+ * handles of the device are looked up again in a single asynchronous
+ * GetManagedObjects call, and when it is answered notifications are started
+ * again for all active subscriptions. The handles stay valid the whole time,
+ * operations on them fail with BLZ_ERR_NOT_CONNECTED while the link is down
+ * and use the old paths until the answer arrived.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+static uint32_t rc_random(blz_ctx* ctx)
+{
+	/* xorshift32, jitter does not need more */
+	uint32_t x = ctx->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	ctx->rand_state = x;
+	return x;
+}
+
+static void rc_schedule(blz_dev* dev)
+{
+	struct blz_reconnect* rc = &dev->rc;
+	uint64_t backoff = rc->min_ms;
+
+	for (unsigned int i = 0; i < rc->attempt && backoff < rc->max_ms; i++) {
+		backoff *= 2;
+	}
+	backoff = MIN(backoff, rc->max_ms);
+
+	uint64_t delay = backoff / 2 + rc_random(dev->ctx) % (backoff / 2 + 1);
+	rc->attempt++;
+	rc->state = RC_WAIT;
+	LOG_INF("BLZ: Reconnect %s in %u ms (attempt %u)", dev->path,
+			(unsigned int)delay, rc->attempt);
+	timer_arm(&dev->ctx->timers, &rc->timer, timer_now() + delay * 1000000);
+}
+
+static void rc_failed(blz_dev* dev)
+{
+	dev->rc.slot = sd_bus_slot_unref(dev->rc.slot);
+
+	/* cancel a connection attempt which may still be ongoing in BlueZ */
+	sd_bus_call_method_async(dev->ctx->bus, NULL, "org.bluez", dev->path,
+							 "org.bluez.Device1", "Disconnect", NULL, NULL, "");
+	rc_schedule(dev);
+}
+
+static int rc_connect_cb(sd_bus_message* reply, void* user, sd_bus_error* err)
+{
+	blz_dev* dev = user;
+	struct blz_reconnect* rc = &dev->rc;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+
+	/* slot is unreferenced below or when the next call is sent */
+	if (e != NULL) {
+		LOG_INF("BLZ: Reconnect %s failed: %s", dev->path, e->message);
+		/* the device object is gone, e.g. when bluetoothd was restarted */
+		if (sd_bus_error_has_name(e, SD_BUS_ERROR_UNKNOWN_OBJECT)
+			|| sd_bus_error_has_name(e, SD_BUS_ERROR_UNKNOWN_METHOD)) {
+			rc->use_connect_device = true;
+		}
+		rc_failed(dev);
+		return 0;
+	}
+
+	rc->slot = sd_bus_slot_unref(rc->slot);
+	rc->state = RC_RESOLVING;
+	timer_arm(&dev->ctx->timers, &rc->timer,
+			  timer_now() + SERV_RESOLV_TIMEOUT * 1000000000ULL);
+
+	/* ServicesResolved may have been seen before the reply */
+	if (dev->connected && dev->services_resolved) {
+		reconnect_resolved(dev);
+	}
+	return 0;
+}
+
+static int rc_send_connect(blz_dev* dev)
+{
+	struct blz_reconnect* rc = &dev->rc;
+	sd_bus_message* call = NULL;
+	int r;
+
+	if (!rc->use_connect_device) {
+		r = sd_bus_message_new_method_call(dev->ctx->bus, &call, "org.bluez",
+										   dev->path, "org.bluez.Device1",
+										   "Connect");
+	} else {
+		const char* macstr = blz_mac_to_string_s(dev->mac);
+		const char* atype
+			= dev->atype == BLZ_ADDR_PUBLIC ? "public" : "random";
+
+		r = sd_bus_message_new_method_call(dev->ctx->bus, &call, "org.bluez",
+										   dev->adapter->path,
+										   "org.bluez.Adapter1",
+										   "ConnectDevice");
+		if (r >= 0) {
+			r = sd_bus_message_open_container(call, 'a', "{sv}");
+		}
+		if (r >= 0) {
+			r = msg_append_property(call, "Address", 's', macstr);
+		}
+		if (r >= 0) {
+			r = msg_append_property(call, "AddressType", 's', atype);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_close_container(call);
+		}
+	}
+
+	if (r >= 0) {
+		r = sd_bus_call_async(dev->ctx->bus, &rc->slot, call, rc_connect_cb,
+							  dev, CONNECT_TIMEOUT * 1000000ULL);
+	}
+
+	sd_bus_message_unref(call);
+	return r;
+}
+
+static void rc_timer_cb(struct blz_timer* t, void* user)
+{
+	blz_dev* dev = user;
+	struct blz_reconnect* rc = &dev->rc;
+
+	switch (rc->state) {
+	case RC_WAIT:
+		if (dev->connected && dev->services_resolved) {
+			/* link came back by itself */
+			reconnect_resolved(dev);
+			break;
+		}
+		rc->state = RC_CONNECTING;
+		if (rc_send_connect(dev) < 0) {
+			LOG_ERR("BLZ: Reconnect %s failed to send", dev->path);
+			rc_schedule(dev);
+		}
+		break;
+	case RC_RESOLVING:
+		LOG_ERR("BLZ: Reconnect %s timeout waiting for ServicesResolved",
+				dev->path);
+		rc_failed(dev);
+		break;
+	default:
+		break;
+	}
+}
+
+/* look up the object paths of all handles of the device again, they may
+ * have changed when the device or bluetoothd was restarted */
+static void rc_revalidate(blz_dev* dev, sd_bus_message* reply)
+{
+	for (struct blz_list* n = dev->servs.next; n != &dev->servs; n = n->next) {
+		blz_serv* srv = list_entry(n, struct blz_serv, dev_node);
+		sd_bus_message_rewind(reply, true);
+		if (msg_parse_objects(reply, dev->path, MSG_SERV_FIND, srv)
+			!= RETURN_FOUND) {
+			LOG_ERR("BLZ: Service %s gone after reconnect", srv->uuid);
+		}
+	}
+
+	/* characteristics are searched below their service, UUIDs may be used
+	 * in several services */
+	for (struct blz_list* n = dev->chars.next; n != &dev->chars; n = n->next) {
+		blz_char* ch = list_entry(n, struct blz_char, dev_node);
+		blz_serv srv = {0};
+		char match[DBUS_PATH_MAX_LEN + 1];
+		char path[DBUS_PATH_MAX_LEN];
+		uint32_t flags = ch->flags;
+
+		strcpy(srv.uuid, ch->serv_uuid);
+		sd_bus_message_rewind(reply, true);
+		if (msg_parse_objects(reply, dev->path, MSG_SERV_FIND, &srv)
+			!= RETURN_FOUND) {
+			LOG_ERR("BLZ: Characteristic %s gone after reconnect", ch->uuid);
+			continue;
+		}
+
+		strcpy(path, ch->path);
+		snprintf(match, sizeof(match), "%s/", srv.path);
+		ch->flags = 0;
+		sd_bus_message_rewind(reply, true);
+		if (msg_parse_objects(reply, match, MSG_CHAR_FIND, ch)
+			!= RETURN_FOUND) {
+			LOG_ERR("BLZ: Characteristic %s gone after reconnect", ch->uuid);
+			ch->flags = flags;
+			continue;
+		}
+
+		if (strcmp(path, ch->path) != 0) {
+			LOG_NOTI("BLZ: Characteristic %s moved to %s", ch->uuid, ch->path);
+		}
+	}
+}
+
+static int rc_objects_cb(sd_bus_message* reply, void* user, sd_bus_error* err)
+{
+	blz_dev* dev = user;
+	struct blz_reconnect* rc = &dev->rc;
+	const sd_bus_error* e = sd_bus_message_get_error(reply);
+
+	rc->objs_slot = sd_bus_slot_unref(rc->objs_slot);
+
+	/* notifications are started on the old paths then */
+	if (e != NULL) {
+		LOG_ERR("BLZ: Failed to get managed objects: %s", e->message);
+	} else {
+		rc_revalidate(dev, reply);
+	}
+
+	notify_chans_restart(dev);
+
+	if (rc->cb) {
+		rc->cb(dev, true, rc->user);
+	}
+	return 0;
+}
+
+/** called from the device PropertiesChanged handler when the services of a
+ * supervised device are resolved */
+void reconnect_resolved(blz_dev* dev)
+{
+	struct blz_reconnect* rc = &dev->rc;
+	int r;
+
+	if (rc->state == RC_IDLE || rc->state == RC_CONNECTING) {
+		/* the reply to Connect is still outstanding */
+		return;
+	}
+
+	timer_cancel(&rc->timer);
+	LOG_NOTI("BLZ: Reconnected %s after %u attempts", dev->path, rc->attempt);
+	rc->state = RC_IDLE;
+	rc->attempt = 0;
+
+	/* not waited for here, many devices may come back at the same time */
+	rc->objs_slot = sd_bus_slot_unref(rc->objs_slot);
+	r = sd_bus_call_method_async(dev->ctx->bus, &rc->objs_slot, "org.bluez",
+								 "/", "org.freedesktop.DBus.ObjectManager",
+								 "GetManagedObjects", rc_objects_cb, dev, "");
+	if (r < 0) {
+		LOG_ERR("BLZ: Failed to get managed objects");
+		notify_chans_restart(dev);
+		if (rc->cb) {
+			rc->cb(dev, true, rc->user);
+		}
+	}
+}
+
+/** called from the device PropertiesChanged handler when the link is lost */
+void reconnect_lost(blz_dev* dev)
+{
+	struct blz_reconnect* rc = &dev->rc;
+
+	if (rc->max_ms == 0 || rc->state != RC_IDLE) {
+		return;
+	}
+
+	/* lost again before the paths were looked up */
+	rc->objs_slot = sd_bus_slot_unref(rc->objs_slot);
+
+	if (rc->cb) {
+		rc->cb(dev, false, rc->user);
+	}
+
+	/* the handler may have disabled supervision */
+	if (rc->max_ms > 0 && rc->state == RC_IDLE) {
+		rc_schedule(dev);
+	}
+}
+
+void reconnect_init(blz_dev* dev)
+{
+	timer_init(&dev->rc.timer, rc_timer_cb, dev);
+}
+
+/** stop supervision, cancel pending attempts */
+void reconnect_stop(blz_dev* dev)
+{
+	struct blz_reconnect* rc = &dev->rc;
+
+	timer_cancel(&rc->timer);
+	rc->slot = sd_bus_slot_unref(rc->slot);
+	rc->objs_slot = sd_bus_slot_unref(rc->objs_slot);
+	rc->state = RC_IDLE;
+	rc->attempt = 0;
+	rc->max_ms = 0;
+}
+
+blz_ret blz_dev_supervise(blz_dev* dev, uint32_t min_ms, uint32_t max_ms,
+						  blz_reconnect_handler_t cb, void* user)
+{
+	struct blz_reconnect* rc;
+
+	if (dev == NULL || (max_ms > 0 && (min_ms == 0 || min_ms > max_ms))) {
+		return BLZ_ERR_INVALID_PARAM;
+	}
+
+	rc = &dev->rc;
+	if (max_ms == 0) {
+		reconnect_stop(dev);
+		return BLZ_OK;
+	}
+
+	if (dev->ctx->rand_state == 0) {
+		dev->ctx->rand_state = ((uint32_t)timer_now() ^ getpid()) | 1;
+	}
+
+	rc->min_ms = min_ms;
+	rc->max_ms = max_ms;
+	rc->cb = cb;
+	rc->user = user;
+
+	/* already down */
+	if (!dev->connected) {
+		reconnect_lost(dev);
+	}
+	return BLZ_OK;
+}
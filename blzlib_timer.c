@@ -0,0 +1,227 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <systemd/sd-bus.h>
+#include <time.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+
+/* timer is not in any wheel slot (unarmed or being expired) */
+#define LEVEL_NONE 0xff
+
+#define SHIFT(l) (TIMER_LEVEL_BITS * (l))
+#define MAX_TICKS ((1ULL << SHIFT(TIMER_LEVELS)) - 1)
+
+uint64_t timer_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void timer_wheel_init(struct blz_timer_wheel* tw, uint64_t now_ns)
+{
+	tw->now = now_ns / TIMER_TICK_NS;
+	tw->count = 0;
+	for (int l = 0; l < TIMER_LEVELS; l++) {
+		tw->pending[l] = 0;
+		for (int s = 0; s < TIMER_SLOTS; s++) {
+			list_init(&tw->slots[l][s]);
+		}
+	}
+}
+
+void timer_init(struct blz_timer* t, blz_timer_cb cb, void* user)
+{
+	list_init(&t->node);
+	t->tw = NULL;
+	t->tick = 0;
+	t->level = LEVEL_NONE;
+	t->cb = cb;
+	t->user = user;
+}
+
+/* put timer into the slot matching its tick relative to the wheel time */
+static void timer_insert(struct blz_timer_wheel* tw, struct blz_timer* t)
+{
+	uint64_t tick = t->tick;
+
+	if (tick <= tw->now) {
+		tick = tw->now + 1; // already expired, fire on next tick
+	} else if (tick - tw->now > MAX_TICKS) {
+		tick = tw->now + MAX_TICKS; // re-inserted when it gets there
+	}
+
+	uint64_t delta = tick - tw->now;
+	int l = 0;
+	while (l < TIMER_LEVELS - 1 && delta >= (1ULL << SHIFT(l + 1))) {
+		l++;
+	}
+
+	int s = (tick >> SHIFT(l)) & (TIMER_SLOTS - 1);
+	t->level = l;
+	t->slot = s;
+	list_add_tail(&tw->slots[l][s], &t->node);
+	tw->pending[l] |= 1ULL << s;
+}
+
+static void timer_unlink(struct blz_timer* t)
+{
+	struct blz_timer_wheel* tw = t->tw;
+
+	list_del(&t->node);
+	if (t->level != LEVEL_NONE) {
+		if (list_empty(&tw->slots[t->level][t->slot])) {
+			tw->pending[t->level] &= ~(1ULL << t->slot);
+		}
+		t->level = LEVEL_NONE;
+	}
+}
+
+void timer_arm(struct blz_timer_wheel* tw, struct blz_timer* t,
+			   uint64_t expire_ns)
+{
+	timer_cancel(t);
+	t->tw = tw;
+	/* round up, a timer must never fire before its deadline */
+	t->tick = (expire_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	timer_insert(tw, t);
+	tw->count++;
+}
+
+void timer_cancel(struct blz_timer* t)
+{
+	if (!timer_armed(t)) {
+		return;
+	}
+	timer_unlink(t);
+	t->tw->count--;
+}
+
+bool timer_armed(const struct blz_timer* t)
+{
+	return !list_empty(&t->node);
+}
+
+/* move all timers of a higher level slot down according to their tick */
+static void timer_cascade(struct blz_timer_wheel* tw, int l)
+{
+	int s = (tw->now >> SHIFT(l)) & (TIMER_SLOTS - 1);
+	struct blz_list tmp;
+
+	list_init(&tmp);
+	list_splice_tail(&tmp, &tw->slots[l][s]);
+	tw->pending[l] &= ~(1ULL << s);
+
+	while (!list_empty(&tmp)) {
+		struct blz_timer* t = list_entry(tmp.next, struct blz_timer, node);
+		list_del(&t->node);
+		timer_insert(tw, t);
+	}
+}
+
+/* process the tick tw->now: cascade and call expired timers */
+static void timer_tick(struct blz_timer_wheel* tw)
+{
+	int s = tw->now & (TIMER_SLOTS - 1);
+	struct blz_list expired;
+	int l = 1;
+
+	/* highest level first, so its timers can fall through to lower levels
+	 * which are cascaded in the same tick */
+	while (l < TIMER_LEVELS && (tw->now & ((1ULL << SHIFT(l)) - 1)) == 0) {
+		l++;
+	}
+	for (l = l - 1; l > 0; l--) {
+		timer_cascade(tw, l);
+	}
+
+	list_init(&expired);
+	list_splice_tail(&expired, &tw->slots[0][s]);
+	tw->pending[0] &= ~(1ULL << s);
+	for (struct blz_list* n = expired.next; n != &expired; n = n->next) {
+		list_entry(n, struct blz_timer, node)->level = LEVEL_NONE;
+	}
+
+	/* timers are popped one by one, callbacks may cancel or re-arm any
+	 * timer including the ones still waiting in the expired list */
+	while (!list_empty(&expired)) {
+		struct blz_timer* t = list_entry(expired.next, struct blz_timer, node);
+		list_del(&t->node);
+		if (t->tick > tw->now) {
+			/* was clamped to the wheel range, not due yet */
+			timer_insert(tw, t);
+			continue;
+		}
+		tw->count--;
+		if (t->cb) {
+			t->cb(t, t->user);
+		}
+	}
+}
+
+void timer_run(struct blz_timer_wheel* tw, uint64_t now_ns)
+{
+	uint64_t to = now_ns / TIMER_TICK_NS;
+
+	while (tw->now < to) {
+		if (tw->count == 0) {
+			tw->now = to;
+			break;
+		}
+
+		/* skip over ticks where nothing can expire or cascade: while the
+		 * lower levels are empty, only the next boundary of the level
+		 * above matters */
+		uint64_t next = tw->now + 1;
+		for (int l = 0; l < TIMER_LEVELS - 1 && tw->pending[l] == 0; l++) {
+			next = ((tw->now >> SHIFT(l + 1)) + 1) << SHIFT(l + 1);
+		}
+
+		if (next > to) {
+			tw->now = to;
+			break;
+		}
+
+		tw->now = next;
+		timer_tick(tw);
+	}
+}
+
+static inline uint64_t rotr64(uint64_t x, int s)
+{
+	return s ? (x >> s) | (x << (64 - s)) : x;
+}
+
+uint64_t timer_next(const struct blz_timer_wheel* tw)
+{
+	uint64_t best = TIMER_NONE;
+
+	if (tw->count == 0) {
+		return TIMER_NONE;
+	}
+
+	/* first pending slot after the current one on each level. for higher
+	 * levels this is the time they are cascaded, which is never later than
+	 * the earliest deadline they hold */
+	for (int l = 0; l < TIMER_LEVELS; l++) {
+		if (tw->pending[l] == 0) {
+			continue;
+		}
+		uint64_t cur = tw->now >> SHIFT(l);
+		int s = (cur + 1) & (TIMER_SLOTS - 1);
+		uint64_t d = __builtin_ctzll(rotr64(tw->pending[l], s)) + 1;
+		uint64_t tick = (cur + d) << SHIFT(l);
+		if (tick < best) {
+			best = tick;
+		}
+	}
+
+	return best == TIMER_NONE ? TIMER_NONE : best * TIMER_TICK_NS;
+}
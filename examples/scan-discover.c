@@ -6,36 +6,50 @@
 #include "blzlib_log.h"
 #include "blzlib_util.h"
 
-#define MAX_SCAN 10
+#define MAX_SCAN		10
+#define DISCOVERY_WIDTH 4
 
 static bool terminate = false;
 static uint8_t scanned_macs[MAX_SCAN][6];
 static int scan_idx = 0;
 
-static void discover(blz_ctx* blz, const char* mac)
+static void discovery_done(blz_discovery* d, void* user)
 {
-	LOG_INF("Connecting to %s...", mac);
-	blz_dev* dev = blz_connect(blz, mac, BLZ_ADDR_UNKNOWN);
-	if (!dev) {
+	bool* done = user;
+	*done = true;
+}
+
+/* connect to devices to discover services and characteristics */
+static void discover(blz_ctx* blz, const char* const* macs, size_t n)
+{
+	bool done = false;
+	size_t cnt;
+
+	blz_discovery* d
+		= blz_discovery_start(blz, macs, n, DISCOVERY_WIDTH, discovery_done,
+							  &done);
+	if (!d) {
 		return;
 	}
 
-	char** uuids = blz_list_service_uuids(dev);
-
-	for (int i = 0; uuids != NULL && uuids[i] != NULL; i++) {
-		LOG_INF("\tService %s", uuids[i]);
-		blz_serv* srv = blz_get_serv_from_uuid(dev, uuids[i]);
-		if (srv) {
-			char** chuuids = blz_list_char_uuids(srv);
-			for (int i = 0; chuuids != NULL && chuuids[i] != NULL; i++) {
-				LOG_INF("\t\tCharacteristic %s", chuuids[i]);
+	blz_loop_wait(blz, &done, UINT32_MAX);
+
+	const struct blz_inv_dev* inv = blz_discovery_result(d, &cnt);
+	for (size_t i = 0; i < cnt; i++) {
+		LOG_INF("%s: %s (connect %llu ms, services %llu ms)", inv[i].mac,
+				blz_errstr(inv[i].ret),
+				(unsigned long long)inv[i].connect_ns / 1000000,
+				(unsigned long long)inv[i].enum_ns / 1000000);
+		for (size_t j = 0; j < inv[i].servs_cnt; j++) {
+			const struct blz_inv_serv* srv = &inv[i].servs[j];
+			LOG_INF("\tService %s", srv->uuid);
+			for (size_t k = 0; k < srv->chars_cnt; k++) {
+				LOG_INF("\t\tCharacteristic %s", srv->chars[k].uuid);
 			}
-
-			blz_serv_free(srv);
 		}
 	}
 
-	blz_disconnect(dev);
+	blz_discovery_free(d);
 }
 
 static void scan_cb(const uint8_t* mac, enum blz_addr_type atype, int8_t rssi,
@@ -81,9 +95,7 @@ int main(int argc, char** argv)
 	}
 
 	if (argc > 1) {
-		for (int i = 1; i < argc; i++) {
-			discover(blz, argv[i]);
-		}
+		discover(blz, (const char* const*)argv + 1, argc - 1);
 	} else {
 		LOG_INF("Cached devices...");
 		blz_known_devices(blz, scan_cb, NULL);
@@ -95,9 +107,16 @@ int main(int argc, char** argv)
 
 		blz_scan_stop(blz);
 
-		/* connect to device to discover services and characteristics */
+		char macstr[MAX_SCAN][18];
+		const char* macs[MAX_SCAN];
+		size_t n = 0;
 		for (int i = 0; i < MAX_SCAN && MAC_NOT_EMPTY(scanned_macs[i]); i++) {
-			discover(blz, blz_mac_to_string_s(scanned_macs[i]));
+			strcpy(macstr[n], blz_mac_to_string_s(scanned_macs[i]));
+			macs[n] = macstr[n];
+			n++;
+		}
+		if (n > 0) {
+			discover(blz, macs, n);
 		}
 	}
 
@@ -0,0 +1,35 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#ifndef BLZ_TEST_H
+#define BLZ_TEST_H
+
+#include <stdio.h>
+
+/* checks go on after a failure, so one run reports all of them */
+static int failed;
+
+#define CHECK(x)                                                               \
+	do {                                                                       \
+		if (!(x)) {                                                            \
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #x);    \
+			failed++;                                                          \
+		}                                                                      \
+	} while (0)
+
+/** exit code of the test program */
+static inline int test_result(const char* name)
+{
+	if (failed > 0) {
+		fprintf(stderr, "%s: %d checks failed\n", name, failed);
+		return 1;
+	}
+	printf("%s: OK\n", name);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * GATT operations against a fake BlueZ
+ *
+ * A child process serves GattCharacteristic1 objects on the other end of a
+ * socket pair, a direct D-Bus connection without a bus daemon. It answers
+ * ReadValue with a fixed value, echoes written values as notifications and
+ * sends a first notification after StartNotify. Reads of char0003 are never
+ * answered. StartNotify of char0004 fails after a notification of char0002,
+ * so its handler runs while the start is in flight. The context and device are
+ * set up by hand, as if they were connected.
+ *
+ * Blocking calls are made from inside the notify handler, where the loop
+ * can not run.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "test.h"
+
+#define CHAR_PATH  "/org/bluez/hci0/dev_00_11_22_33_44_55/service0001/char0002"
+#define SLOW_PATH  "/org/bluez/hci0/dev_00_11_22_33_44_55/service0001/char0003"
+#define FAIL_PATH  "/org/bluez/hci0/dev_00_11_22_33_44_55/service0001/char0004"
+#define FAIL_VALUE 0x04
+#define READ_VALUE 0x55
+
+/*
+ * Fake BlueZ
+ */
+
+static int fake_signal(sd_bus* bus, const char* path, const char* prop,
+					   char type, const void* data, size_t len)
+{
+	sd_bus_message* m = NULL;
+	int b = len > 0;
+	int r;
+
+	r = sd_bus_message_new_signal(bus, &m, path,
+								  "org.freedesktop.DBus.Properties",
+								  "PropertiesChanged");
+	if (r >= 0) {
+		r = sd_bus_message_set_sender(m, "org.bluez");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_append(m, "s", "org.bluez.GattCharacteristic1");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'a', "{sv}");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'e', "sv");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_append_basic(m, 's', prop);
+	}
+	if (r >= 0 && type == 'b') {
+		r = sd_bus_message_append(m, "v", "b", b);
+	} else if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'v', "ay");
+		if (r >= 0) {
+			r = sd_bus_message_append_array(m, 'y', data, len);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_close_container(m);
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_append(m, "as", 0);
+	}
+	if (r >= 0) {
+		r = sd_bus_send(bus, m, NULL);
+	}
+	sd_bus_message_unref(m);
+	return r;
+}
+
+static int fake_method(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	sd_bus* bus = user;
+	const char* path = sd_bus_message_get_path(m);
+	const char* iface = "org.bluez.GattCharacteristic1";
+	static const uint8_t first = 0x01;
+	const void* data;
+	size_t len;
+
+	if (sd_bus_message_is_method_call(m, iface, "ReadValue")
+		&& strcmp(path, SLOW_PATH) == 0) {
+		return 1;
+	}
+	if (sd_bus_message_is_method_call(m, iface, "ReadValue")) {
+		uint8_t v = READ_VALUE;
+		sd_bus_message* reply = NULL;
+		sd_bus_message_new_method_return(m, &reply);
+		sd_bus_message_append_array(reply, 'y', &v, 1);
+		sd_bus_send(bus, reply, NULL);
+		sd_bus_message_unref(reply);
+		return 1;
+	}
+	if (sd_bus_message_is_method_call(m, iface, "WriteValue")) {
+		if (sd_bus_message_read_array(m, 'y', &data, &len) < 0) {
+			return -EINVAL;
+		}
+		sd_bus_reply_method_return(m, "");
+		return fake_signal(bus, path, "Value", 'y', data, len);
+	}
+	if (sd_bus_message_is_method_call(m, iface, "StartNotify")
+		&& strcmp(path, FAIL_PATH) == 0) {
+		static const uint8_t v = FAIL_VALUE;
+		fake_signal(bus, CHAR_PATH, "Value", 'y', &v, 1);
+		return sd_bus_reply_method_errorf(m, "org.bluez.Error.Failed",
+										  "Failed");
+	}
+	if (sd_bus_message_is_method_call(m, iface, "StartNotify")) {
+		sd_bus_reply_method_return(m, "");
+		fake_signal(bus, path, "Notifying", 'b', NULL, 1);
+		return fake_signal(bus, path, "Value", 'y', &first, 1);
+	}
+	if (sd_bus_message_is_method_call(m, iface, "StopNotify")) {
+		sd_bus_reply_method_return(m, "");
+		return fake_signal(bus, path, "Notifying", 'b', NULL, 0);
+	}
+	return 0;
+}
+
+/* serve until the other end closes the connection */
+static void fake_bluez(int fd)
+{
+	sd_bus* bus = NULL;
+	sd_id128_t id;
+	int r;
+
+	sd_id128_randomize(&id);
+	if (sd_bus_new(&bus) < 0 || sd_bus_set_fd(bus, fd, fd) < 0
+		|| sd_bus_set_server(bus, 1, id) < 0 || sd_bus_start(bus) < 0
+		|| sd_bus_add_fallback(bus, NULL, "/org/bluez", fake_method, bus)
+			   < 0) {
+		_exit(1);
+	}
+
+	for (;;) {
+		r = sd_bus_process(bus, NULL);
+		if (r < 0) {
+			break;
+		}
+		if (r == 0 && sd_bus_wait(bus, UINT64_MAX) < 0) {
+			break;
+		}
+	}
+	_exit(0);
+}
+
+/*
+ * Test
+ */
+
+static blz_ctx* test_ctx_new(int fd)
+{
+	static const char* hci0 = "hci0";
+	blz_ctx* ctx = calloc(1, sizeof(struct blz_context));
+
+	/* like ctx_new(), but on the fake bus and without powering on */
+	if (adapters_init(ctx, &hci0, 1) != BLZ_OK || sd_bus_new(&ctx->bus) < 0
+		|| sd_bus_set_fd(ctx->bus, fd, fd) < 0 || sd_bus_start(ctx->bus) < 0) {
+		return NULL;
+	}
+	timer_wheel_init(&ctx->timers, timer_now());
+	ctx->op_timeout_ms = 2000;
+	list_init(&ctx->sched_ready);
+	list_init(&ctx->polls);
+	list_init(&ctx->notify_chans);
+	for (int i = 0; i < DEV_HASH_SIZE; i++) {
+		list_init(&ctx->dev_hash[i]);
+	}
+	connect_init(ctx);
+	ctx->max_inflight = MAX_INFLIGHT;
+	ctx->max_inflight_dev = MAX_INFLIGHT_DEV;
+	return ctx;
+}
+
+static blz_char* test_char_new(blz_dev* dev, const char* path)
+{
+	blz_char* ch = calloc(1, sizeof(struct blz_char));
+
+	ch->ctx = dev->ctx;
+	ch->dev = dev;
+	strcpy(ch->path, path);
+	ch->flags = BLZ_CHAR_READ | BLZ_CHAR_WRITE | BLZ_CHAR_NOTIFY;
+	list_init(&ch->chan_node);
+	list_init(&ch->subs);
+	list_add_tail(&dev->chars, &ch->dev_node);
+	return ch;
+}
+
+struct handler_state {
+	int calls;
+	bool done;
+	blz_ret loop_ret;
+	blz_ret write_ret;
+	blz_ret read_ret;
+	uint8_t read_buf[4];
+	size_t read_len;
+	blz_ret stop_ret;
+	blz_char* slow;
+	blz_ret slow_ret;
+	uint64_t slow_ns;
+	uint8_t slow_buf[1];
+};
+
+static void notify_handler(const uint8_t* data, size_t len, blz_char* ch,
+						   void* user)
+{
+	struct handler_state* s = user;
+	static const uint8_t echo = 0x42;
+
+	s->calls++;
+	if (len != 1) {
+		return;
+	}
+
+	if (data[0] == 0x01) {
+		/* the first notification: write and read, which can not wait for
+		 * the loop here */
+		s->loop_ret = blz_loop_one(ch->ctx, 0);
+		s->write_ret = blz_char_write(ch, &echo, 1);
+		s->read_len = sizeof(s->read_buf);
+		s->read_ret = blz_char_read(ch, s->read_buf, &s->read_len);
+		/* the timeout of the _timeout variant applies as well */
+		s->slow_ns = timer_now();
+		s->slow_ret = blz_char_read_timeout(s->slow, s->slow_buf,
+											&(size_t){1}, 200);
+		s->slow_ns = timer_now() - s->slow_ns;
+	} else if (data[0] == echo) {
+		/* the written value came back: stop from inside the handler */
+		s->stop_ret = blz_char_notify_stop(ch);
+		s->done = true;
+	}
+}
+
+/* joins the start of char0004 in flight */
+static void join_handler(const uint8_t* data, size_t len, blz_char* ch,
+						 void* user)
+{
+	struct handler_state* s = user;
+
+	if (len == 1 && data[0] == FAIL_VALUE) {
+		s->calls++;
+		s->write_ret = blz_char_notify_start(s->slow, join_handler, s);
+	}
+}
+
+struct async_state {
+	int done;
+	blz_ret ret;
+	int notified;
+};
+
+static void async_done(blz_ret ret, const uint8_t* data, size_t len,
+					   blz_char* ch, void* user)
+{
+	struct async_state* a = user;
+	a->done++;
+	a->ret = ret;
+}
+
+static void async_notify(const uint8_t* data, size_t len,
+						 const struct blz_notify_info* info, blz_char* ch,
+						 void* user)
+{
+	struct async_state* a = user;
+	a->notified++;
+}
+
+/* loop until done was called n times */
+static bool async_wait(blz_ctx* ctx, struct async_state* a, int n)
+{
+	for (int i = 0; i < 100 && a->done < n; i++) {
+		blz_loop_one(ctx, 50);
+	}
+	return a->done == n;
+}
+
+int main(void)
+{
+	struct async_state a = {0};
+	struct async_state b = {0};
+	struct handler_state s = {0};
+	struct handler_state j = {0};
+	blz_char* fail;
+	blz_ctx* ctx;
+	blz_dev* dev;
+	blz_char* ch;
+	pid_t pid;
+	int sv[2];
+	int status;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		fake_bluez(sv[1]);
+	}
+	close(sv[1]);
+
+	ctx = test_ctx_new(sv[0]);
+	CHECK(ctx != NULL);
+	if (ctx == NULL) {
+		return test_result("gatt");
+	}
+	dev = dev_new(ctx, &ctx->adapters[0], "00:11:22:33:44:55",
+				  BLZ_ADDR_PUBLIC);
+	dev->connected = true;
+	ch = test_char_new(dev, CHAR_PATH);
+	s.slow = test_char_new(dev, SLOW_PATH);
+
+	/* outside of handlers the loop runs until the start completed */
+	CHECK(blz_char_notify_start(ch, notify_handler, &s) == BLZ_OK);
+	CHECK(blz_loop_wait(ctx, &s.done, 5000) == BLZ_OK);
+
+	CHECK(s.loop_ret == BLZ_ERR);
+	CHECK(s.write_ret == BLZ_OK);
+	CHECK(s.read_ret == BLZ_OK && s.read_len == 1
+		  && s.read_buf[0] == READ_VALUE);
+	CHECK(s.slow_ret == BLZ_ERR_TIMEOUT);
+	CHECK(s.slow_ns >= 190000000ULL && s.slow_ns < 1000000000ULL);
+	CHECK(s.stop_ret == BLZ_OK);
+	CHECK(s.calls == 2);
+	CHECK(ch->chan == NULL && !ch->notify_started);
+
+	/* a handle which joined a start in flight is detached when it fails */
+	j.slow = test_char_new(dev, FAIL_PATH);
+	fail = test_char_new(dev, FAIL_PATH);
+	CHECK(blz_char_notify_start(ch, join_handler, &j) == BLZ_OK);
+	CHECK(blz_char_notify_start(fail, join_handler, &j) == BLZ_ERR);
+	CHECK(j.calls == 1 && j.write_ret == BLZ_OK);
+	CHECK(fail->chan == NULL && !fail->notify_started);
+	CHECK(j.slow->chan == NULL && !j.slow->notify_started);
+	CHECK(blz_char_notify_stop(ch) == BLZ_OK);
+
+	/* asynchronous start and stop */
+	CHECK(blz_char_notify_start_async(ch, async_notify, &a, async_done, &a)
+		  == BLZ_OK);
+	CHECK(a.done == 0);
+	CHECK(async_wait(ctx, &a, 1) && a.ret == BLZ_OK);
+	for (int i = 0; i < 100 && a.notified == 0; i++) {
+		blz_loop_one(ctx, 50);
+	}
+	CHECK(a.notified == 1 && ch->notify_started);
+	CHECK(blz_char_notify_stop_async(ch, async_done, &a) == BLZ_OK);
+	CHECK(async_wait(ctx, &a, 2) && a.ret == BLZ_OK);
+	CHECK(ch->chan == NULL && !ch->notify_started);
+
+	/* a failed start is reported and stops the handle */
+	memset(&a, 0, sizeof(a));
+	CHECK(blz_char_notify_start_async(fail, async_notify, &a, async_done, &a)
+		  == BLZ_OK);
+	CHECK(async_wait(ctx, &a, 1) && a.ret == BLZ_ERR);
+	CHECK(fail->chan == NULL && !fail->notify_started);
+
+	/* stopped while the start is in flight, a second start waits too */
+	memset(&a, 0, sizeof(a));
+	CHECK(blz_char_notify_start_async(ch, async_notify, &a, async_done, &a)
+		  == BLZ_OK);
+	CHECK(blz_char_notify_start_async(ch, async_notify, &b, async_done, &b)
+		  == BLZ_OK);
+	CHECK(a.done == 0 && b.done == 0);
+	CHECK(blz_char_notify_stop_async(ch, async_done, &a) == BLZ_OK);
+	CHECK(a.done == 1 && a.ret == BLZ_ERR && b.done == 1 && b.ret == BLZ_ERR);
+	CHECK(async_wait(ctx, &a, 2) && a.ret == BLZ_OK);
+	CHECK(ch->chan == NULL && !ch->notify_started);
+
+	/* outside of handlers again */
+	s.read_len = sizeof(s.read_buf);
+	CHECK(blz_char_read(ch, s.read_buf, &s.read_len) == BLZ_OK
+		  && s.read_buf[0] == READ_VALUE);
+
+	blz_char_free(ch);
+	blz_char_free(s.slow);
+	blz_char_free(j.slow);
+	blz_char_free(fail);
+	dev->connected = false;
+	blz_disconnect(dev);
+	blz_fini(ctx);
+	waitpid(pid, &status, 0);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	return test_result("gatt");
+}
@@ -0,0 +1,115 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Notification history test
+ *
+ * More entries than the capacity are added so the ring wraps, then time
+ * ranges and downsampled windows are checked against the values known to
+ * be kept.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "test.h"
+
+#define CAP	   8
+#define STRIDE 4
+#define ADDED  21
+
+/* entry i at ts 100 + 10 * i: s16 -i at 0, u8 i at 2, 3 to 5 bytes long */
+static void add(blz_char* ch, int i)
+{
+	uint8_t buf[8];
+	int16_t v = -i;
+
+	memset(buf, 0xee, sizeof(buf));
+	buf[0] = (uint16_t)v & 0xff;
+	buf[1] = (uint16_t)v >> 8;
+	buf[2] = i;
+	hist_add(ch->hist, 100 + 10 * i, buf, 3 + i % 3);
+}
+
+int main(void)
+{
+	blz_char ch;
+	uint64_t ts[CAP + 1];
+	uint8_t data[(CAP + 1) * STRIDE];
+	size_t lens[CAP + 1];
+	struct blz_hist_stat st[4];
+	size_t n;
+
+	memset(&ch, 0, sizeof(ch));
+	CHECK(blz_char_history_enable(&ch, CAP, 0) == BLZ_ERR_INVALID_PARAM);
+	CHECK(blz_char_history_enable(&ch, CAP, STRIDE) == BLZ_OK);
+
+	for (int i = 0; i < ADDED; i++) {
+		add(&ch, i);
+	}
+	CHECK(blz_char_history_len(&ch) == CAP);
+
+	/* everything: the last CAP entries, oldest first across the wrap */
+	n = blz_char_history_range(&ch, 0, UINT64_MAX, ts, data, lens, CAP + 1);
+	CHECK(n == CAP);
+	for (size_t k = 0; k < n; k++) {
+		int i = ADDED - CAP + k;
+		uint8_t* d = data + k * STRIDE;
+		size_t len = 3 + i % 3;
+		CHECK(ts[k] == 100 + 10 * i);
+		CHECK(lens[k] == len);
+		CHECK(d[0] == (uint8_t)-i && d[1] == 0xff && d[2] == i);
+		/* zero padded or truncated to the stride */
+		CHECK(d[3] == (len == 3 ? 0 : 0xee));
+	}
+
+	/* from <= ts < to, limited to max, NULL columns */
+	n = blz_char_history_range(&ch, 235, 270, ts, NULL, NULL, CAP);
+	CHECK(n == 3 && ts[0] == 240 && ts[2] == 260);
+	n = blz_char_history_range(&ch, 240, 300, ts, NULL, NULL, 2);
+	CHECK(n == 2 && ts[0] == 240 && ts[1] == 250);
+	CHECK(blz_char_history_range(&ch, 0, 230, ts, NULL, NULL, CAP) == 0);
+	CHECK(blz_char_history_range(&ch, 301, 400, ts, NULL, NULL, CAP) == 0);
+	CHECK(blz_char_history_range(&ch, 250, 250, ts, NULL, NULL, CAP) == 0);
+
+	/* timestamps going back are clamped, so lookups stay ordered */
+	add(&ch, ADDED);
+	hist_add(ch.hist, 50, "\x05\x00\x07", 3);
+	n = blz_char_history_range(&ch, 0, UINT64_MAX, ts, NULL, lens, CAP);
+	CHECK(n == CAP && ts[CAP - 1] == 100 + 10 * ADDED
+		  && ts[CAP - 2] == ts[CAP - 1] && lens[CAP - 1] == 3);
+
+	/* windows of 40 ns from 225: entries at 250, 260 | 270..300 | 310 twice
+	 * | nothing. Values at 0 are s16 -i, the clamped one is 5 */
+	CHECK(blz_char_history_downsample(&ch, 225, 40, 0, BLZ_HIST_S16, st, 4)
+		  == BLZ_OK);
+	CHECK(st[0].start == 225 && st[0].count == 2);
+	CHECK(st[0].min == -16 && st[0].max == -15 && st[0].mean == -15.5);
+	CHECK(st[1].start == 265 && st[1].count == 4);
+	CHECK(st[1].min == -20 && st[1].max == -17 && st[1].mean == -18.5);
+	CHECK(st[2].count == 2 && st[2].min == -21 && st[2].max == 5);
+	CHECK(st[3].start == 345 && st[3].count == 0 && st[3].mean == 0);
+
+	/* u8 at 2 */
+	CHECK(blz_char_history_downsample(&ch, 230, 100, 2, BLZ_HIST_U8, st, 1)
+		  == BLZ_OK);
+	CHECK(st[0].count == 8 && st[0].min == 7 && st[0].max == 21);
+
+	/* the field has to be within the stride */
+	CHECK(blz_char_history_downsample(&ch, 0, 10, 2, BLZ_HIST_U32, st, 1)
+		  == BLZ_ERR_INVALID_PARAM);
+	CHECK(blz_char_history_downsample(&ch, 0, 0, 0, BLZ_HIST_U8, st, 1)
+		  == BLZ_ERR_INVALID_PARAM);
+
+	CHECK(blz_char_history_enable(&ch, 0, 0) == BLZ_OK);
+	CHECK(ch.hist == NULL && blz_char_history_len(&ch) == 0);
+
+	return test_result("hist");
+}
@@ -0,0 +1,136 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * blzd shared memory ring test
+ *
+ * Records of varying length are pushed into a small ring and consumed in
+ * bursts, so the ring wraps many times at different positions and PAD
+ * records fill its end. Every record has to come out once, in order and
+ * intact, a full ring has to drop and corrupted records must not be read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blzd_proto.h"
+#include "test.h"
+
+#define RING_SIZE 256
+#define RECORDS	  5000
+
+struct test_hdr {
+	uint32_t seq;
+	uint32_t dlen;
+};
+
+/* 0 to 40 bytes of data, some making the records end exactly at the end */
+static size_t rec_dlen(uint32_t seq)
+{
+	return (seq * 7) % 41;
+}
+
+static bool push(struct blzd_ring_ref* rr, uint32_t seq, bool* was_empty)
+{
+	struct test_hdr h = {.seq = seq, .dlen = rec_dlen(seq)};
+	uint8_t data[64];
+
+	for (size_t i = 0; i < h.dlen; i++) {
+		data[i] = seq + i;
+	}
+	return blzd_ring_push(rr, BLZD_EV_NOTIFY, &h, sizeof(h), data, h.dlen,
+						  was_empty);
+}
+
+/* returns false when the ring is empty */
+static bool pop(struct blzd_ring_ref* rr, uint32_t expect)
+{
+	const uint8_t* p;
+	struct test_hdr h;
+	uint16_t type;
+	uint32_t len;
+
+	p = blzd_ring_peek(rr, &type, &len);
+	if (p == NULL) {
+		return false;
+	}
+	memcpy(&h, p, sizeof(h));
+	CHECK(type == BLZD_EV_NOTIFY);
+	CHECK(h.seq == expect && h.dlen == rec_dlen(expect));
+	CHECK(len == sizeof(h) + h.dlen);
+	for (size_t i = 0; i < h.dlen && i < len - sizeof(h); i++) {
+		CHECK(p[sizeof(h) + i] == (uint8_t)(expect + i));
+	}
+	blzd_ring_consume(rr, len);
+	return true;
+}
+
+int main(void)
+{
+	size_t size = BLZD_SHM_DATA_OFF + RING_SIZE;
+	struct blzd_shm* shm = aligned_alloc(64, (size + 63) & ~(size_t)63);
+	struct blzd_ring_ref rr;
+	uint32_t pushed = 0;
+	uint32_t popped = 0;
+	uint32_t drops = 0;
+	uint64_t wraps;
+	struct blzd_rec rec;
+	uint32_t pos;
+	bool was_empty;
+
+	memset(shm, 0, size);
+	blzd_ring_ref_init(&rr, shm, &shm->ev, BLZD_SHM_DATA_OFF, RING_SIZE);
+
+	CHECK(blzd_ring_peek(&rr, &(uint16_t){0}, &(uint32_t){0}) == NULL);
+	CHECK(push(&rr, 0, &was_empty) && was_empty);
+	CHECK(push(&rr, 1, &was_empty) && !was_empty);
+	CHECK(pop(&rr, 0) && pop(&rr, 1) && !pop(&rr, 2));
+	pushed = popped = 2;
+
+	/* bursts of up to 9 pushes, then up to 5 pops, until all are through */
+	for (uint32_t round = 0; popped < RECORDS; round++) {
+		if (round > 10 * RECORDS) {
+			CHECK(!"records get stuck");
+			break;
+		}
+		for (uint32_t i = 0; i < round % 10 && pushed < RECORDS; i++) {
+			if (!push(&rr, pushed, &was_empty)) {
+				drops++;
+				break;
+			}
+			CHECK(was_empty == (pushed == popped));
+			pushed++;
+		}
+		for (uint32_t i = 0; i < round % 6 && popped < pushed; i++) {
+			CHECK(pop(&rr, popped));
+			popped++;
+		}
+	}
+	CHECK(!pop(&rr, popped));
+
+	/* every drop was counted, and none was lost otherwise */
+	wraps = atomic_load(&shm->ev.head) / RING_SIZE;
+	CHECK(drops > 0 && atomic_load(&shm->ev.dropped) == drops);
+	CHECK(wraps > 100);
+
+	/* too large for the ring at all */
+	CHECK(!blzd_ring_push(&rr, BLZD_EV_NOTIFY, shm, RING_SIZE, NULL, 0,
+						  &was_empty));
+
+	/* a record claiming to be longer than what was published is not read */
+	CHECK(push(&rr, 7, &was_empty));
+	pos = atomic_load(&shm->ev.tail) & (RING_SIZE - 1);
+	memcpy(&rec, rr.data + pos, sizeof(rec));
+	rec.len += 8;
+	memcpy(rr.data + pos, &rec, sizeof(rec));
+	CHECK(blzd_ring_peek(&rr, &(uint16_t){0}, &(uint32_t){0}) == NULL);
+
+	free(shm);
+
+	return test_result("ring");
+}
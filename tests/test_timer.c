@@ -0,0 +1,157 @@
+/*
+ * blzlib - Copyright (C) 2019-2022 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Timer wheel test
+ *
+ * Timers spread over all levels are run by stepping the wheel to the time
+ * timer_next() returns, like the event loop does. Every timer has to fire
+ * exactly at its tick after cascading down, and timer_next() must never be
+ * later than the earliest deadline.
+ */
+
+#include <stdio.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_util.h"
+#include "test.h"
+
+#define MS		  1000000ULL
+#define TIMERS	  32
+#define START_MS  123456789ULL /* not aligned to any level */
+
+struct test_timer {
+	struct blz_timer t;
+	uint64_t expire; /* ns, as armed */
+	uint64_t fired;	 /* ns, wheel time when called, 0 never */
+	int calls;
+	struct test_timer* cancel; /* cancelled from the callback */
+	uint64_t rearm;			   /* ns after firing, 0 none */
+};
+
+static struct blz_timer_wheel tw;
+
+static void test_cb(struct blz_timer* t, void* user)
+{
+	struct test_timer* tt = user;
+
+	tt->fired = tw.now * TIMER_TICK_NS;
+	tt->calls++;
+	if (tt->cancel != NULL) {
+		timer_cancel(&tt->cancel->t);
+	}
+	if (tt->rearm != 0) {
+		tt->expire = tt->fired + tt->rearm;
+		tt->rearm = 0;
+		tt->fired = 0;
+		timer_arm(&tw, &tt->t, tt->expire);
+	}
+}
+
+static uint64_t tick_ns(uint64_t ns)
+{
+	return (ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS * TIMER_TICK_NS;
+}
+
+/* the tick a timer is due, expired ones on the next tick of the wheel */
+static uint64_t due(const struct test_timer* tt, uint64_t armed_at)
+{
+	return tick_ns(MAX(tt->expire, armed_at + TIMER_TICK_NS));
+}
+
+/* earliest deadline of the armed timers */
+static uint64_t earliest(struct test_timer* tt, int n, uint64_t armed_at)
+{
+	uint64_t best = TIMER_NONE;
+
+	for (int i = 0; i < n; i++) {
+		if (timer_armed(&tt[i].t) && due(&tt[i], armed_at) < best) {
+			best = due(&tt[i], armed_at);
+		}
+	}
+	return best;
+}
+
+int main(void)
+{
+	static const uint64_t offs_ms[TIMERS] = {
+		0,		 1,		   2,		 63,	   64,		 65,	 100,
+		4095,	 4096,	   4097,	 5000,	   262143,	 262144, 262145,
+		300001,	 1 << 24,  16777217, 1 << 30,  1 << 30,	 7,		 7,
+		7,		 64 * 64,  999999,	 12345678, 1ULL << 36, 1ULL << 37,
+		40,		 40,	   41,		 2,		   3,
+	};
+	struct test_timer tt[TIMERS] = {0};
+	uint64_t start = START_MS * MS;
+	uint64_t next;
+	int steps = 0;
+
+	timer_wheel_init(&tw, start);
+	CHECK(timer_next(&tw) == TIMER_NONE);
+
+	for (int i = 0; i < TIMERS; i++) {
+		timer_init(&tt[i].t, test_cb, &tt[i]);
+		tt[i].expire = start + offs_ms[i] * MS;
+	}
+	/* not on a tick, rounded up */
+	tt[2].expire += MS / 2;
+	/* due in the same tick: the first cancels the last */
+	tt[19].cancel = &tt[21];
+	/* re-armed from its callback */
+	tt[27].rearm = 4100 * MS;
+	/* cancelled and armed again before running */
+	tt[30].expire = start + 50 * MS;
+
+	for (int i = 0; i < TIMERS; i++) {
+		timer_arm(&tw, &tt[i].t, tt[i].expire);
+	}
+	timer_cancel(&tt[31].t);
+	timer_arm(&tw, &tt[30].t, tt[30].expire);
+	CHECK(tw.count == TIMERS - 1);
+
+	/* what the loop does: sleep until timer_next(), then run */
+	while ((next = timer_next(&tw)) != TIMER_NONE) {
+		CHECK(next <= earliest(tt, TIMERS, start));
+		CHECK(next > tw.now * TIMER_TICK_NS);
+		timer_run(&tw, next);
+		if (++steps > 100000) {
+			CHECK(!"timer_next() makes no progress");
+			break;
+		}
+	}
+	CHECK(tw.count == 0);
+
+	for (int i = 0; i < TIMERS; i++) {
+		if (i == 21 || i == 31) {
+			CHECK(tt[i].calls == 0);
+			continue;
+		}
+		if (tt[i].calls != (i == 27 ? 2 : 1)
+			|| tt[i].fired != due(&tt[i], start)) {
+			fprintf(stderr, "timer %d (+%llu ms): %d calls, at +%lld ns\n", i,
+					(unsigned long long)offs_ms[i], tt[i].calls,
+					(long long)(tt[i].fired - tt[i].expire));
+			failed++;
+		}
+	}
+
+	/* running in big steps fires everything that is due */
+	for (int i = 0; i < 4; i++) {
+		tt[i].calls = 0;
+		tt[i].expire = tw.now * TIMER_TICK_NS + offs_ms[i + 4] * MS;
+		timer_arm(&tw, &tt[i].t, tt[i].expire);
+	}
+	timer_run(&tw, tw.now * TIMER_TICK_NS + 10000 * MS);
+	for (int i = 0; i < 4; i++) {
+		CHECK(tt[i].calls == 1);
+	}
+	CHECK(timer_next(&tw) == TIMER_NONE);
+
+	return test_result("timer");
+}